@@ -0,0 +1,45 @@
+#ifndef HH_APU_HH
+#define HH_APU_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// The DMA sound output is resampled at 32768 Hz, one sample every 512 cycles
+#define APU_SAMPLE_RATE         32768
+#define APU_CYCLES_PER_SAMPLE   512
+
+// Stereo frames kept until the frontend takes them (about 62 ms)
+#define APU_BUFFER_FRAMES       2048
+
+#define APU_FIFO_SIZE           32
+
+
+typedef struct
+{
+  int8_t data[APU_FIFO_SIZE];
+  uint8_t read;
+  uint8_t count;
+  int8_t sample;      // what the channel is playing right now
+} apu_fifo;
+
+typedef struct
+{
+  apu_fifo fifo[2];   // Direct Sound A and B
+} apu_state;
+
+
+void apu_init();
+
+// SOUNDCNT_H and FIFO_A / FIFO_B writes, from the I/O module
+void apu_write_control(uint16_t value);
+void apu_write_fifo(uint8_t fifo, uint16_t value);
+
+// A timer overflowed: the FIFOs clocked by it play their next sample
+void apu_timer_overflow(uint8_t timer);
+
+// Moves up to max interleaved stereo frames out of the output buffer
+uint32_t apu_take_samples(int16_t *out, uint32_t max);
+
+
+#endif
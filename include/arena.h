@@ -0,0 +1,65 @@
+#ifndef HH_ARENA_HH
+#define HH_ARENA_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cpu.h"
+#include "bus.h"
+#include "io.h"
+#include "dma.h"
+#include "emulator.h"
+#include "backup.h"
+#include "apu.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "ppu.h"
+
+
+// A huge page: the arena is aligned on it so the whole guest state can be
+// backed by a single TLB entry
+#define ARENA_ALIGNMENT 0x200000
+
+
+// Every piece of mutable guest state in one contiguous block, so that a save
+// state or a clone of the running instance is a single memcpy. The ROM and
+// the BIOS are not part of it: they are read only file mappings (see
+// cartridge.c and bios.c), and neither is the backup memory, which is the
+// mapped save file (backup.c).
+typedef struct
+{
+  // Guest memory
+  uint8_t on_board_wram[262144];    // 256  KB
+  uint8_t on_chip_wram[32768];      // 32   KB
+  uint8_t vram[98304];              // 96   KB
+  uint8_t bg_obj_pram[1024];        // 1    KB
+  uint8_t oam[1024];                // 1    KB
+  uint8_t io_regs[IO_SIZE];         // 1    KB
+
+  // CPU and hardware state
+  cpu_context cpu;
+  emu_context emu;
+  dma_channel dma[4];
+  timer_channel timer[4];
+  affine_reference affine[2];       // BG2 and BG3
+  prefetch_buffer prefetch;
+  uint8_t access_cycles[2][2][16];
+  dirty_bitmaps stale;              // what the renderer's copy lacks
+  backup_state backup;
+  apu_state apu;
+  scheduler scheduler;
+} gba_arena;
+
+extern gba_arena arena;
+
+
+void arena_init();
+
+// Save states: the buffer must be at least arena_size() bytes
+size_t arena_size();
+void arena_save(void *buffer);
+void arena_load(const void *buffer);
+
+
+#endif
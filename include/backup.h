@@ -0,0 +1,58 @@
+#ifndef HH_BACKUP_HH
+#define HH_BACKUP_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef enum
+{
+  BACKUP_NONE,
+  BACKUP_SRAM,          // 32 KB
+  BACKUP_FLASH_64K,
+  BACKUP_FLASH_128K,
+  BACKUP_EEPROM         // 512 B or 8 KB, told apart by the first DMA
+} backup_type;
+
+
+// Emulated chip state (the data itself is the mapped save file)
+typedef struct
+{
+  uint8_t type;
+
+  uint8_t flash_state;
+  bool flash_id_mode;
+  bool flash_erase;
+  uint32_t flash_bank;
+
+  uint8_t eeprom_state;
+  uint8_t eeprom_address_bits;      // 6 or 14, 0 while unknown
+  uint8_t eeprom_count;             // bits received / sent in this state
+  uint16_t eeprom_address;
+  uint64_t eeprom_buffer;
+} backup_state;
+
+
+// The save file is mapped shared: writes land in the page cache and the
+// kernel writes them back, the emulation never waits for the disk. False
+// when the file cannot be used: the game then gets backup memory that is
+// not saved.
+bool backup_init(backup_type type, const char *save_path, uint32_t rom_size);
+void backup_destroy();
+
+// Optional: flush dirty pages every interval_ms from a background thread.
+// False when the thread could not be started.
+bool backup_start_sync(uint32_t interval_ms);
+
+// 0E000000-0E00FFFF
+uint8_t backup_read_byte(uint32_t address);
+void backup_write_byte(uint32_t address, uint8_t value);
+
+// EEPROM is a serial device on the upper Game Pak ROM area
+bool backup_is_eeprom(uint32_t address);
+uint16_t backup_eeprom_read();
+void backup_eeprom_write(uint16_t value);
+void backup_eeprom_dma(uint32_t count);
+
+
+#endif
@@ -6,6 +6,20 @@
 
 
 bool load_bios(char *file_name);
+bool bios_is_builtin();
+void bios_post_boot_state();
+
+
+// High level emulation of the SWIs the built-in BIOS has no code for
+typedef enum
+{
+  SWI_DONE,         // handled, carry on with the next instruction
+  SWI_RETRY,        // the CPU halted: run the SWI again once it wakes up
+  SWI_NOT_HLE       // take the SWI exception
+} swi_result;
+
+swi_result bios_hle_swi(uint8_t number);
+
 uint8_t bios_read_byte(uint32_t address);
 uint16_t bios_read_halfword(uint32_t address);
 uint32_t bios_read_word(uint32_t address);
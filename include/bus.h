@@ -4,6 +4,37 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Dirty bitmaps: one bit per 32 byte tile of VRAM, per palette entry and per
+// OAM entry. Set by every write, consumed by the render queue.
+#define VRAM_DIRTY_WORDS  (98304 / 32 / 64)
+#define PRAM_DIRTY_WORDS  (1024 / 2 / 64)
+#define OAM_DIRTY_WORDS   (1024 / 8 / 64)
+
+typedef struct
+{
+  uint64_t tiles[VRAM_DIRTY_WORDS];
+  uint64_t palette[PRAM_DIRTY_WORDS];
+  uint64_t oam[OAM_DIRTY_WORDS];
+} dirty_bitmaps;
+
+
+// The prefetch buffer is not simulated access by access: it is a stream of
+// halfwords where the next one to be handed out becomes available at the
+// timestamp 'ready'. Whatever the CPU does in between (internal cycles,
+// accesses to other regions) lets the stream run ahead for free, up to the
+// 8 halfwords the buffer can hold, and is only accounted for when the next
+// ROM access happens.
+typedef struct
+{
+  uint32_t address;     // next halfword the buffer will hand out
+  int64_t ready;        // cycle at which it is (or will be) available
+  int64_t mask;         // all ones when the buffer is enabled, 0 otherwise
+} prefetch_buffer;
+
+
+void bus_init();
+void bus_update_waitcnt(uint16_t waitcnt);
+
 uint8_t bus_read(uint32_t address);
 void bus_write(uint32_t address, uint8_t value);
 
@@ -13,4 +44,8 @@ void bus_write_halfword(uint32_t address, uint16_t value);
 uint32_t bus_read_word(uint32_t address);
 void bus_write_word(uint32_t address, uint32_t value);
 
+uint32_t bus_access_cycles(uint32_t address, bool word, bool sequential);
+uint8_t *bus_host_pointer(uint32_t address, uint32_t length, bool write);
+
+
 #endif
\ No newline at end of file
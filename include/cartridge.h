@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "detect.h"
+
 
 typedef struct
 {
@@ -23,6 +25,9 @@ typedef struct
 
 bool load_cartridge(char *file_name);
 void dealloc_cartridge();
+uint8_t *cartridge_rom_data();
+uint32_t cartridge_rom_size();
+const cartridge_features *cartridge_get_features();
 uint8_t cartridge_read_byte(uint32_t address);
 void cartridge_write_byte(uint32_t address, uint8_t value);
 
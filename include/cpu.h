@@ -74,11 +74,52 @@ typedef struct cpu_context
 
   void (*function)(struct cpu_context *);
   void (*thumb_function)(struct cpu_context *);
+
+  // Real instructions in the pipeline (0-2): after a flush the next one to
+  // execute is at the PC, not two instructions behind it
+  uint8_t pipeline_depth;
+
+  // Halt / Stop: nothing runs until one of the wake_mask interrupts is
+  // both enabled and requested
+  bool halted;
+  bool intr_wait;         // an HLE IntrWait is in progress
+  uint16_t wake_mask;
 } cpu_context;
 
-void cpu_init();
+
+// HALTCNT modes: Halt wakes on any interrupt, Stop only on these
+#define CPU_WAKE_HALT 0x3FFF
+#define CPU_WAKE_STOP 0x3080
+
+// The per-instruction trace (disassembly, PC, registers) is only built with
+// -DCPU_TRACE: printing it costs far more than executing the instructions
+#ifdef CPU_TRACE
+#define TRACE(...) printf(__VA_ARGS__)
+#else
+#define TRACE(...) ((void)0)
+#endif
+
+#define CPU_NO_BREAKPOINT 0xFFFFFFFF
+
+void cpu_init(bool skip_bios);
+
+// Points the banked registers, the SPSR and the decoded instruction handlers
+// back at a cpu_context that was copied in (a loaded save state)
+void cpu_rebuild();
+
+// False when the step left the PC on the breakpoint
 bool cpu_step();
 
+// Stops cpu_step when the PC register reaches address (it runs two
+// instructions ahead of the one executing, as the pipeline has it).
+// CPU_NO_BREAKPOINT for none, the default.
+void cpu_set_breakpoint(uint32_t address);
+
+// Enters the IRQ handler, unless the CPSR I bit masks it
+bool cpu_raise_irq();
+
+void cpu_halt(uint16_t wake_mask);
+
 void cpu_print_failed_test();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef HH_DETECT_HH
+#define HH_DETECT_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "backup.h"
+
+
+// Extra hardware on the Game Pak
+#define CART_FEATURE_RTC            0x1
+#define CART_FEATURE_TILT           0x2
+#define CART_FEATURE_LIGHT_SENSOR   0x4
+
+
+typedef struct
+{
+  backup_type backup;
+  uint32_t features;
+  bool overridden;            // found in the known games table
+  double elapsed_ms;
+} cartridge_features;
+
+
+// Looks the game code up in the overrides table first, then scans the ROM
+// for the library ID strings the Nintendo SDK links in. Without either, the
+// backup is SRAM.
+void detect_cartridge_features(const uint8_t *rom, uint32_t size,
+  const uint8_t game_code[4], cartridge_features *features);
+
+const char *detect_backup_name(backup_type type);
+
+
+#endif
@@ -2,34 +2,45 @@
 #define HH_DISPLAY_HH
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <SDL3/SDL.h>
 
-#define GBA_WIDTH   240
-#define GBA_HEIGHT  160
+#include "frame_swap.h"
 
 
+// The window, on a thread of its own. The emulator hands the pictures over
+// through a frame_swap and never waits for it; the window shows the newest
+// one at each refresh.
 typedef struct Display
 {
   SDL_Thread *thread;
-  SDL_Window *window;
-  SDL_Mutex *mutex;
-  uint8_t running;
-  uint8_t refresh;
-
-  // Just for now, before I implement frame buffer
-  struct
-  {
-    uint8_t red;
-    uint8_t green;
-    uint8_t blue;
-  } color;
-  
+  const char *title;
+  uint8_t scale;
+  double refresh_hz;              // of the screen the window opens on
+  atomic_bool running;            // until the window is closed
+  atomic_bool vsync;              // presenting waits for the refresh
+  SDL_Semaphore *presented;       // posted after each picture shown
+
+  frame_swap frames;
 } Display;
 
-void display_init(Display *display, char *title, uint8_t scale);
-void display_update(Display *display, int i);
-void display_destroy(Display *display);
+bool display_init(Display *display, const char *title, uint8_t scale);
+bool display_running(Display *display);
+
+// Where the emulator draws the next picture, then hands it over and gets
+// the buffer for the one after
+uint32_t *display_back_buffer(Display *display);
+uint32_t *display_present(Display *display);
 
+// Waits until the window has shown the picture handed over, which happens
+// at the screen's refresh. False without vsync, or when nothing was shown
+// for DISPLAY_WAIT_MS (the window is closing or hidden).
+#define DISPLAY_WAIT_MS 100
+bool display_wait_refresh(Display *display);
+
+// Closes the window and waits for its thread
+void display_destroy(Display *display);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,38 @@
+#ifndef HH_DMA_HH
+#define HH_DMA_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// DMAxCNT_H start timing
+#define DMA_TIMING_IMMEDIATE  0
+#define DMA_TIMING_VBLANK     1
+#define DMA_TIMING_HBLANK     2
+#define DMA_TIMING_SPECIAL    3
+
+
+typedef struct
+{
+  // Internal registers, latched when the channel gets enabled
+  uint32_t source;
+  uint32_t destination;
+  uint32_t count;
+
+  bool pending;       // immediate transfer waiting for its start event
+} dma_channel;
+
+
+void dma_init();
+
+// Called by the I/O module on every write to DMAxCNT_H
+void dma_write_control(uint8_t channel, uint16_t old, uint16_t value);
+
+// Start conditions raised by the other hardware blocks
+void dma_on_vblank();
+void dma_on_hblank();
+void dma_on_fifo(uint8_t fifo);
+void dma_on_video_capture(uint16_t line);
+
+
+#endif
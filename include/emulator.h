@@ -3,18 +3,53 @@
 
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 typedef struct
 {
   bool paused;
   bool running;
-  uint64_t ticks;
+  uint64_t ticks;       // instructions executed
+  uint64_t cycles;      // master clock
+  uint64_t frames;
+  uint64_t frame_end;   // cycle budget of the frame being run
 } emu_context;
 
-int emu_run(int argc, char **argv);
+
+typedef enum
+{
+  EMU_FRAME_DONE,       // the whole cycle budget was run
+  EMU_BREAKPOINT        // the PC reached the breakpoint (--break)
+} emu_status;
+
+// What one call to emu_run_frame(s) produced. The pointers stay valid until
+// the next call.
+typedef struct
+{
+  const uint32_t *framebuffer;    // SCREEN_WIDTH x SCREEN_HEIGHT ARGB8888
+  const int16_t *audio;           // interleaved stereo, APU_SAMPLE_RATE Hz
+  uint32_t audio_frames;
+  uint64_t frame;                 // frames completed so far
+  emu_status status;
+} emu_frame;
+
+// One video frame: 228 lines of 1232 cycles
+#define EMU_CYCLES_PER_FRAME 280896
+
+// emu_run_frames runs at most this many frames per call, so that all of
+// their audio fits in the returned buffer. frame tells how far it got.
+#define EMU_MAX_RUN_FRAMES 16
+
+
+// Core API, no frontend needed
+bool emu_init(char *rom_path, char *bios_path, bool boot_bios);
+void emu_shutdown();
+
+emu_frame emu_run_frame();
+emu_frame emu_run_frames(uint32_t count);
 
 emu_context *emu_get_context();
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,20 @@
+#ifndef HH_FRAME_HASH_HH
+#define HH_FRAME_HASH_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// A fast 64 bit hash for whole frames and audio blocks, built like XXH3's
+// long input path: 64 byte stripes into 8 accumulators, scrambled every
+// kilobyte. Not XXH3 itself, but every kernel (scalar, SSE2, AVX2) gives
+// the same value on every host, so hash logs compare across machines.
+void frame_hash_init();
+
+uint64_t frame_hash(const void *data, size_t size);
+
+// Throughput of each kernel on a frame, checked against the scalar one
+void frame_hash_benchmark();
+
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef HH_FRAME_SWAP_HH
+#define HH_FRAME_SWAP_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "ppu.h"
+
+
+// Triple buffered pictures between one producer (the emulator) and one
+// consumer (the display). Each side owns a buffer; the third one is
+// swapped in and out with a single atomic exchange, so neither side ever
+// waits for the other and the consumer always gets the newest picture.
+typedef struct
+{
+  uint32_t pixels[3][SCREEN_WIDTH * SCREEN_HEIGHT];
+  uint8_t back;                   // the producer's
+  uint8_t front;                  // the consumer's
+
+  // Index of the spare buffer, with FRAME_SWAP_FRESH while it holds a
+  // picture the consumer has not taken yet
+  _Alignas(64) atomic_uint spare;
+} frame_swap;
+
+#define FRAME_SWAP_FRESH  4
+
+
+void frame_swap_init(frame_swap *s);
+
+// Producer: the buffer to draw the next picture in, then hand it over and
+// get the next one. A picture the consumer did not take is dropped.
+uint32_t *frame_swap_back(frame_swap *s);
+uint32_t *frame_swap_publish(frame_swap *s);
+
+// Consumer: the newest picture, or NULL when there is none since the last
+// call. Valid until the next call.
+const uint32_t *frame_swap_take(frame_swap *s);
+
+
+#endif
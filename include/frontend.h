@@ -0,0 +1,11 @@
+#ifndef HH_FRONTEND_HH
+#define HH_FRONTEND_HH
+
+#include "options.h"
+
+
+// The SDL application: window, audio, main loop
+int emu_run(const options *o);
+
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef HH_HASH_LOG_HH
+#define HH_HASH_LOG_HH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "emulator.h"
+
+
+// A stream of per frame hashes of the picture and of the audio, for
+// comparing runs against a golden one without keeping any frame. Binary
+// (an 8 byte header, then 24 little endian bytes per frame) or, for a
+// file ending in .csv, one "frame,video,audio" line per frame in hex.
+typedef struct
+{
+  uint64_t frame;
+  uint64_t video;
+  uint64_t audio;
+} hash_record;
+
+typedef struct
+{
+  FILE *file;
+  bool csv;
+} hash_log;
+
+
+bool hash_log_open(hash_log *log, const char *path);
+void hash_log_frame(hash_log *log, const emu_frame *frame);
+void hash_log_close(hash_log *log);
+
+// Reads either format; false at the end
+bool hash_log_open_read(hash_log *log, const char *path);
+bool hash_log_read(hash_log *log, hash_record *record);
+
+// Prints the first frame where the two logs differ. 0 when they match, 1
+// when they diverge, -1 when one could not be read.
+int hash_log_compare(const char *path_a, const char *path_b);
+
+
+#endif
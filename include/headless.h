@@ -0,0 +1,24 @@
+#ifndef HH_HEADLESS_HH
+#define HH_HEADLESS_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "options.h"
+
+
+// Video output without SDL or a window: the PPU draws straight into a
+// SCREEN_WIDTH x SCREEN_HEIGHT ARGB8888 buffer the caller owns
+void headless_attach(uint32_t *pixels);
+void headless_detach();
+
+// A binary PPM of the buffer
+bool headless_write_ppm(const uint32_t *pixels, const char *path);
+
+// The frontend of machines without a display: runs --frames frames (or
+// until the game stops) as fast as the host goes, unless --speed says
+// otherwise
+int headless_run(const options *o);
+
+
+#endif
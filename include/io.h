@@ -0,0 +1,97 @@
+#ifndef HH_IO_HH
+#define HH_IO_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// I/O register offsets (relative to 0x04000000)
+#define REG_DISPCNT     0x000
+#define REG_DISPSTAT    0x004
+#define REG_VCOUNT      0x006
+#define REG_BG0CNT      0x008
+#define REG_BG2CNT      0x00C
+#define REG_BG0HOFS     0x010
+#define REG_BG0VOFS     0x012
+
+#define REG_BG2PA       0x020
+#define REG_BG2PD       0x026
+#define REG_BG2X        0x028
+#define REG_BG2Y        0x02C
+#define REG_BG3PA       0x030
+#define REG_BG3PD       0x036
+#define REG_BG3X        0x038
+#define REG_BG3Y        0x03C
+#define REG_WIN0H       0x040
+#define REG_WIN1H       0x042
+#define REG_WIN0V       0x044
+#define REG_WIN1V       0x046
+#define REG_WININ       0x048
+#define REG_WINOUT      0x04A
+#define REG_BLDCNT      0x050
+#define REG_BLDALPHA    0x052
+#define REG_BLDY        0x054
+
+#define REG_SOUNDCNT_H  0x082
+#define REG_SOUNDCNT_X  0x084
+#define REG_SOUNDBIAS   0x088
+#define REG_FIFO_A      0x0A0
+#define REG_FIFO_B      0x0A4
+
+#define REG_DMA0SAD     0x0B0
+#define REG_DMA0DAD     0x0B4
+#define REG_DMA0CNT_L   0x0B8
+#define REG_DMA0CNT_H   0x0BA
+#define REG_DMA3CNT_H   0x0DE
+#define DMA_REG_STRIDE  0x00C
+
+#define REG_TM0CNT_L    0x100
+#define REG_TM0CNT_H    0x102
+#define REG_TM3CNT_H    0x10E
+#define TIMER_REG_STRIDE 0x004
+
+#define REG_KEYINPUT    0x130
+#define REG_RCNT        0x134
+
+#define REG_IE          0x200
+#define REG_IF          0x202
+#define REG_WAITCNT     0x204
+#define REG_IME         0x208
+#define REG_POSTFLG     0x300
+#define REG_HALTCNT     0x301
+
+#define IO_SIZE         0x400
+
+
+// Interrupt sources (bit index in IE / IF)
+#define IRQ_VBLANK      0
+#define IRQ_HBLANK      1
+#define IRQ_VCOUNT      2
+#define IRQ_TIMER0      3
+#define IRQ_SERIAL      7
+#define IRQ_DMA0        8
+#define IRQ_KEYPAD      12
+#define IRQ_GAMEPAK     13
+
+
+void io_init();
+
+uint8_t io_read_byte(uint32_t address);
+uint16_t io_read_halfword(uint32_t address);
+uint32_t io_read_word(uint32_t address);
+
+void io_write_byte(uint32_t address, uint8_t value);
+void io_write_halfword(uint32_t address, uint16_t value);
+void io_write_word(uint32_t address, uint32_t value);
+
+// Raw register access for the hardware modules (no side effects)
+uint16_t io_get(uint32_t address);
+void io_set(uint32_t address, uint16_t value);
+
+void io_request_interrupt(uint8_t irq);
+
+// Schedules the IRQ delivery if IME, IE and IF allow it
+void io_check_interrupts();
+
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef HH_OPTIONS_HH
+#define HH_OPTIONS_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pacer.h"
+
+
+// The command line, the same for the SDL and the headless frontends
+typedef struct
+{
+  char *rom_path;
+  char *bios_path;
+  bool boot_bios;
+  uint32_t breakpoint;        // CPU_NO_BREAKPOINT for none
+  pace_mode pace;
+  double multiplier;
+  bool color_correction;
+  bool render_thread;
+  uint32_t render_bands;
+  uint32_t save_sync_ms;      // 0: the kernel writes the save back alone
+  bool bench_render;
+  bool headless;
+  uint64_t frames;            // headless: how many to run, 0 for no limit
+  char *screenshot;           // headless: PPM of the last frame
+  char *hash_log;             // per frame hashes of the picture and audio
+  char *hash_compare[2];      // two hash logs to compare, then exit
+} options;
+
+
+void options_parse(options *o, int argc, char **argv);
+
+// emu_init, then the rendering options
+bool options_start(const options *o);
+
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef HH_PACER_HH
+#define HH_PACER_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef enum
+{
+  PACE_UNTHROTTLED,     // as fast as the host goes
+  PACE_MULTIPLIER,      // N times the GBA frame rate
+  PACE_AUDIO,           // realtime, following the audio queue fill level
+  PACE_DISPLAY          // one frame per picture the window shows at vsync
+} pace_mode;
+
+
+typedef struct
+{
+  pace_mode mode;
+  double multiplier;
+  double refresh_hz;
+
+  // Audio sync: how many sample frames the output still has queued, and
+  // how many it should have
+  uint32_t (*audio_queued)(void *user);
+  void *audio_user;
+  uint32_t audio_target;
+
+  // Display sync: blocks until the window has shown the last picture, false
+  // when it cannot tell (no vsync), which falls back to a refresh_hz timer
+  bool (*wait_refresh)(void *user);
+  void *refresh_user;
+
+  uint64_t deadline;          // ns, CLOCK_MONOTONIC
+
+  // Effective speed, measured over windows of about half a second
+  uint64_t window_start;
+  uint64_t window_frames;
+  double speed;
+} pacer;
+
+
+void pacer_init(pacer *p, pace_mode mode, double multiplier);
+void pacer_set_audio(pacer *p, uint32_t (*queued)(void *user), void *user,
+  uint32_t target);
+void pacer_set_refresh(pacer *p, double hz);
+void pacer_set_display(pacer *p, bool (*wait)(void *user), void *user);
+
+// Call once per emulated frame: sleeps as long as the mode says
+void pacer_frame(pacer *p);
+
+// 1.0 is the speed of the real hardware
+double pacer_speed(const pacer *p);
+bool pacer_speed_updated(const pacer *p);
+
+const char *pacer_mode_name(pace_mode mode);
+
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef HH_PALETTE_HH
+#define HH_PALETTE_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Palette RAM as host pixels: 256 BG colors, then 256 OBJ colors
+#define PALETTE_ENTRIES 512
+
+
+void palette_init();
+
+// Approximates the colors of the GBA screen instead of the raw values. Not
+// while the render thread runs.
+void palette_set_correction(bool enabled);
+
+// Converts the entries the game wrote to since the last call
+void palette_sync();
+
+// Valid until the next sync
+const uint32_t *palette_colors();
+
+// BGR555 pixels of the direct color modes, through the global table
+void palette_direct(const uint16_t *src, uint32_t *dst, uint32_t count);
+
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HH_PPU_HH
+#define HH_PPU_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bus.h"
+#include "tile_cache.h"
+
+
+#define SCREEN_WIDTH          240
+#define SCREEN_HEIGHT         160
+
+// Display timing, in CPU cycles
+#define PPU_CYCLES_PER_LINE   1232
+#define PPU_HBLANK_START      1006
+#define PPU_VISIBLE_LINES     160
+#define PPU_TOTAL_LINES       228
+#define PPU_CYCLES_PER_FRAME  (PPU_CYCLES_PER_LINE * PPU_TOTAL_LINES)
+
+
+// Internal reference point of an affine BG, in 20.8 fixed point
+typedef struct
+{
+  int32_t x;
+  int32_t y;
+} affine_reference;
+
+
+void ppu_init();
+void ppu_end_frame();
+
+// Draws the lines on a thread of their own, behind the CPU. Only between
+// frames; false when the thread could not be started.
+bool ppu_set_render_thread(bool enabled);
+
+// Draws each frame in bands on a pool of threads (1 for none). Only between
+// frames; false when the pool could not be started.
+bool ppu_set_render_bands(uint32_t threads);
+
+// Draws into a SCREEN_WIDTH x SCREEN_HEIGHT buffer of the caller's from
+// the next line on, or into the PPU's own with NULL. Only between frames.
+void ppu_set_output(uint32_t *pixels);
+
+// Waits for the lines queued so far to be drawn
+void ppu_sync();
+
+// The last completed picture, SCREEN_WIDTH x SCREEN_HEIGHT ARGB8888. Valid
+// after a sync.
+const uint32_t *ppu_framebuffer();
+
+// Tile cache lookups of the last frame
+const tile_cache_stats *ppu_tile_cache_stats();
+
+
+#endif
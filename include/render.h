@@ -0,0 +1,189 @@
+#ifndef HH_RENDER_HH
+#define HH_RENDER_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ppu.h"
+#include "bus.h"
+#include "io.h"
+
+
+// DISPCNT:
+//
+//  Bit   Expl.
+//  0-2   BG Mode                (0-5=Video Mode 0-5, 6-7=Prohibited)
+//  3     Reserved / CGB Mode    (0=GBA, 1=CGB; can be set only by BIOS opcodes)
+//  4     Display Frame Select   (0-1=Frame 0-1) (for BG Modes 4,5 only)
+//  5     H-Blank Interval Free  (1=Allow access to OAM during H-Blank)
+//  6     OBJ Character VRAM Mapping (0=Two dimensional, 1=One dimensional)
+//  7     Forced Blank           (1=Allow FAST access to VRAM,Palette,OAM)
+//  8     Screen Display BG0  (0=Off, 1=On)
+//  9     Screen Display BG1  (0=Off, 1=On)
+//  10    Screen Display BG2  (0=Off, 1=On)
+//  11    Screen Display BG3  (0=Off, 1=On)
+//  12    Screen Display OBJ  (0=Off, 1=On)
+//  13    Window 0 Display Flag   (0=Off, 1=On)
+//  14    Window 1 Display Flag   (0=Off, 1=On)
+//  15    OBJ Window Display Flag (0=Off, 1=On)
+
+#define DISPCNT_MODE(dispcnt)   ((dispcnt) & 0x7)
+#define DISPCNT_FRAME           0x0010
+#define DISPCNT_HBLANK_FREE     0x0020
+#define DISPCNT_OBJ_1D          0x0040
+#define DISPCNT_FORCED_BLANK    0x0080
+#define DISPCNT_BG(bg)          (0x0100 << (bg))
+#define DISPCNT_OBJ             0x1000
+#define DISPCNT_WIN0            0x2000
+#define DISPCNT_WIN1            0x4000
+#define DISPCNT_OBJ_WIN         0x8000
+
+
+// BGxCNT:
+//
+//  Bit   Expl.
+//  0-1   BG Priority           (0-3, 0=Highest)
+//  2-3   Character Base Block  (0-3, in units of 16 KBytes) (=BG Tile Data)
+//  4-5   Not used (must be zero)
+//  6     Mosaic                (0=Disable, 1=Enable)
+//  7     Colors/Palettes       (0=16/16, 1=256/1)
+//  8-12  Screen Base Block     (0-31, in units of 2 KBytes) (=BG Map Data)
+//  13    Display Area Overflow (0=Transparent, 1=Wraparound; BG2CNT/BG3CNT only)
+//  14-15 Screen Size (0-3)
+
+#define BGCNT_PRIORITY(control)     ((control) & 0x3)
+#define BGCNT_CHAR_BASE(control)    ((((control) >> 2) & 0x3) * 0x4000)
+#define BGCNT_256_COLORS            0x0080
+#define BGCNT_SCREEN_BASE(control)  ((((control) >> 8) & 0x1F) * 0x800)
+#define BGCNT_WRAPAROUND            0x2000
+#define BGCNT_SIZE(control)         (((control) >> 14) & 0x3)
+
+
+// Display registers a line is drawn with: DISPCNT up to BLDY
+#define RENDER_REGS_SIZE  (REG_BLDY + 2)
+
+// Everything a line is drawn from besides video memory, as it was at the
+// line's HBlank: the renderers never look at the live registers, so that
+// they can run behind the CPU (see render_queue.c)
+typedef struct
+{
+  uint16_t line;
+  uint16_t regs[RENDER_REGS_SIZE / 2];
+  affine_reference affine[2];       // BG2 and BG3
+} line_state;
+
+static inline uint16_t line_reg(const line_state *state, uint32_t address)
+{
+  return state->regs[address >> 1];
+}
+
+
+// The renderer's own copy of VRAM, PRAM and OAM, kept up to date a line at
+// a time by the render queue. The stale bitmaps tell the tile cache, the
+// palette and the OBJ lists what changed since they last looked.
+typedef struct
+{
+  uint8_t vram[98304];
+  uint8_t pram[1024];
+  uint8_t oam[1024];
+  dirty_bitmaps stale;
+} video_memory;
+
+extern video_memory video;
+
+
+// One line of one layer, as palette indices: 0 is transparent
+typedef uint8_t line_buffer[SCREEN_WIDTH];
+
+// One line of OBJs: the frontmost OBJ pixel at each position, as an index
+// into the OBJ palette (0 is transparent) with its priority and mode
+#define OBJ_PIXEL_PRIORITY  0x03
+#define OBJ_PIXEL_SEMI      0x04
+
+typedef struct
+{
+  uint8_t color[SCREEN_WIDTH];
+  uint8_t flags[SCREEN_WIDTH];
+  uint8_t window[SCREEN_WIDTH];   // 1 inside the OBJ window
+  bool semi;                      // some OBJ on the line is semi-transparent
+} obj_line_buffer;
+
+
+// Picks the kernels and empties the caches
+void render_init();
+
+// The whole line, layers, OBJs and effects, to ARGB8888
+void render_scanline(const line_state *state, uint32_t *out);
+
+// Brings the palette, the tile cache and the OBJ lists up to date with the
+// video memory copy. Each line does it first; when nothing changed since,
+// it only reads, so the bands of a frame can share them.
+void render_sync();
+
+// Lines of the same video memory drawn in bands of BAND_LINES, spread over
+// a fixed pool of threads (the caller is one of them). Only between frames.
+#define BAND_LINES          8
+#define BAND_MAX_THREADS    16
+
+bool render_bands_init(uint32_t threads);
+void render_bands_stop();
+uint32_t render_bands_threads();
+void render_bands_draw(const line_state *lines, uint32_t count,
+  uint32_t *framebuffer);
+void render_bands_benchmark();
+
+// Text (tiled, scrolling) backgrounds of modes 0-2
+void render_text_bg(const line_state *state, uint8_t bg, uint8_t *out);
+
+// Bitmap modes 3-5, straight to ARGB8888 with the best kernels the host has
+void render_bitmap_init();
+void render_bitmap_line(const line_state *state, uint32_t *out,
+  uint32_t backdrop);
+void render_bitmap_benchmark();
+
+// Whether BG2 of a bitmap mode has a pixel there, or lets the backdrop through
+bool render_bitmap_opaque(const line_state *state, uint16_t x);
+
+// BG2 of a bitmap mode as BGR555 colors, with bit 15 set where it is opaque
+void render_bitmap_colors(const line_state *state, uint16_t *out);
+
+// Affine BGs of modes 1 and 2, and the texture fetch of affine OBJs, with
+// the best kernels the host has
+typedef struct
+{
+  uint32_t tile;          // tile number of the top left corner
+  uint32_t width;
+  uint32_t height;
+  uint32_t row_shift;     // log2 of the tile numbers from a row to the next
+  uint32_t color256;      // 1 for 256 colors, 0 for 16
+  uint8_t palette;        // palette bank of a 16 color OBJ, already << 4
+} affine_obj;
+
+void render_affine_init();
+void render_affine_bg(const line_state *state, uint8_t bg, uint8_t *out);
+
+// The reference points in the arena, on the CPU side of the queue
+void render_affine_latch(uint8_t bg, bool y);
+void render_affine_next_line();
+
+// Colors (OBJ palette indices) of count pixels from texture coordinates x,
+// y, stepping by pa, pc. Up to 7 bytes past count may be written.
+void render_affine_obj(const affine_obj *obj, int32_t x, int32_t y,
+  int32_t pa, int32_t pc, uint32_t count, uint8_t *colors);
+
+// Regular and affine OBJs, within the OBJ unit's cycles for the line. The
+// per line lists are rebuilt by the sync after OAM writes.
+void render_obj_sync();
+void render_obj_line(const line_state *state, obj_line_buffer *out);
+
+// Windows and color effects. bg[n] is BGn as BGR555 colors with bit 15 set
+// where opaque, or NULL when it is off; obj is NULL when no OBJ was drawn.
+void render_compose_init();
+bool render_has_effects(const line_state *state, const obj_line_buffer *obj);
+void render_compose(const line_state *state, const uint16_t *bg[4],
+  const uint8_t priorities[4], const obj_line_buffer *obj, uint32_t *out);
+
+void render_convert_bgr555(const uint16_t *src, uint32_t *dst, uint32_t count);
+
+
+#endif
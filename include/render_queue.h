@@ -0,0 +1,39 @@
+#ifndef HH_RENDER_QUEUE_HH
+#define HH_RENDER_QUEUE_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tile_cache.h"
+
+
+// Hands the lines over from the CPU side to the renderer. At each HBlank
+// the display registers and the video memory written since the last line
+// go into a single producer, single consumer ring; the renderer applies
+// them to its own copy and draws the line. With the render thread running
+// that happens on another core, otherwise right away. With the band pool
+// (render_bands_init) the lines are kept until the frame ends, or until
+// video memory changes under them, and drawn in parallel.
+void render_queue_init();
+
+// Only with the queue drained, i.e. between frames
+bool render_queue_start_thread();
+void render_queue_stop_thread();
+bool render_queue_threaded();
+
+void render_queue_line(uint16_t line);
+void render_queue_frame();
+
+// Until everything queued so far is drawn
+void render_queue_wait();
+
+// Where the lines go from the next one on, NULL for the queue's own
+// framebuffer. Only with the queue drained.
+void render_queue_set_output(uint32_t *pixels);
+
+// What the renderer drew, valid after a wait
+const uint32_t *render_queue_framebuffer();
+const tile_cache_stats *render_queue_tile_stats();
+
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef HH_SCHEDULER_HH
+#define HH_SCHEDULER_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Every timed piece of hardware is an event with a deadline on the master
+// clock (arena.emu.cycles). The CPU runs freely until the earliest deadline,
+// so nothing gets ticked cycle by cycle.
+typedef enum
+{
+  EVENT_PPU_HBLANK,
+  EVENT_PPU_LINE,
+  EVENT_TIMER0,
+  EVENT_TIMER1,
+  EVENT_TIMER2,
+  EVENT_TIMER3,
+  EVENT_DMA,
+  EVENT_APU_SAMPLE,
+  EVENT_IRQ,
+  EVENT_COUNT
+} event_type;
+
+
+typedef struct
+{
+  uint64_t timestamp;
+  uint8_t type;
+} scheduled_event;
+
+// Binary min-heap; each event type is in it at most once
+typedef struct
+{
+  scheduled_event heap[EVENT_COUNT];
+  int8_t position[EVENT_COUNT];     // index in the heap, -1 if not scheduled
+  uint8_t size;
+  uint64_t next;                    // earliest deadline, UINT64_MAX if none
+} scheduler;
+
+
+// Handlers get the timestamp the event was due at, which can be in the past
+// if the CPU overshot it: periodic events reschedule from there, not from now
+typedef void (*event_handler)(uint64_t timestamp);
+
+
+void scheduler_init();
+void scheduler_register(event_type type, event_handler handler);
+
+void scheduler_schedule(event_type type, uint64_t timestamp);
+void scheduler_cancel(event_type type);
+bool scheduler_is_scheduled(event_type type);
+uint64_t scheduler_deadline(event_type type);
+
+uint64_t scheduler_now();
+uint64_t scheduler_next();
+
+// Runs every event whose deadline has been reached
+void scheduler_dispatch();
+
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef HH_TILE_CACHE_HH
+#define HH_TILE_CACHE_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Tiles can start on any 32 byte boundary of the first 96 KB of VRAM
+#define TILE_CACHE_BLOCKS (98304 / 32)
+
+
+typedef struct
+{
+  uint32_t hits;
+  uint32_t misses;
+} tile_cache_stats;
+
+
+void tile_cache_init();
+
+// Drops the tiles the game wrote to since the last call
+void tile_cache_sync();
+
+// The 8x8 tile at this VRAM offset, one byte per pixel, row after row. 16
+// color tiles hold their raw 0-15 color numbers: the palette bank is the
+// screen entry's business. Valid until the thread's next lookup.
+const uint8_t *tile_cache_get(uint32_t address, bool color256, bool hflip);
+
+// Adds the lookups of the calling thread to the totals
+void tile_cache_flush_stats();
+
+// Lookups since the last call, the calling thread's and the flushed ones
+tile_cache_stats tile_cache_take_stats();
+
+
+#endif
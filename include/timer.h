@@ -0,0 +1,32 @@
+#ifndef HH_TIMER_HH
+#define HH_TIMER_HH
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Counters are not ticked: each one remembers the value it had at a given
+// timestamp and works out the current one from the master clock when read.
+// The scheduler only hears about overflows somebody cares about (an IRQ,
+// a sound FIFO or a cascaded timer).
+typedef struct
+{
+  uint16_t reload;
+  uint16_t counter;   // value at `start`
+  uint64_t start;     // always on a prescaler boundary
+  uint8_t shift;      // log2 of the prescaler
+} timer_channel;
+
+
+void timer_init();
+
+// TMxCNT_L / TMxCNT_H, from the I/O module
+uint16_t timer_read_counter(uint8_t timer);
+void timer_write_reload(uint8_t timer, uint16_t value);
+void timer_write_control(uint8_t timer, uint16_t old, uint16_t value);
+
+// Which overflows need an event depends on SOUNDCNT_H too
+void timer_sound_changed();
+
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "apu.h"
+#include "io.h"
+#include "dma.h"
+#include "arena.h"
+#include "scheduler.h"
+
+
+// SOUNDCNT_H:
+//
+//  Bit   Expl.
+//  0-1   Sound # 1-4 Volume   (0=25%, 1=50%, 2=100%, 3=Prohibited)
+//  2     DMA Sound A Volume   (0=50%, 1=100%)
+//  3     DMA Sound B Volume   (0=50%, 1=100%)
+//  4-7   Not used
+//  8     DMA Sound A Enable RIGHT (0=Disable, 1=Enable)
+//  9     DMA Sound A Enable LEFT  (0=Disable, 1=Enable)
+//  10    DMA Sound A Timer Select (0=Timer 0, 1=Timer 1)
+//  11    DMA Sound A Reset FIFO   (1=Reset)
+//  12-15 DMA Sound B (same as above)
+
+#define FIFO_FULL_VOLUME(control, fifo)  (((control) >> (2 + (fifo))) & 0x1)
+#define FIFO_RIGHT(control, fifo)        (((control) >> (8 + (fifo) * 4)) & 0x1)
+#define FIFO_LEFT(control, fifo)         (((control) >> (9 + (fifo) * 4)) & 0x1)
+#define FIFO_TIMER(control, fifo)        (((control) >> (10 + (fifo) * 4)) & 0x1)
+#define FIFO_RESET(control, fifo)        (((control) >> (11 + (fifo) * 4)) & 0x1)
+
+// SOUNDCNT_X bit 7
+#define SOUND_MASTER_ENABLE 0x0080
+
+// A FIFO asks for 4 more words once it gets down to this many bytes
+#define FIFO_REFILL_LEVEL 16
+
+
+// Host side output, not guest state: it stays out of the arena
+static int16_t output[APU_BUFFER_FRAMES * 2];
+static uint32_t output_count;
+
+
+static void fifo_reset(apu_fifo *fifo)
+{
+  fifo->read = 0;
+  fifo->count = 0;
+}
+
+static void fifo_push(apu_fifo *fifo, int8_t value)
+{
+  // A full FIFO drops the write
+  if (fifo->count == APU_FIFO_SIZE)
+    return;
+
+  fifo->data[(fifo->read + fifo->count) % APU_FIFO_SIZE] = value;
+  fifo->count++;
+}
+
+
+static void sample_tick(uint64_t timestamp)
+{
+  uint16_t control = io_get(REG_SOUNDCNT_H);
+  int32_t left = 0;
+  int32_t right = 0;
+
+  if (io_get(REG_SOUNDCNT_X) & SOUND_MASTER_ENABLE)
+  {
+    for (uint8_t i = 0; i < 2; ++i)
+    {
+      int32_t sample = arena.apu.fifo[i].sample << FIFO_FULL_VOLUME(control, i);
+      if (FIFO_LEFT(control, i))
+        left += sample;
+      if (FIFO_RIGHT(control, i))
+        right += sample;
+    }
+  }
+
+  // Two channels at 9 bits each fit in 10, scale them to 16
+  if (output_count < APU_BUFFER_FRAMES)
+  {
+    output[output_count * 2] = left << 6;
+    output[output_count * 2 + 1] = right << 6;
+    output_count++;
+  }
+
+  scheduler_schedule(EVENT_APU_SAMPLE, timestamp + APU_CYCLES_PER_SAMPLE);
+}
+
+
+void apu_init()
+{
+  memset(&arena.apu, 0, sizeof(arena.apu));
+  output_count = 0;
+
+  scheduler_register(EVENT_APU_SAMPLE, sample_tick);
+  scheduler_schedule(EVENT_APU_SAMPLE, APU_CYCLES_PER_SAMPLE);
+}
+
+
+void apu_write_control(uint16_t value)
+{
+  for (uint8_t i = 0; i < 2; ++i)
+    if (FIFO_RESET(value, i))
+      fifo_reset(&arena.apu.fifo[i]);
+}
+
+
+void apu_write_fifo(uint8_t fifo, uint16_t value)
+{
+  fifo_push(&arena.apu.fifo[fifo], value & 0xFF);
+  fifo_push(&arena.apu.fifo[fifo], value >> 8);
+}
+
+
+void apu_timer_overflow(uint8_t timer)
+{
+  uint16_t control = io_get(REG_SOUNDCNT_H);
+
+  for (uint8_t i = 0; i < 2; ++i)
+  {
+    if (FIFO_TIMER(control, i) != timer)
+      continue;
+
+    apu_fifo *fifo = &arena.apu.fifo[i];
+    if (fifo->count)
+    {
+      fifo->sample = fifo->data[fifo->read];
+      fifo->read = (fifo->read + 1) % APU_FIFO_SIZE;
+      fifo->count--;
+    }
+
+    if (fifo->count <= FIFO_REFILL_LEVEL)
+      dma_on_fifo(i);
+  }
+}
+
+
+uint32_t apu_take_samples(int16_t *out, uint32_t max)
+{
+  uint32_t count = output_count < max ? output_count : max;
+  memcpy(out, output, count * 2 * sizeof(int16_t));
+
+  // Whatever was not taken moves to the front
+  memmove(output, output + count * 2,
+    (output_count - count) * 2 * sizeof(int16_t));
+  output_count -= count;
+
+  return count;
+}
@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+
+gba_arena arena __attribute__((aligned(ARENA_ALIGNMENT)));
+
+
+void arena_init()
+{
+  memset(&arena, 0, sizeof(arena));
+  memset(&arena.stale, 0xFF, sizeof(arena.stale));
+
+  // Only a hint: without transparent huge pages this is a no-op
+  long page_size = sysconf(_SC_PAGESIZE);
+  madvise(&arena, (sizeof(arena) + page_size - 1) & ~(page_size - 1),
+    MADV_HUGEPAGE);
+}
+
+
+size_t arena_size()
+{
+  return sizeof(arena);
+}
+
+
+void arena_save(void *buffer)
+{
+  memcpy(buffer, &arena, sizeof(arena));
+}
+
+
+// The CPU's pointers (banked registers, SPSR, decoded handlers) are rebuilt
+// from its state, so a buffer saved by another process loads as well. The
+// tile, palette and OBJ caches hold the old memory: all of it goes.
+void arena_load(const void *buffer)
+{
+  memcpy(&arena, buffer, sizeof(arena));
+  cpu_rebuild();
+  memset(&arena.stale, 0xFF, sizeof(arena.stale));
+}
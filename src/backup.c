@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "backup.h"
+#include "arena.h"
+
+
+#define FLASH_READY         0
+#define FLASH_COMMAND_1     1     // got 0xAA at 5555
+#define FLASH_COMMAND_2     2     // got 0x55 at 2AAA
+#define FLASH_WRITE         3     // next write programs a byte
+#define FLASH_BANK          4     // next write to 0000 selects the bank
+
+#define EEPROM_COMMAND      0
+#define EEPROM_ADDRESS      1
+#define EEPROM_DATA         2
+#define EEPROM_STOP         3
+#define EEPROM_READ         4
+
+#define EEPROM_READ_REQUEST   0x3
+#define EEPROM_WRITE_REQUEST  0x2
+
+
+typedef struct
+{
+  int fd;
+  uint8_t *data;
+  uint32_t size;
+  uint32_t rom_size;
+
+  atomic_bool dirty;
+  atomic_bool syncing;
+  thrd_t sync_thread;
+} backup_file;
+
+static backup_file save;
+
+
+static uint32_t backup_size(backup_type type)
+{
+  switch (type)
+  {
+  case BACKUP_SRAM:
+    return 0x8000;
+
+  case BACKUP_FLASH_64K:
+    return 0x10000;
+
+  case BACKUP_FLASH_128K:
+    return 0x20000;
+
+  case BACKUP_EEPROM:
+    return 0x2000;
+
+  default:
+    return 0;
+  }
+}
+
+
+// Without a usable file the game still gets its backup memory, it is just
+// not kept
+static void memory_only()
+{
+  if (save.fd >= 0)
+    close(save.fd);
+  save.fd = -1;
+
+  save.data = mmap(NULL, save.size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (save.data == MAP_FAILED)
+  {
+    // Nothing to read or write: no backup at all
+    save.data = NULL;
+    arena.backup.type = BACKUP_NONE;
+    return;
+  }
+  memset(save.data, 0xFF, save.size);
+}
+
+
+bool backup_init(backup_type type, const char *save_path, uint32_t rom_size)
+{
+  memset(&arena.backup, 0, sizeof(arena.backup));
+  arena.backup.type = type;
+  save.rom_size = rom_size;
+  save.size = backup_size(type);
+  save.data = NULL;
+  save.fd = -1;
+  atomic_store(&save.dirty, false);
+  atomic_store(&save.syncing, false);
+
+  if (type == BACKUP_NONE)
+    return true;
+
+  save.fd = open(save_path, O_RDWR | O_CREAT, 0644);
+  if (save.fd < 0)
+  {
+    printf("Failed to open: %s\n", save_path);
+    memory_only();
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(save.fd, &st) < 0)
+  {
+    printf("Failed to stat: %s\n", save_path);
+    memory_only();
+    return false;
+  }
+
+  // A 512 byte file is a small EEPROM from a previous run
+  if (type == BACKUP_EEPROM && st.st_size == 0x200)
+    arena.backup.eeprom_address_bits = 6;
+
+  if (st.st_size < save.size && ftruncate(save.fd, save.size) < 0)
+  {
+    printf("Failed to resize: %s\n", save_path);
+    memory_only();
+    return false;
+  }
+
+  // Prefault the pages so the emulation thread never takes a fault on them
+  save.data = mmap(NULL, save.size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, save.fd, 0);
+  if (save.data == MAP_FAILED)
+  {
+    printf("Failed to map: %s\n", save_path);
+    memory_only();
+    return false;
+  }
+
+  // Erased flash and unwritten SRAM / EEPROM read as 0xFF, and so does
+  // whatever the file was just extended by
+  if (st.st_size < save.size)
+    memset(save.data + st.st_size, 0xFF, save.size - st.st_size);
+
+  printf("Save file: %s (%u bytes)\n", save_path, save.size);
+  return true;
+}
+
+
+static int sync_thread(void *data)
+{
+  uint32_t interval_ms = *((uint32_t *)data);
+  struct timespec interval =
+  {
+    .tv_sec = interval_ms / 1000,
+    .tv_nsec = (interval_ms % 1000) * 1000000L
+  };
+
+  while (atomic_load(&save.syncing))
+  {
+    thrd_sleep(&interval, NULL);
+    if (atomic_exchange(&save.dirty, false))
+      msync(save.data, save.size, MS_SYNC);
+  }
+  return 0;
+}
+
+
+bool backup_start_sync(uint32_t interval_ms)
+{
+  static uint32_t interval;
+
+  // Nothing on disk to flush, or already flushing
+  if (save.fd < 0 || atomic_load(&save.syncing))
+    return true;
+
+  interval = interval_ms;
+  atomic_store(&save.syncing, true);
+  if (thrd_create(&save.sync_thread, sync_thread, &interval) != thrd_success)
+  {
+    atomic_store(&save.syncing, false);
+    return false;
+  }
+  return true;
+}
+
+
+void backup_destroy()
+{
+  if (atomic_exchange(&save.syncing, false))
+    thrd_join(save.sync_thread, NULL);
+
+  if (save.data && save.fd < 0)
+    munmap(save.data, save.size);
+  else if (save.data)
+  {
+    msync(save.data, save.size, MS_SYNC);
+    munmap(save.data, save.size);
+
+    // The file was created for the big EEPROM before the size was known
+    if (arena.backup.type == BACKUP_EEPROM && arena.backup.eeprom_address_bits == 6)
+      ftruncate(save.fd, 0x200);
+  }
+  if (save.fd >= 0)
+    close(save.fd);
+
+  save.data = NULL;
+  save.fd = -1;
+}
+
+
+static inline void mark_dirty()
+{
+  atomic_store_explicit(&save.dirty, true, memory_order_relaxed);
+}
+
+
+
+// Flash chips: Panasonic (64 KB) and Sanyo (128 KB) IDs
+static uint8_t flash_read(uint32_t address)
+{
+  address &= 0xFFFF;
+
+  if (arena.backup.flash_id_mode && address < 2)
+  {
+    static const uint8_t ids[2][2] = { { 0x32, 0x1B }, { 0x62, 0x13 } };
+    return ids[arena.backup.type == BACKUP_FLASH_128K][address];
+  }
+
+  return save.data[arena.backup.flash_bank + address];
+}
+
+
+static void flash_write(uint32_t address, uint8_t value)
+{
+  address &= 0xFFFF;
+
+  switch (arena.backup.flash_state)
+  {
+  case FLASH_READY:
+    if (address == 0x5555 && value == 0xAA)
+      arena.backup.flash_state = FLASH_COMMAND_1;
+    else if (value == 0xF0)
+      arena.backup.flash_id_mode = false;
+    return;
+
+  case FLASH_COMMAND_1:
+    arena.backup.flash_state = (address == 0x2AAA && value == 0x55) ?
+      FLASH_COMMAND_2 : FLASH_READY;
+    return;
+
+  case FLASH_COMMAND_2:
+    arena.backup.flash_state = FLASH_READY;
+
+    // Sector erase is the only command not sent to 5555
+    if (arena.backup.flash_erase && value == 0x30)
+    {
+      memset(&save.data[arena.backup.flash_bank + (address & 0xF000)], 0xFF, 0x1000);
+      arena.backup.flash_erase = false;
+      mark_dirty();
+      return;
+    }
+
+    if (address != 0x5555)
+      return;
+
+    switch (value)
+    {
+    case 0x90:
+      arena.backup.flash_id_mode = true;
+      break;
+
+    case 0xF0:
+      arena.backup.flash_id_mode = false;
+      break;
+
+    case 0x80:
+      arena.backup.flash_erase = true;
+      break;
+
+    case 0x10:
+      if (arena.backup.flash_erase)
+      {
+        memset(save.data, 0xFF, save.size);
+        mark_dirty();
+      }
+      arena.backup.flash_erase = false;
+      break;
+
+    case 0xA0:
+      arena.backup.flash_state = FLASH_WRITE;
+      break;
+
+    case 0xB0:
+      if (arena.backup.type == BACKUP_FLASH_128K)
+        arena.backup.flash_state = FLASH_BANK;
+      break;
+    }
+    return;
+
+  case FLASH_WRITE:
+    save.data[arena.backup.flash_bank + address] = value;
+    arena.backup.flash_state = FLASH_READY;
+    mark_dirty();
+    return;
+
+  case FLASH_BANK:
+    if (address == 0x0000)
+      arena.backup.flash_bank = (value & 1) << 16;
+    arena.backup.flash_state = FLASH_READY;
+    return;
+  }
+}
+
+
+uint8_t backup_read_byte(uint32_t address)
+{
+  switch (arena.backup.type)
+  {
+  case BACKUP_SRAM:
+    return save.data[address & 0x7FFF];
+
+  case BACKUP_FLASH_64K:
+  case BACKUP_FLASH_128K:
+    return flash_read(address);
+
+  default:
+    return 0xFF;
+  }
+}
+
+
+void backup_write_byte(uint32_t address, uint8_t value)
+{
+  switch (arena.backup.type)
+  {
+  case BACKUP_SRAM:
+    save.data[address & 0x7FFF] = value;
+    mark_dirty();
+    return;
+
+  case BACKUP_FLASH_64K:
+  case BACKUP_FLASH_128K:
+    flash_write(address, value);
+    return;
+
+  default:
+    return;
+  }
+}
+
+
+
+// EEPROM: on carts up to 16 MB the whole 0D000000-0DFFFFFF range talks to
+// it, on 32 MB carts only 0DFFFF00-0DFFFFFF does
+bool backup_is_eeprom(uint32_t address)
+{
+  if (arena.backup.type != BACKUP_EEPROM)
+    return false;
+  return save.rom_size <= 0x01000000 || address >= 0x0DFFFF00;
+}
+
+
+// Requests are 2 + address + (64 data) + 1 bits long, so the DMA length of
+// the first transfer gives the address width away
+void backup_eeprom_dma(uint32_t count)
+{
+  if (arena.backup.type != BACKUP_EEPROM || arena.backup.eeprom_address_bits)
+    return;
+
+  if (count == 9 || count == 73)
+    arena.backup.eeprom_address_bits = 6;
+  else if (count == 17 || count == 81)
+    arena.backup.eeprom_address_bits = 14;
+}
+
+
+uint16_t backup_eeprom_read()
+{
+  if (arena.backup.eeprom_state != EEPROM_READ)
+    return 1;
+
+  // 4 dummy bits, then 64 data bits MSB first
+  uint8_t bit = arena.backup.eeprom_count++;
+  if (arena.backup.eeprom_count == 68)
+  {
+    arena.backup.eeprom_state = EEPROM_COMMAND;
+    arena.backup.eeprom_count = 0;
+  }
+  if (bit < 4)
+    return 0;
+
+  bit -= 4;
+  uint8_t byte = save.data[arena.backup.eeprom_address * 8 + (bit >> 3)];
+  return (byte >> (7 - (bit & 7))) & 1;
+}
+
+
+void backup_eeprom_write(uint16_t value)
+{
+  uint8_t address_bits = arena.backup.eeprom_address_bits ?
+    arena.backup.eeprom_address_bits : 14;
+
+  arena.backup.eeprom_buffer = (arena.backup.eeprom_buffer << 1) | (value & 1);
+  arena.backup.eeprom_count++;
+
+  switch (arena.backup.eeprom_state)
+  {
+  case EEPROM_COMMAND:
+  case EEPROM_READ:
+    if (arena.backup.eeprom_state == EEPROM_READ)
+    {
+      // A new request aborts a read in progress
+      arena.backup.eeprom_state = EEPROM_COMMAND;
+      arena.backup.eeprom_buffer = value & 1;
+      arena.backup.eeprom_count = 1;
+    }
+    if (arena.backup.eeprom_count == 2)
+    {
+      arena.backup.eeprom_state = EEPROM_ADDRESS;
+      arena.backup.eeprom_count = 0;
+    }
+    return;
+
+  case EEPROM_ADDRESS:
+    if (arena.backup.eeprom_count < address_bits)
+      return;
+
+    // Only 10 of the 14 address bits are wired on the 8 KB chip
+    arena.backup.eeprom_address = (arena.backup.eeprom_buffer & 0x3FF) &
+      ((address_bits == 6) ? 0x3F : 0x3FF);
+    arena.backup.eeprom_state = ((arena.backup.eeprom_buffer >> address_bits) & 0x3) ==
+      EEPROM_WRITE_REQUEST ? EEPROM_DATA : EEPROM_STOP;
+    arena.backup.eeprom_count = 0;
+    arena.backup.eeprom_buffer = (arena.backup.eeprom_state == EEPROM_DATA) ? 0 :
+      EEPROM_READ_REQUEST;
+    return;
+
+  case EEPROM_DATA:
+    if (arena.backup.eeprom_count < 64)
+      return;
+
+    for (uint8_t i = 0; i < 8; ++i)
+      save.data[arena.backup.eeprom_address * 8 + i] =
+        arena.backup.eeprom_buffer >> (56 - i * 8);
+    mark_dirty();
+    arena.backup.eeprom_state = EEPROM_STOP;
+    arena.backup.eeprom_count = 0;
+    arena.backup.eeprom_buffer = EEPROM_WRITE_REQUEST;
+    return;
+
+  case EEPROM_STOP:
+    // Only a read request has something to send back
+    arena.backup.eeprom_state = ((arena.backup.eeprom_buffer >> 1) == EEPROM_READ_REQUEST) ?
+      EEPROM_READ : EEPROM_COMMAND;
+    arena.backup.eeprom_count = 0;
+    arena.backup.eeprom_buffer = 0;
+    return;
+  }
+}
@@ -1,31 +1,649 @@
 #include "bios.h"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "io.h"
+#include "cpu.h"
+#include "bus.h"
+#include "arena.h"
+
+
+#define BIOS_SIZE 16384
+
+// IRQ handlers acknowledge IntrWait interrupts here (03FFFFF8 mirror)
+#define BIOS_IF_OFFSET 0x7FF8
+
+#define SWI_REGISTER_RAM_RESET  0x01
+#define SWI_HALT                0x02
+#define SWI_STOP                0x03
+#define SWI_INTR_WAIT           0x04
+#define SWI_VBLANK_INTR_WAIT    0x05
+#define SWI_DIV                 0x06
+#define SWI_DIV_ARM             0x07
+#define SWI_SQRT                0x08
+#define SWI_ARCTAN              0x09
+#define SWI_ARCTAN2             0x0A
+#define SWI_CPU_SET             0x0B
+#define SWI_CPU_FAST_SET        0x0C
+#define SWI_BIT_UNPACK          0x10
+#define SWI_LZ77_WRAM           0x11
+#define SWI_LZ77_VRAM           0x12
+#define SWI_HUFFMAN             0x13
+#define SWI_RL_WRAM             0x14
+#define SWI_RL_VRAM             0x15
+#define SWI_DIFF8_WRAM          0x16
+#define SWI_DIFF8_VRAM          0x17
+#define SWI_DIFF16              0x18
+
+// The largest output of a decompression SWI: all of on-board WRAM
+#define UNPACK_MAX_SIZE         0x40000
+
+#define R(n) (*arena.cpu.regs[n])
+
+
+// Fallback used when no BIOS file is available. It is not a dump: it only
+// provides what a game can observe from the BIOS region after boot, that is
+// the exception vectors and the IRQ dispatcher (same sequence as the
+// original, games rely on its stack layout). The common SWIs are emulated
+// in C (bios_hle_swi); the SWI vector is only reached for the others, which
+// do nothing and are reported once.
+//
+//  00000000  b     reset_handler
+//  00000004  movs  pc, lr                          ; undefined
+//  00000008  movs  pc, lr                          ; SWI
+//  0000000C  subs  pc, lr, #4                      ; prefetch abort
+//  00000010  subs  pc, lr, #4                      ; data abort
+//  00000014  movs  pc, lr                          ; reserved
+//  00000018  b     irq_handler
+//  0000001C  subs  pc, lr, #4                      ; FIQ
+//
+//  reset_handler:
+//  00000068  mov   pc, #0x08000000
+//
+//  irq_handler:
+//  00000128  stmfd sp!, {r0-r3, r12, lr}
+//  0000012C  mov   r0, #0x04000000
+//  00000130  add   lr, pc, #0
+//  00000134  ldr   pc, [r0, #-4]                   ; user handler at 03FFFFFC
+//  00000138  ldmfd sp!, {r0-r3, r12, lr}
+//  0000013C  subs  pc, lr, #4
+static const uint32_t builtin_bios[BIOS_SIZE / 4] =
+{
+  [0x000 / 4] = 0xEA000018,
+  [0x004 / 4] = 0xE1B0F00E,
+  [0x008 / 4] = 0xE1B0F00E,
+  [0x00C / 4] = 0xE25EF004,
+  [0x010 / 4] = 0xE25EF004,
+  [0x014 / 4] = 0xE1B0F00E,
+  [0x018 / 4] = 0xEA000042,
+  [0x01C / 4] = 0xE25EF004,
+
+  [0x068 / 4] = 0xE3A0F302,
+
+  [0x128 / 4] = 0xE92D500F,
+  [0x12C / 4] = 0xE3A00301,
+  [0x130 / 4] = 0xE28FE000,
+  [0x134 / 4] = 0xE510F004,
+  [0x138 / 4] = 0xE8BD500F,
+  [0x13C / 4] = 0xE25EF004
+};
+
+
+// Either the mapped file (shared through the page cache by every process
+// using the same BIOS) or the built-in image
+static const uint8_t *bios_data = (const uint8_t *)builtin_bios;
 
-uint8_t bios_data[16384];
-unsigned int bios_size;
 
 bool load_bios(char *file_name)
 {
-  FILE *file_ptr = fopen(file_name, "r");
+  int fd = open(file_name, O_RDONLY);
+
+  if (fd < 0)
+  {
+    printf("Failed to open: %s (using the built-in BIOS)\n", file_name);
+    return false;
+  }
 
-  if (!file_ptr)
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != BIOS_SIZE)
   {
-    printf("Failed to open: %s\n", file_name);
+    printf("Invalid BIOS: %s (using the built-in BIOS)\n", file_name);
+    close(fd);
+    return false;
+  }
+
+  const uint8_t *data = mmap(NULL, BIOS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    printf("Failed to map: %s (using the built-in BIOS)\n", file_name);
     return false;
   }
 
   printf("Opened: %s\n", file_name);
+  bios_data = data;
+  return true;
+}
+
+
+bool bios_is_builtin()
+{
+  return bios_data == (const uint8_t *)builtin_bios;
+}
+
+
+// What the boot sequence leaves behind in the I/O registers
+void bios_post_boot_state()
+{
+  io_set(REG_SOUNDBIAS, 0x0200);
+  io_set(REG_RCNT, 0x8000);
+  io_set(REG_POSTFLG, 0x0001);
+}
+
+
+
+
+// Waits until the game's IRQ handler reports one of the flags in BIOS_IF.
+// Each time an interrupt wakes the CPU the handler runs and the SWI is
+// executed again; only the first pass may discard the old flags.
+static swi_result intr_wait(bool discard, uint16_t flags)
+{
+  uint16_t *bios_if = (uint16_t *)&arena.on_chip_wram[BIOS_IF_OFFSET];
+
+  io_write_halfword(REG_IME, 1);
+
+  if (discard && !arena.cpu.intr_wait)
+    *bios_if &= ~flags;
+
+  if (*bios_if & flags)
+  {
+    *bios_if &= ~flags;
+    arena.cpu.intr_wait = false;
+    return SWI_DONE;
+  }
+
+  arena.cpu.intr_wait = true;
+  cpu_halt(CPU_WAKE_HALT);
+  return SWI_RETRY;
+}
+
+
+// Clears the memories and registers the flags in r0 select. On-chip WRAM
+// keeps its last 512 bytes: the stacks and the IRQ handler pointer.
+static void register_ram_reset(uint8_t flags)
+{
+  static const struct
+  {
+    uint32_t address;
+    uint32_t size;
+  } areas[5] =
+  {
+    { 0x02000000, 0x40000 },
+    { 0x03000000, 0x7E00 },
+    { 0x05000000, 0x400 },
+    { 0x06000000, 0x18000 },
+    { 0x07000000, 0x400 }
+  };
+
+  for (uint32_t i = 0; i < 5; ++i)
+    if (flags & (1 << i))
+      for (uint32_t offset = 0; offset < areas[i].size; offset += 4)
+        bus_write_word(areas[i].address + offset, 0);
+
+  // Serial, sound, then everything else (display, DMA, timers, interrupts)
+  if (flags & 0x20)
+  {
+    for (uint32_t reg = 0x120; reg < 0x130; reg += 2)
+      bus_write_halfword(0x04000000 + reg, 0);
+    bus_write_halfword(0x04000000 + REG_RCNT, 0x8000);
+  }
+  if (flags & 0x40)
+  {
+    for (uint32_t reg = 0x060; reg < 0x0B0; reg += 2)
+      if (reg != REG_SOUNDBIAS)
+        bus_write_halfword(0x04000000 + reg, 0);
+  }
+  if (flags & 0x80)
+  {
+    bus_write_halfword(0x04000000 + REG_DISPCNT, 0x0080);
+    for (uint32_t reg = 0x008; reg < 0x060; reg += 2)
+      bus_write_halfword(0x04000000 + reg, 0);
+    for (uint32_t reg = 0x0B0; reg < 0x120; reg += 2)
+      bus_write_halfword(0x04000000 + reg, 0);
+    bus_write_halfword(0x04000000 + REG_IE, 0);
+    bus_write_halfword(0x04000000 + REG_WAITCNT, 0);
+    bus_write_halfword(0x04000000 + REG_IME, 0);
+  }
+}
+
+
+// r0 = numerator / denominator, r1 = remainder, r3 = |r0|. The real BIOS
+// never returns from a division by zero; this gives +-1 instead.
+static void divide(int32_t numerator, int32_t denominator)
+{
+  int32_t quotient;
+  int32_t remainder;
+
+  if (!denominator)
+  {
+    quotient = numerator < 0 ? -1 : 1;
+    remainder = numerator;
+  }
+  else if (numerator == INT32_MIN && denominator == -1)
+  {
+    quotient = INT32_MIN;
+    remainder = 0;
+  }
+  else
+  {
+    quotient = numerator / denominator;
+    remainder = numerator % denominator;
+  }
+
+  R(0) = quotient;
+  R(1) = remainder;
+  R(3) = quotient < 0 ? -(uint32_t)quotient : (uint32_t)quotient;
+}
+
+
+static uint32_t square_root(uint32_t value)
+{
+  uint32_t root = 0;
+  for (uint32_t bit = 1u << 30; bit; bit >>= 2)
+  {
+    if (value >= root + bit)
+    {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+  }
+  return root;
+}
+
+
+// The BIOS polynomial, bit for bit: tangent in 1.14 fixed point, angle
+// with 0x10000 for a full turn
+static int32_t arctan(int32_t tangent)
+{
+  int32_t a = -((tangent * tangent) >> 14);
+  int32_t b = ((0xA9 * a) >> 14) + 0x390;
+  b = ((b * a) >> 14) + 0x91C;
+  b = ((b * a) >> 14) + 0xFB6;
+  b = ((b * a) >> 14) + 0x16AA;
+  b = ((b * a) >> 14) + 0x2081;
+  b = ((b * a) >> 14) + 0x3651;
+  b = ((b * a) >> 14) + 0xA2F9;
+  return (tangent * b) >> 16;
+}
+
+static uint16_t arctan2(int32_t x, int32_t y)
+{
+  if (!y)
+    return x >= 0 ? 0 : 0x8000;
+  if (!x)
+    return y >= 0 ? 0x4000 : 0xC000;
+
+  if (y >= 0)
+  {
+    if (x >= 0 ? x >= y : -x >= y)
+      return arctan((y << 14) / x) + (x >= 0 ? 0 : 0x8000);
+    return 0x4000 - arctan((x << 14) / y);
+  }
+
+  if (x <= 0 ? -x > -y : x >= -y)
+    return arctan((y << 14) / x) + (x <= 0 ? 0x8000 : 0x10000);
+  return 0xC000 - arctan((x << 14) / y);
+}
+
+
+// r0 source, r1 destination, r2 count (bits 0-20), fill (bit 24), words
+// (bit 26)
+static void cpu_set(uint32_t source, uint32_t destination, uint32_t control)
+{
+  uint32_t count = control & 0x1FFFFF;
+  bool fill = control & (1 << 24);
+
+  if (control & (1 << 26))
+  {
+    source &= ~3;
+    destination &= ~3;
+    uint32_t value = bus_read_word(source);
+    for (uint32_t i = 0; i < count; ++i)
+      bus_write_word(destination + i * 4,
+        fill ? value : bus_read_word(source + i * 4));
+  }
+  else
+  {
+    source &= ~1;
+    destination &= ~1;
+    uint16_t value = bus_read_halfword(source);
+    for (uint32_t i = 0; i < count; ++i)
+      bus_write_halfword(destination + i * 2,
+        fill ? value : bus_read_halfword(source + i * 2));
+  }
+}
+
+// Words only, in blocks of 8
+static void cpu_fast_set(uint32_t source, uint32_t destination,
+  uint32_t control)
+{
+  uint32_t count = ((control & 0x1FFFFF) + 7) & ~7;
+  cpu_set(source, destination, count | (control & (1 << 24)) | (1 << 26));
+}
+
+
+// r2 points to: source length in bytes (16 bits), source and destination
+// unit widths in bits (8 bits each), offset added to the units (31 bits,
+// bit 31 to add it to zero units too)
+static void bit_unpack(uint32_t source, uint32_t destination, uint32_t info)
+{
+  uint32_t length = bus_read_halfword(info);
+  uint8_t source_width = bus_read(info + 2);
+  uint8_t destination_width = bus_read(info + 3);
+  uint32_t offset = bus_read_word(info + 4);
+  bool offset_zero = offset & 0x80000000;
+  offset &= 0x7FFFFFFF;
+
+  if (!source_width || source_width > 8 || 8 % source_width ||
+    !destination_width || destination_width > 32 || 32 % destination_width)
+  {
+    return;
+  }
+
+  uint32_t word = 0;
+  uint32_t bits = 0;
+  destination &= ~3;
+  for (uint32_t i = 0; i < length; ++i)
+  {
+    uint8_t byte = bus_read(source + i);
+    for (uint32_t shift = 0; shift < 8; shift += source_width)
+    {
+      uint32_t unit = (byte >> shift) & ((1 << source_width) - 1);
+      if (unit || offset_zero)
+        unit += offset;
+
+      word |= (unit & (destination_width == 32 ? ~0u :
+        (1u << destination_width) - 1)) << bits;
+      bits += destination_width;
+      if (bits == 32)
+      {
+        bus_write_word(destination, word);
+        destination += 4;
+        word = 0;
+        bits = 0;
+      }
+    }
+  }
+}
+
+
+// The decompressors fill a host buffer from the compressed header's size,
+// then write it out in units of 1, 2 or 4 bytes: halfwords to VRAM, which
+// has no byte writes, and words for Huffman, whose output is 32 bit units
+static uint8_t unpacked[UNPACK_MAX_SIZE];
+
+static uint32_t unpack_size(uint32_t source)
+{
+  uint32_t size = bus_read_word(source) >> 8;
+  return size > UNPACK_MAX_SIZE ? UNPACK_MAX_SIZE : size;
+}
+
+static void store_unpacked(uint32_t destination, uint32_t size, uint32_t unit)
+{
+  destination &= ~(unit - 1);
+  for (uint32_t i = 0; i < size; i += unit)
+  {
+    uint32_t value = 0;
+    for (uint32_t byte = 0; byte < unit && i + byte < size; ++byte)
+      value |= (uint32_t)unpacked[i + byte] << (byte * 8);
+
+    if (unit == 4)
+      bus_write_word(destination + i, value);
+    else if (unit == 2)
+      bus_write_halfword(destination + i, value);
+    else
+      bus_write(destination + i, value);
+  }
+}
+
+
+// Flag bytes, MSB first: 0 for a literal byte, 1 for a copy of 3 to 18
+// bytes from 1 to 4096 bytes back
+static uint32_t lz77_unpack(uint32_t source)
+{
+  uint32_t size = unpack_size(source);
+  uint32_t in = source + 4;
+  uint32_t out = 0;
+
+  while (out < size)
+  {
+    uint8_t flags = bus_read(in++);
+    for (uint32_t bit = 0; bit < 8 && out < size; ++bit, flags <<= 1)
+    {
+      if (!(flags & 0x80))
+      {
+        unpacked[out++] = bus_read(in++);
+        continue;
+      }
+
+      uint8_t high = bus_read(in++);
+      uint8_t low = bus_read(in++);
+      uint32_t length = (high >> 4) + 3;
+      uint32_t distance = (((high & 0xF) << 8) | low) + 1;
+
+      for (; length && out < size; --length, ++out)
+        unpacked[out] = out >= distance ? unpacked[out - distance] : 0;
+    }
+  }
+
+  return size;
+}
+
+// Flag bytes: bit 7 set for a run of (flag & 0x7F) + 3 copies of the next
+// byte, clear for (flag + 1) literal bytes
+static uint32_t rl_unpack(uint32_t source)
+{
+  uint32_t size = unpack_size(source);
+  uint32_t in = source + 4;
+  uint32_t out = 0;
+
+  while (out < size)
+  {
+    uint8_t flag = bus_read(in++);
+    if (flag & 0x80)
+    {
+      uint8_t value = bus_read(in++);
+      for (uint32_t n = (flag & 0x7F) + 3; n && out < size; --n)
+        unpacked[out++] = value;
+    }
+    else
+    {
+      for (uint32_t n = flag + 1; n && out < size; --n)
+        unpacked[out++] = bus_read(in++);
+    }
+  }
 
-  fseek(file_ptr, 0, SEEK_END);
-  bios_size = ftell(file_ptr);
+  return size;
+}
+
+// A tree of 4 or 8 bit values, walked one bit at a time from 32 bit words
+// read MSB first. A node's offset leads to its two children; bits 7 and 6
+// tell whether the left or the right one is a value.
+static uint32_t huffman_unpack(uint32_t source)
+{
+  uint32_t size = unpack_size(source) & ~3;
+  uint8_t unit_bits = bus_read(source) & 0xF;
+  if (unit_bits != 4 && unit_bits != 8)
+    return 0;
+
+  uint32_t root = source + 5;
+  uint32_t in = source + 4 + (bus_read(source + 4) + 1) * 2;
+  uint32_t node = root;
+  uint32_t out = 0;
+  uint32_t word = 0;
+  uint32_t word_bits = 0;
+
+  while (out < size)
+  {
+    uint32_t bits = bus_read_word(in);
+    in += 4;
 
-  rewind(file_ptr);
+    for (uint32_t i = 0; i < 32 && out < size; ++i, bits <<= 1)
+    {
+      uint8_t value = bus_read(node);
+      bool right = bits & 0x80000000;
+      uint32_t child = (node & ~1) + (value & 0x3F) * 2 + 2 + right;
 
-  fread(bios_data, bios_size, 1, file_ptr);
-  fclose(file_ptr);
+      if (!(value & (right ? 0x40 : 0x80)))
+      {
+        node = child;
+        continue;
+      }
+
+      word |= (uint32_t)bus_read(child) << word_bits;
+      word_bits += unit_bits;
+      node = root;
+      if (word_bits == 32)
+      {
+        memcpy(&unpacked[out], &word, 4);
+        out += 4;
+        word = 0;
+        word_bits = 0;
+      }
+    }
+  }
+
+  return size;
+}
+
+// Each unit is the difference from the previous one
+static uint32_t diff_unpack(uint32_t source, bool halfwords)
+{
+  uint32_t size = unpack_size(source);
+  uint32_t in = source + 4;
+
+  if (halfwords)
+  {
+    size &= ~1;
+    uint16_t value = 0;
+    for (uint32_t out = 0; out < size; out += 2, in += 2)
+    {
+      value += bus_read_halfword(in);
+      unpacked[out] = value;
+      unpacked[out + 1] = value >> 8;
+    }
+  }
+  else
+  {
+    uint8_t value = 0;
+    for (uint32_t out = 0; out < size; ++out)
+      unpacked[out] = value += bus_read(in++);
+  }
+
+  return size;
+}
+
+
+swi_result bios_hle_swi(uint8_t number)
+{
+  static bool reported[256];
+
+  switch (number)
+  {
+  case SWI_REGISTER_RAM_RESET:
+    register_ram_reset(R(0));
+    return SWI_DONE;
+
+  case SWI_HALT:
+    cpu_halt(CPU_WAKE_HALT);
+    return SWI_DONE;
+
+  case SWI_STOP:
+    cpu_halt(CPU_WAKE_STOP);
+    return SWI_DONE;
+
+  case SWI_INTR_WAIT:
+    return intr_wait(R(0) & 1, R(1));
+
+  case SWI_VBLANK_INTR_WAIT:
+    return intr_wait(true, 1 << IRQ_VBLANK);
+
+  case SWI_DIV:
+    divide(R(0), R(1));
+    return SWI_DONE;
+
+  case SWI_DIV_ARM:
+    divide(R(1), R(0));
+    return SWI_DONE;
+
+  case SWI_SQRT:
+    R(0) = square_root(R(0));
+    return SWI_DONE;
+
+  case SWI_ARCTAN:
+    R(0) = (uint16_t)arctan((int16_t)R(0));
+    return SWI_DONE;
+
+  case SWI_ARCTAN2:
+    R(0) = arctan2((int16_t)R(0), (int16_t)R(1));
+    return SWI_DONE;
+
+  case SWI_CPU_SET:
+    cpu_set(R(0), R(1), R(2));
+    return SWI_DONE;
+
+  case SWI_CPU_FAST_SET:
+    cpu_fast_set(R(0), R(1), R(2));
+    return SWI_DONE;
+
+  case SWI_BIT_UNPACK:
+    bit_unpack(R(0), R(1), R(2));
+    return SWI_DONE;
+
+  case SWI_LZ77_WRAM:
+  case SWI_LZ77_VRAM:
+    store_unpacked(R(1), lz77_unpack(R(0)), number == SWI_LZ77_VRAM ? 2 : 1);
+    return SWI_DONE;
+
+  case SWI_HUFFMAN:
+    store_unpacked(R(1), huffman_unpack(R(0)), 4);
+    return SWI_DONE;
+
+  case SWI_RL_WRAM:
+  case SWI_RL_VRAM:
+    store_unpacked(R(1), rl_unpack(R(0)), number == SWI_RL_VRAM ? 2 : 1);
+    return SWI_DONE;
+
+  case SWI_DIFF8_WRAM:
+  case SWI_DIFF8_VRAM:
+    store_unpacked(R(1), diff_unpack(R(0), false),
+      number == SWI_DIFF8_VRAM ? 2 : 1);
+    return SWI_DONE;
+
+  case SWI_DIFF16:
+    store_unpacked(R(1), diff_unpack(R(0), true), 2);
+    return SWI_DONE;
+
+  default:
+    // The stub's SWI vector returns right away: say so, once per number
+    if (!reported[number])
+    {
+      reported[number] = true;
+      printf("SWI 0x%02X is not emulated without a BIOS file\n", number);
+    }
+    return SWI_NOT_HLE;
+  }
 }
 
 
@@ -44,5 +662,3 @@ uint32_t bios_read_word(uint32_t address)
 {
   return *((uint32_t *)&bios_data[address]);
 }
-
-
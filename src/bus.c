@@ -1,10 +1,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bus.h"
 #include "cartridge.h"
 #include "bios.h"
+#include "io.h"
+#include "backup.h"
+#include "arena.h"
 
 //General Internal Memory
 //
@@ -42,14 +46,10 @@
 #define NO_IMPL { fprintf(stderr, "NOT YET IMPLEMENTED: BUS\n"); exit(-5); }
 
 
-uint8_t on_board_wram[262144];    // 256  KB
-uint8_t on_chip_wram[32768];      // 32   kB
+// All the memories live in the arena (see arena.h)
 
 
 // Temporarly ******************** DISPLAY MEM
-uint8_t bg_obj_pram[1024];        // 1    KB
-uint8_t vram[98304];              // 96   KB
-uint8_t oam[1024];                // 1    KB
 
 
 uint8_t read_pram_byte(uint32_t address);
@@ -120,18 +120,151 @@ void write_oc_wram_word(uint32_t address, uint32_t value);
 
 
 
+// Access timings in cycles (1 + wait states), indexed by the upper 4 bits of
+// the address. 32 bit accesses on a 16 bit bus cost two halfword accesses.
+// The Game Pak entries (08-0F) are rebuilt from WAITCNT when it is written.
+static const uint8_t default_access_cycles[2][2][16] =
+{
+  // Non sequential
+  {
+    { 1, 1, 3, 1, 1, 1, 1, 1,  0, 0, 0, 0, 0, 0, 0, 0 },     // 16 bit
+    { 1, 1, 6, 1, 1, 2, 2, 1,  0, 0, 0, 0, 0, 0, 0, 0 }      // 32 bit
+  },
+  // Sequential
+  {
+    { 1, 1, 3, 1, 1, 1, 1, 1,  0, 0, 0, 0, 0, 0, 0, 0 },     // 16 bit
+    { 1, 1, 6, 1, 1, 2, 2, 1,  0, 0, 0, 0, 0, 0, 0, 0 }      // 32 bit
+  }
+};
+
+
+// WAITCNT:
+//
+//  Bit   Expl.
+//  0-1   SRAM Wait Control          (0..3 = 4,3,2,8 cycles)
+//  2-3   Wait State 0 First Access  (0..3 = 4,3,2,8 cycles)
+//  4     Wait State 0 Second Access (0..1 = 2,1 cycles)
+//  5-6   Wait State 1 First Access  (0..3 = 4,3,2,8 cycles)
+//  7     Wait State 1 Second Access (0..1 = 4,1 cycles)
+//  8-9   Wait State 2 First Access  (0..3 = 4,3,2,8 cycles)
+//  10    Wait State 2 Second Access (0..1 = 8,1 cycles)
+//  11-12 PHI Terminal Output
+//  14    Game Pak Prefetch Buffer   (0=Disable, 1=Enable)
+//  15    Game Pak Type Flag         (Read Only)
+
+static const uint8_t first_access_waits[4] = { 4, 3, 2, 8 };
+static const uint8_t second_access_waits[3][2] = { { 2, 1 }, { 4, 1 }, { 8, 1 } };
+
+
+void bus_update_waitcnt(uint16_t waitcnt)
+{
+  for (uint8_t ws = 0; ws < 3; ++ws)
+  {
+    uint8_t n = 1 + first_access_waits[(waitcnt >> (2 + ws * 3)) & 0x3];
+    uint8_t s = 1 + second_access_waits[ws][(waitcnt >> (4 + ws * 3)) & 0x1];
+
+    for (uint8_t region = 0x08 + ws * 2; region < 0x0A + ws * 2; ++region)
+    {
+      arena.access_cycles[0][0][region] = n;
+      arena.access_cycles[1][0][region] = s;
+      arena.access_cycles[0][1][region] = n + s;
+      arena.access_cycles[1][1][region] = s + s;
+    }
+  }
+
+  // SRAM has an 8 bit bus, every access is a first access
+  uint8_t sram = 1 + first_access_waits[waitcnt & 0x3];
+  for (uint8_t i = 0; i < 4; ++i)
+  {
+    arena.access_cycles[i >> 1][i & 1][0x0E] = sram;
+    arena.access_cycles[i >> 1][i & 1][0x0F] = sram;
+  }
+
+  arena.prefetch.mask = (waitcnt & 0x4000) ? -1 : 0;
+  arena.prefetch.ready = 0;
+}
+
+
+void bus_init()
+{
+  memcpy(arena.access_cycles, default_access_cycles,
+    sizeof(default_access_cycles));
+  arena.prefetch.address = 0;
+  bus_update_waitcnt(0);
+}
+
+
+// Cost of one halfword fetch from the Game Pak, without branches: both the
+// sequential and the non sequential costs are computed and one is selected.
+static inline uint32_t rom_halfword_cycles(uint32_t address)
+{
+  uint8_t region = (address >> 24) & 0xF;
+  int64_t now = arena.emu.cycles;
+  int64_t n = arena.access_cycles[0][0][region];
+  int64_t s = arena.access_cycles[1][0][region];
+
+  // A buffered halfword takes 1 cycle, without prefetch it is a plain S cycle
+  int64_t minimum = 1 + ((s - 1) & ~arena.prefetch.mask);
+  int64_t wait = arena.prefetch.ready - now;
+  int64_t sequential_cost = wait > minimum ? wait : minimum;
+
+  bool sequential = address == arena.prefetch.address;
+  int64_t cost = sequential ? sequential_cost : n;
+  int64_t end = now + cost;
+
+  // The next halfword follows the stream, but a full buffer (8 halfwords,
+  // one of which was just handed out) cannot be further ahead than this
+  int64_t next = (sequential ? arena.prefetch.ready : end) + s;
+  int64_t full = end - 6 * s;
+  next = next > full ? next : full;
+
+  arena.prefetch.ready = next & arena.prefetch.mask;
+  arena.prefetch.address = address + 2;
+  return cost;
+}
+
+
+// Everything but the Game Pak ROM (billed by the prefetch model above) costs
+// its sequential access time: this is what makes every instruction advance
+// the clock, so the scheduler deadlines come around
+#define FLAT_REGIONS 0xC0FF
+
+static inline void charge_access(uint32_t address, bool word)
+{
+  uint8_t region = (address >> 24) & 0xF;
+  if ((FLAT_REGIONS >> region) & 1)
+    arena.emu.cycles += arena.access_cycles[1][word][region];
+}
+
+
+// VRAM mirrors every 128 KB, and the upper 32 KB of each mirror maps back
+// onto 06010000-06017FFF
+static inline uint32_t vram_offset(uint32_t address)
+{
+  address &= 0x0001FFFF;
+  return address >= 0x18000 ? address - 0x8000 : address;
+}
+
 //  06000000-06017FFF   VRAM - Video RAM          (96 KBytes)
 uint8_t bus_read(uint32_t address)
 {
+  charge_access(address, false);
+
   if (address <= 0x00003FFF)
   {
     return bios_read_byte(address);
   }
   else if (address >= 0x08000000 && address <= 0x0DFFFFFF)
   {
+    // The Game Pak bus is 16 bits wide: a byte costs its halfword
+    arena.emu.cycles += rom_halfword_cycles(address & ~1);
     address &= 0x01FFFFFF;
     return cartridge_read_byte(address);
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    return backup_read_byte(address);
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -145,8 +278,7 @@ uint8_t bus_read(uint32_t address)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("READ byte from 0x%08x (IO registers)\n", address);
-    return 0;
+    return io_read_byte(address);
   }
   else if (address >= 0x05000000 && address <= 0x05FFFFFF)
   {
@@ -155,7 +287,7 @@ uint8_t bus_read(uint32_t address)
   }
   else if (address >= 0x06000000 && address <= 0x06FFFFFF)
   {
-    address &= 0x00017FFF;
+    address = vram_offset(address);
     return read_vram_byte(address);
   }
   else if (address >= 0x07000000 && address <= 0x07FFFFFF)
@@ -176,12 +308,19 @@ uint8_t bus_read(uint32_t address)
 
 void bus_write(uint32_t address, uint8_t value)
 {
+  charge_access(address, false);
+
   if (address >= 0x08000000 && address <= 0x0DFFFFFF)
   {
     address &= 0x01FFFFFF;
     cartridge_write_byte(address, value);
     return;
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    backup_write_byte(address, value);
+    return;
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -197,7 +336,7 @@ void bus_write(uint32_t address, uint8_t value)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("Write 0x%04x to 0x%08x (IO registers)\n", value, address);
+    io_write_byte(address, value);
     return;
   }
   //else if (address >= 0x06000000 && address <= 0x06017FFF)
@@ -213,16 +352,32 @@ void bus_write(uint32_t address, uint8_t value)
 
 uint16_t bus_read_halfword(uint32_t address)
 {
+  charge_access(address, false);
+
   // Read on the ROM
   if (address <= 0x00003FFF)
   {
     return bios_read_halfword(address);
   }
-  else if (address >= 0x08000000 && address <= 0x0DFFFFFF)
+  else if (address >= 0x08000000 && address <= 0x0CFFFFFF)
+  {
+    arena.emu.cycles += rom_halfword_cycles(address);
+    address &= 0x01FFFFFF;
+    return cartridge_read_halfword(address);
+  }
+  else if (address >= 0x0D000000 && address <= 0x0DFFFFFF)
   {
+    if (backup_is_eeprom(address))
+      return backup_eeprom_read();
+    arena.emu.cycles += rom_halfword_cycles(address);
     address &= 0x01FFFFFF;
     return cartridge_read_halfword(address);
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    // 8 bit bus: the byte shows up on both halves
+    return backup_read_byte(address) * 0x0101;
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -236,8 +391,7 @@ uint16_t bus_read_halfword(uint32_t address)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("READ halfword from 0x%08x (IO registers)\n", address);
-    return 0;
+    return io_read_halfword(address);
   }
   else if (address >= 0x05000000 && address <= 0x05FFFFFF)
   {
@@ -246,7 +400,7 @@ uint16_t bus_read_halfword(uint32_t address)
   }
   else if (address >= 0x06000000 && address <= 0x06FFFFFF)
   {
-    address &= 0x000017FFF;
+    address = vram_offset(address);
     return read_vram_halfword(address);
   }
   else if (address >= 0x07000000 && address <= 0x07FFFFFF)
@@ -261,12 +415,25 @@ uint16_t bus_read_halfword(uint32_t address)
 
 void bus_write_halfword(uint32_t address, uint16_t value)
 {
-  if (address >= 0x08000000 && address <= 0x0DFFFFFF)
+  charge_access(address, false);
+
+  if (address >= 0x0D000000 && address <= 0x0DFFFFFF &&
+    backup_is_eeprom(address))
+  {
+    backup_eeprom_write(value);
+    return;
+  }
+  else if (address >= 0x08000000 && address <= 0x0DFFFFFF)
   {
     address &= 0x01FFFFFF;
     cartridge_write_halfword(address, value);
     return;
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    backup_write_byte(address, value >> ((address & 1) * 8));
+    return;
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -282,19 +449,18 @@ void bus_write_halfword(uint32_t address, uint16_t value)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("Write 0x%04x to 0x%08x (IO registers)\n", value, address);
+    io_write_halfword(address, value);
     return;
   }
   else if (address >= 0x05000000 && address <= 0x05FFFFFF)
   {
     address &= 0x000003FF;
-    printf("Write 0x%04x to 0x%08x (OBJ/BG vram)\n", value, address);
     write_pram_halfword(address, value);
     return;
   }
   else if (address >= 0x06000000 && address <= 0x06FFFFFF)
   {
-    address &= 0x000017FFF;
+    address = vram_offset(address);
     write_vram_halfword(address, value);
     return;
   }
@@ -310,15 +476,23 @@ void bus_write_halfword(uint32_t address, uint16_t value)
 
 uint32_t bus_read_word(uint32_t address)
 {
+  charge_access(address, true);
+
   if (address <= 0x00003FFF)
   {
     return bios_read_word(address);
   }
   else if (address >= 0x08000000 && address <= 0x0DFFFFFF)
   {
+    arena.emu.cycles += rom_halfword_cycles(address);
+    arena.emu.cycles += rom_halfword_cycles(address + 2);
     address &= 0x01FFFFFF;
     return cartridge_read_word(address);
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    return backup_read_byte(address) * 0x01010101;
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -332,8 +506,7 @@ uint32_t bus_read_word(uint32_t address)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("READ word from 0x%08x (IO registers)\n", address);
-    return 0;
+    return io_read_word(address);
   }
   else if (address >= 0x05000000 && address <= 0x05FFFFFF)
   {
@@ -342,7 +515,7 @@ uint32_t bus_read_word(uint32_t address)
   }
   else if (address >= 0x06000000 && address <= 0x06FFFFFF)
   {
-    address &= 0x000017FFF;
+    address = vram_offset(address);
     return read_vram_word(address);
   }
   else if (address >= 0x07000000 && address <= 0x07FFFFFF)
@@ -379,12 +552,19 @@ uint32_t bus_read_word(uint32_t address)
 
 void bus_write_word(uint32_t address, uint32_t value)
 {
+  charge_access(address, true);
+
   if (address >= 0x08000000 && address <= 0x0DFFFFFF)
   {
     address &= 0x01FFFFFF;
     cartridge_write_word(address, value);
     return;
   }
+  else if (address >= 0x0E000000 && address <= 0x0FFFFFFF)
+  {
+    backup_write_byte(address, value >> ((address & 3) * 8));
+    return;
+  }
   else if (address >= 0x02000000 && address <= 0x02FFFFFF)
   {
     address &= 0x0003FFFF;
@@ -400,7 +580,7 @@ void bus_write_word(uint32_t address, uint32_t value)
   else if (address >= 0x04000000 && address <= 0x04FFFFFF)
   {
     address &= 0x000003FF;
-    printf("Write 0x%04x to 0x%08x (IO registers)\n", value, address);
+    io_write_word(address, value);
     return;
   }
   else if (address >= 0x05000000 && address <= 0x05FFFFFF)
@@ -411,7 +591,7 @@ void bus_write_word(uint32_t address, uint32_t value)
   }
   else if (address >= 0x06000000 && address <= 0x06FFFFFF)
   {
-    address &= 0x000017FFF;
+    address = vram_offset(address);
     write_vram_word(address, value);
     return;
   }
@@ -419,7 +599,6 @@ void bus_write_word(uint32_t address, uint32_t value)
   {
     address &= 0x000003FF;
     write_oam_word(address, value);
-    printf("DEBUG\n");
     return;
   }
   
@@ -428,88 +607,157 @@ void bus_write_word(uint32_t address, uint32_t value)
 
 
 
+uint32_t bus_access_cycles(uint32_t address, bool word, bool sequential)
+{
+  return arena.access_cycles[sequential][word][(address >> 24) & 0xF];
+}
+
+
+static void mark_dirty(uint64_t *bitmap, uint32_t first, uint32_t last)
+{
+  for (uint32_t i = first; i <= last; ++i)
+    bitmap[i >> 6] |= 1ull << (i & 63);
+}
+
+
+// Returns where [address, address + length) lives on the host, or NULL if the
+// range is not plain memory or is not contiguous (it crosses a mirror).
+// Asking for a writable display memory range marks it dirty.
+uint8_t *bus_host_pointer(uint32_t address, uint32_t length, bool write)
+{
+  uint32_t offset;
+
+  switch (address >> 24)
+  {
+  case 0x02:
+    offset = address & 0x0003FFFF;
+    return (offset + length <= sizeof(arena.on_board_wram)) ?
+      &arena.on_board_wram[offset] : NULL;
+
+  case 0x03:
+    offset = address & 0x00007FFF;
+    return (offset + length <= sizeof(arena.on_chip_wram)) ?
+      &arena.on_chip_wram[offset] : NULL;
+
+  case 0x05:
+    offset = address & 0x000003FF;
+    if (offset + length > sizeof(arena.bg_obj_pram))
+      return NULL;
+    if (write && length)
+      mark_dirty(arena.stale.palette, offset >> 1, (offset + length - 1) >> 1);
+    return &arena.bg_obj_pram[offset];
+
+  case 0x06:
+    offset = address & 0x0001FFFF;
+    if (offset + length > ((offset < 0x18000) ? 0x18000 : 0x20000))
+      return NULL;
+    offset = vram_offset(offset);
+    if (write && length)
+      mark_dirty(arena.stale.tiles, offset >> 5, (offset + length - 1) >> 5);
+    return &arena.vram[offset];
+
+  case 0x07:
+    offset = address & 0x000003FF;
+    if (offset + length > sizeof(arena.oam))
+      return NULL;
+    if (write && length)
+      mark_dirty(arena.stale.oam, offset >> 3, (offset + length - 1) >> 3);
+    return &arena.oam[offset];
+
+  case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+    if (write || backup_is_eeprom(address + length - 1))
+      return NULL;
+    offset = address & 0x01FFFFFF;
+    return (offset + length <= 0x02000000) ?
+      cartridge_rom_data() + offset : NULL;
+
+  default:
+    return NULL;
+  }
+}
+
 
 
 uint8_t read_ob_wram_byte(uint32_t address)
 {
-  return on_board_wram[address];
+  return arena.on_board_wram[address];
 }
 
 uint16_t read_ob_wram_halfword(uint32_t address)
 {
-  return *((uint16_t *)&on_board_wram[address]);
+  return *((uint16_t *)&arena.on_board_wram[address]);
 }
 
 uint32_t read_ob_wram_word(uint32_t address)
 {
-  return *((uint32_t *)&on_board_wram[address]);
+  return *((uint32_t *)&arena.on_board_wram[address]);
 }
 
 
 void write_ob_wram_byte(uint32_t address, uint8_t value)
 {
-  on_board_wram[address] = value;
+  arena.on_board_wram[address] = value;
 }
 
 void write_ob_wram_halfword(uint32_t address, uint16_t value)
 {
-  *((uint16_t *)&on_board_wram[address]) = value;
+  *((uint16_t *)&arena.on_board_wram[address]) = value;
 }
 
 void write_ob_wram_word(uint32_t address, uint32_t value)
 {
-  *((uint32_t *)&on_board_wram[address]) = value;
+  *((uint32_t *)&arena.on_board_wram[address]) = value;
 }
 
 
 
 uint8_t read_oc_wram_byte(uint32_t address)
 {
-  return on_chip_wram[address];
+  return arena.on_chip_wram[address];
 }
 
 uint16_t read_oc_wram_halfword(uint32_t address)
 {
-  return *((uint16_t *)&on_chip_wram[address]);
+  return *((uint16_t *)&arena.on_chip_wram[address]);
 }
 
 uint32_t read_oc_wram_word(uint32_t address)
 {
-  return *((uint32_t *)&on_chip_wram[address]);
+  return *((uint32_t *)&arena.on_chip_wram[address]);
 }
 
 
 void write_oc_wram_byte(uint32_t address, uint8_t value)
 {
-  on_chip_wram[address] = value;
+  arena.on_chip_wram[address] = value;
 }
 
 void write_oc_wram_halfword(uint32_t address, uint16_t value)
 {
-  *((uint16_t *)&on_chip_wram[address]) = value;
+  *((uint16_t *)&arena.on_chip_wram[address]) = value;
 }
 
 void write_oc_wram_word(uint32_t address, uint32_t value)
 {
 
-  *((uint32_t *)&on_chip_wram[address]) = value;
+  *((uint32_t *)&arena.on_chip_wram[address]) = value;
 }
 
 
 
 uint8_t read_pram_byte(uint32_t address)
 {
-  return bg_obj_pram[address];
+  return arena.bg_obj_pram[address];
 }
 
 uint16_t read_pram_halfword(uint32_t address)
 {
-  return *((uint16_t *)&bg_obj_pram[address]);
+  return *((uint16_t *)&arena.bg_obj_pram[address]);
 }
 
 uint32_t read_pram_word(uint32_t address)
 {
-  return *((uint32_t *)&bg_obj_pram[address]);
+  return *((uint32_t *)&arena.bg_obj_pram[address]);
 }
 
 
@@ -517,34 +765,34 @@ uint32_t read_pram_word(uint32_t address)
 
 uint8_t read_vram_byte(uint32_t address)
 {
-  return vram[address];
+  return arena.vram[address];
 }
 
 uint16_t read_vram_halfword(uint32_t address)
 {
-  return *((uint16_t *)&vram[address]);
+  return *((uint16_t *)&arena.vram[address]);
 }
 
 uint32_t read_vram_word(uint32_t address)
 {
-  return *((uint32_t *)&vram[address]);
+  return *((uint32_t *)&arena.vram[address]);
 }
 
 
 
 uint8_t read_oam_byte(uint32_t address)
 {
-  return vram[address];
+  return arena.oam[address];
 }
 
 uint16_t read_oam_halfword(uint32_t address)
 {
-  return *((uint16_t *)&vram[address]);
+  return *((uint16_t *)&arena.oam[address]);
 }
 
 uint32_t read_oam_word(uint32_t address)
 {
-  return *((uint32_t *)&vram[address]);
+  return *((uint32_t *)&arena.oam[address]);
 }
 
 
@@ -552,12 +800,14 @@ uint32_t read_oam_word(uint32_t address)
 
 void write_pram_halfword(uint32_t address, uint16_t value)
 {
-  *((uint16_t *)&bg_obj_pram[address]) = value;
+  *((uint16_t *)&arena.bg_obj_pram[address]) = value;
+  arena.stale.palette[address >> 7] |= 1ull << ((address >> 1) & 63);
 }
 
 void write_pram_word(uint32_t address, uint32_t value)
 {
-  *((uint32_t *)&bg_obj_pram[address]) = value;
+  *((uint32_t *)&arena.bg_obj_pram[address]) = value;
+  arena.stale.palette[address >> 7] |= 3ull << ((address >> 1) & 62);
 }
 
 
@@ -569,22 +819,26 @@ void write_pram_word(uint32_t address, uint32_t value)
 
 void write_vram_halfword(uint32_t address, uint16_t value)
 {
-  *((uint16_t *)&vram[address]) = value;
+  *((uint16_t *)&arena.vram[address]) = value;
+  arena.stale.tiles[address >> 11] |= 1ull << ((address >> 5) & 63);
 }
 
 void write_vram_word(uint32_t address, uint32_t value)
 {
-  *((uint32_t *)&vram[address]) = value;
+  *((uint32_t *)&arena.vram[address]) = value;
+  arena.stale.tiles[address >> 11] |= 1ull << ((address >> 5) & 63);
 }
 
 
 void write_oam_halfword(uint32_t address, uint16_t value)
 {
-  *((uint16_t *)&vram[address]) = value;
+  *((uint16_t *)&arena.oam[address]) = value;
+  arena.stale.oam[address >> 9] |= 1ull << ((address >> 3) & 63);
 }
 
 void write_oam_word(uint32_t address, uint32_t value)
 {
-  *((uint32_t *)&vram[address]) = value;
+  *((uint32_t *)&arena.oam[address]) = value;
+  arena.stale.oam[address >> 9] |= 1ull << ((address >> 3) & 63);
 }
 
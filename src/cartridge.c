@@ -1,9 +1,28 @@
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cartridge.h"
+#include "detect.h"
+
+
+// The Game Pak region is 32 MB wide (address masked to 25 bits), so the ROM
+// is mapped inside a reservation of the same size. Everything after the ROM
+// image reads back as open bus, which on the GBA is the halfword address
+// ((addr >> 1) & 0xFFFF). Since that pattern repeats every 128 KB, the
+// padding is made of views of a single 128 KB memfd: pages are shared and
+// cost nothing until the game actually touches them.
+#define ROM_REGION_SIZE   0x02000000
+#define OPEN_BUS_PERIOD   0x00020000
 
 
 typedef struct
@@ -12,18 +31,71 @@ typedef struct
   uint32_t rom_size;
   uint8_t *rom_data;
   rom_header *header;
+  cartridge_features features;
 } cartridge;
 
 static cartridge cart;
 
+
+static void fill_open_bus(uint8_t *data, uint32_t start, uint32_t end)
+{
+  // start and end are always halfword aligned
+  for (uint32_t address = start; address < end; address += 2)
+    *((uint16_t *)&data[address]) = (address >> 1) & 0xFFFF;
+}
+
+
+static bool map_open_bus(uint8_t *region, uint32_t start)
+{
+  int fd = memfd_create("open_bus", MFD_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  if (ftruncate(fd, OPEN_BUS_PERIOD) < 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  uint8_t *pattern = mmap(NULL, OPEN_BUS_PERIOD, PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  if (pattern == MAP_FAILED)
+  {
+    close(fd);
+    return false;
+  }
+  fill_open_bus(pattern, 0, OPEN_BUS_PERIOD);
+  munmap(pattern, OPEN_BUS_PERIOD);
+
+  // Map the pattern chunk by chunk, each view starting at the right phase
+  uint32_t address = start;
+  while (address < ROM_REGION_SIZE)
+  {
+    uint32_t offset = address & (OPEN_BUS_PERIOD - 1);
+    uint32_t length = OPEN_BUS_PERIOD - offset;
+
+    if (mmap(region + address, length, PROT_READ, MAP_SHARED | MAP_FIXED,
+      fd, offset) == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+    address += length;
+  }
+
+  close(fd);
+  return true;
+}
+
+
 bool load_cartridge(char *file_name)
 {
   // load the file in memory
   snprintf(cart.file_name, sizeof(cart.file_name), "%s", file_name);
 
-  FILE *file_ptr = fopen(file_name, "r");
+  int fd = open(file_name, O_RDONLY);
 
-  if (!file_ptr)
+  if (fd < 0)
   {
     printf("Failed to open: %s\n", file_name);
     return false;
@@ -31,20 +103,59 @@ bool load_cartridge(char *file_name)
 
   printf("Opened: %s\n", cart.file_name);
 
-  fseek(file_ptr, 0, SEEK_END);
-  cart.rom_size = ftell(file_ptr);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    printf("Failed to stat: %s\n", file_name);
+    close(fd);
+    return false;
+  }
+
+  cart.rom_size = st.st_size > ROM_REGION_SIZE ? ROM_REGION_SIZE : st.st_size;
+
+  // Reserve the whole Game Pak region, then place the file at its start
+  cart.rom_data = mmap(NULL, ROM_REGION_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (cart.rom_data == MAP_FAILED)
+  {
+    printf("Failed to reserve the Game Pak region\n");
+    close(fd);
+    cart.rom_data = NULL;
+    return false;
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint32_t mapped_size = (cart.rom_size + page_size - 1) & ~(page_size - 1);
 
-  rewind(file_ptr);
+  if (cart.rom_size && mmap(cart.rom_data, mapped_size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    printf("Failed to map: %s\n", file_name);
+    close(fd);
+    dealloc_cartridge();
+    return false;
+  }
+  close(fd);
+
+  // The last page of the file is zero filled by the kernel after EOF
+  fill_open_bus(cart.rom_data, (cart.rom_size + 1) & ~1, mapped_size);
+
+  if (!map_open_bus(cart.rom_data, mapped_size))
+  {
+    // No memfd: fall back to filling the anonymous pages
+    fill_open_bus(cart.rom_data, mapped_size, ROM_REGION_SIZE);
+  }
 
-  cart.rom_data = malloc(cart.rom_size);
-  fread(cart.rom_data, cart.rom_size, 1, file_ptr);
-  fclose(file_ptr);
+  mprotect(cart.rom_data, mapped_size, PROT_READ);
 
   cart.header = (rom_header *)(cart.rom_data);
-  cart.header->title[11] = 0;
+
+  char title[13];
+  memcpy(title, cart.header->title, sizeof(cart.header->title));
+  title[12] = 0;
 
   printf("Cartridge loaded:\n");
-  printf("\tTitle       : %s\n", cart.header->title);
+  printf("\tTitle       : %s\n", title);
   printf("\tUnique code : %c\n", cart.header->game_code[0]);
   printf("\tShort title : %c%c\n", cart.header->game_code[1], 
     cart.header->game_code[2]);
@@ -62,16 +173,43 @@ bool load_cartridge(char *file_name)
   printf("\tChecksum    : %2.2X (%s)\n", cart.header->complement_check,
     (chk & 0xFF) ? "PASSED" : "FAILED");
 
+  detect_cartridge_features(cart.rom_data, cart.rom_size,
+    cart.header->game_code, &cart.features);
+
+  printf("\tSave type   : %s%s%s (%.3f ms)\n",
+    detect_backup_name(cart.features.backup),
+    (cart.features.features & CART_FEATURE_RTC) ? " + RTC" : "",
+    cart.features.overridden ? " [override]" : "",
+    cart.features.elapsed_ms);
+
   printf("\n");
   return true;
 }
 
 void dealloc_cartridge()
 {
-  free(cart.rom_data);
+  if (cart.rom_data)
+    munmap(cart.rom_data, ROM_REGION_SIZE);
+  cart.rom_data = NULL;
+}
+
+uint8_t *cartridge_rom_data()
+{
+  return cart.rom_data;
 }
 
+uint32_t cartridge_rom_size()
+{
+  return cart.rom_size;
+}
 
+const cartridge_features *cartridge_get_features()
+{
+  return &cart.features;
+}
+
+
+// No bounds checks needed: the whole 32 MB region is always mapped
 uint8_t cartridge_read_byte(uint32_t address)
 {
   return cart.rom_data[address];
@@ -102,4 +240,3 @@ void cartridge_write_halfword(uint32_t address, uint16_t value)
   // Not implemented
 }
 
-
@@ -5,84 +5,157 @@
 #include "instructions.h"
 
 #include "bus.h"
+#include "io.h"
+#include "arena.h"
 
 
 #define TEST(add)                                                                   \
 {                                                                                   \
   uint32_t address = add;                                                           \
-  cpu.instruction_to_exec = bus_read_word(address);                                 \
-  printf("Instruction: 0x%08x\n", cpu.instruction_to_exec);                         \
-  void (*function)(cpu_context *) = decode_instruction(cpu.instruction_to_exec);    \
+  arena.cpu.instruction_to_exec = bus_read_word(address);                           \
+  printf("Instruction: 0x%08x\n", arena.cpu.instruction_to_exec);                   \
+  void (*function)(cpu_context *) = decode_instruction(arena.cpu.instruction_to_exec);\
   printf("0x%08x:\t", address);                                                     \
-  function(&cpu);                                                                   \
-  cpu.regs[15] += 4;                                                                \
+  function(&arena.cpu);                                                             \
+  arena.cpu.regs[15] += 4;                                                          \
 }
 
-#define REGS(id) *cpu.regs[id]
+#define REGS(id) *arena.cpu.regs[id]
 
 
 // defining the nop instruction as mov r0, r0
 #define NOP 0xe1a00000
 #define THUMB_NOP 0x46C0
-#define PC *cpu.regs[15]
-#define LR *cpu.regs[14]
-#define SP *cpu.regs[13]
+#define PC *arena.cpu.regs[15]
+#define LR *arena.cpu.regs[14]
+#define SP *arena.cpu.regs[13]
 
-static cpu_context cpu;
+// The CPU state lives in the arena
 
-bool cpu_arm_step();
-bool cpu_thumb_step();
+static void cpu_arm_step();
+static void cpu_thumb_step();
 
-void cpu_init()
+static uint32_t breakpoint = CPU_NO_BREAKPOINT;
+
+void cpu_init(bool skip_bios)
 {
-  printf("CPU Initialization\n");
+  TRACE("CPU Initialization\n");
   // Set the program counter to 0
   //cpu.regs[15] = 0x07FFFFFC;
   //cpu.regs = cpu.regs_sys_usr;
-  cpu.current_mode = 0x1F;
-  cpu.CPSR = 0x0000001F;    
-  cpu.current_SPSR = NULL;
+  arena.cpu.current_SPSR = NULL;
+  for (int i = 0; i < 16; ++i)
+    arena.cpu.regs[i] = &arena.cpu.regs_sys_usr[i];
+
+  if (skip_bios)
+  {
+    // State left by the BIOS boot sequence: System mode, stacks set up
+    arena.cpu.current_mode = 0x1F;
+    arena.cpu.CPSR = 0x0000001F;
+    PC = 0x08000000;
+    SP = 0x03007f00;
+    arena.cpu.regs_svc[0] = 0x03007fe0;
+    arena.cpu.regs_irq[0] = 0x03007fa0;
+  }
+  else
+  {
+    // Reset: Supervisor mode with IRQ and FIQ disabled, from the BIOS
+    arena.cpu.current_mode = 0x13;
+    arena.cpu.CPSR = 0x000000D3;
+    arena.cpu.current_SPSR = &arena.cpu.SPSR_svc;
+    arena.cpu.regs[13] = &arena.cpu.regs_svc[0];
+    arena.cpu.regs[14] = &arena.cpu.regs_svc[1];
+    PC = 0x00000000;
+  }
+
+  arena.cpu.instruction_to_exec = NOP;
+  arena.cpu.decoded_instruction = NOP;
+  arena.cpu.fetched_instruction = NOP;
+
+  arena.cpu.thumb_fetch   = THUMB_NOP;
+  arena.cpu.thumb_decode  = THUMB_NOP;
+  arena.cpu.thumb_exec    = THUMB_NOP;
+
+  arena.cpu.function = decode_instruction(arena.cpu.instruction_to_exec);
+  arena.cpu.thumb_function = thumb_decode_instruction(arena.cpu.thumb_exec);
+  arena.cpu.pipeline_depth = 0;
+}
+
+// The register bank and SPSR pointers follow the CPSR mode and the decoded
+// handlers follow the instructions in the pipeline, so they are derived
+// rather than restored
+void cpu_rebuild()
+{
   for (int i = 0; i < 16; ++i)
-    cpu.regs[i] = &cpu.regs_sys_usr[i];
-
-  printf("DEBUG\n");
-  PC = 0x08000000;
-  //PC = 0x00000000;
-  SP = 0x03007f00;
-  cpu.instruction_to_exec = NOP;
-  cpu.decoded_instruction = NOP;
-  cpu.fetched_instruction = NOP;
-
-  cpu.thumb_fetch   = THUMB_NOP;
-  cpu.thumb_decode  = THUMB_NOP;
-  cpu.thumb_exec    = THUMB_NOP;
-
-  cpu.function = decode_instruction(cpu.instruction_to_exec);
-  cpu.thumb_function = thumb_decode_instruction(cpu.thumb_exec);
+    arena.cpu.regs[i] = &arena.cpu.regs_sys_usr[i];
+  bank_registers(&arena.cpu, arena.cpu.CPSR & 0x1F);
+
+  arena.cpu.function = decode_instruction(arena.cpu.instruction_to_exec);
+  arena.cpu.thumb_function = thumb_decode_instruction(arena.cpu.thumb_exec);
 }
 
 bool cpu_step()
 {
-  bool retval;
-  printf("PC = 0x%08x\n", PC);
-  if (((cpu.CPSR >> 5) & 0x01) == 1)
-    retval = cpu_thumb_step();
+  TRACE("PC = 0x%08x\n", PC);
+  if (((arena.cpu.CPSR >> 5) & 0x01) == 1)
+    cpu_thumb_step();
   else
-    retval = cpu_arm_step();
+    cpu_arm_step();
 
-  return retval;
+  return PC != breakpoint;
+}
+
+
+void cpu_set_breakpoint(uint32_t address)
+{
+  breakpoint = address;
+}
+
+
+// IRQ exception entry, between two steps. The return address is the next
+// instruction to execute plus 4, which is where "subs pc, lr, #4" expects it
+bool cpu_raise_irq()
+{
+  if (arena.cpu.CPSR & 0x80)
+    return false;
+
+  bool thumb = (arena.cpu.CPSR >> 5) & 0x1;
+  uint32_t next = PC - arena.cpu.pipeline_depth * (thumb ? 2 : 4);
+
+  arena.cpu.SPSR_irq = arena.cpu.CPSR;
+  bank_registers(&arena.cpu, 0x12);
+  arena.cpu.CPSR = (arena.cpu.CPSR & ~0xFF) | 0x92;
+
+  LR = next + 4;
+  PC = 0x00000018;
+  arena.cpu.pipeline_depth = 0;
+
+  flush(&arena.cpu);
+  arena.cpu.function = decode_instruction(NOP);
+
+  return true;
+}
+
+
+void cpu_halt(uint16_t wake_mask)
+{
+  arena.cpu.halted = true;
+  arena.cpu.wake_mask = wake_mask;
+
+  // An interrupt that is already pending does not let it sleep at all
+  io_check_interrupts();
 }
 
 
 void cpu_print_failed_test()
 {
   // Choose the register
-  uint8_t reg = ((cpu.CPSR >> 5) & 0x1) ? 7 : 12;
+  uint8_t reg = ((arena.cpu.CPSR >> 5) & 0x1) ? 7 : 12;
 
-  if (*cpu.regs[reg] == 0)
+  if (*arena.cpu.regs[reg] == 0)
     printf("All tests passed!\n");
   else
-    printf("Failed test = %d\n", *cpu.regs[reg]);
+    printf("Failed test = %d\n", *arena.cpu.regs[reg]);
 }
 
 
@@ -132,91 +205,86 @@ void cpu_print_failed_test()
 //}
 
 
-bool cpu_arm_step()
+static void cpu_arm_step()
 {
-  printf("CPSR = 0x%08x\n", cpu.CPSR);
-  cpu.fetched_instruction = bus_read_word(PC);
+  TRACE("CPSR = 0x%08x\n", arena.cpu.CPSR);
+  arena.cpu.fetched_instruction = bus_read_word(PC);
 
   uint32_t old_pc = PC;
-  uint8_t cond = cpu.instruction_to_exec >> 28;
-  if (verify_condition(&cpu, cond))
-    cpu.function(&cpu);
+  uint8_t cond = arena.cpu.instruction_to_exec >> 28;
+  if (verify_condition(&arena.cpu, cond))
+    arena.cpu.function(&arena.cpu);
   else
-    printf("NOT EXECUTED DUE TO UNSATISFIED CONDITION\n");
+    TRACE("NOT EXECUTED DUE TO UNSATISFIED CONDITION\n");
   
   // If an instruction changed the pc, then flush the pipeline
   if (old_pc != PC)
   {
-    flush(&cpu);
+    flush(&arena.cpu);
+    arena.cpu.pipeline_depth = 0;
   }
-  printf("Fetched instruction: 0x%08x\n", cpu.fetched_instruction);
-  printf("Decoded instruction: 0x%08x\n", cpu.decoded_instruction);
-  printf("Executed instruction: 0x%08x\n", cpu.instruction_to_exec);
+  else if (arena.cpu.pipeline_depth < 2)
+    arena.cpu.pipeline_depth++;
+  TRACE("Fetched instruction: 0x%08x\n", arena.cpu.fetched_instruction);
+  TRACE("Decoded instruction: 0x%08x\n", arena.cpu.decoded_instruction);
+  TRACE("Executed instruction: 0x%08x\n", arena.cpu.instruction_to_exec);
     
 
-  cpu.function = decode_instruction(cpu.decoded_instruction);
-  cpu.instruction_to_exec = cpu.decoded_instruction;
-  cpu.decoded_instruction = cpu.fetched_instruction;
+  arena.cpu.function = decode_instruction(arena.cpu.decoded_instruction);
+  arena.cpu.instruction_to_exec = arena.cpu.decoded_instruction;
+  arena.cpu.decoded_instruction = arena.cpu.fetched_instruction;
 
-  printf("R0 = 0x%08x\n", REGS(0));
-  printf("R1 = 0x%08x\n", REGS(1));
-  printf("R2 = 0x%08x\n", REGS(2));
-  printf("R3 = 0x%08x\n", REGS(3));
-  printf("R8 = 0x%08x\n", REGS(8));
-  printf("LR = 0x%08x\n", LR);
-  printf("SP = 0x%08x\n", SP);
-  printf("nzcv = 0b%04b\n", cpu.CPSR >> 28);
+  TRACE("R0 = 0x%08x\n", REGS(0));
+  TRACE("R1 = 0x%08x\n", REGS(1));
+  TRACE("R2 = 0x%08x\n", REGS(2));
+  TRACE("R3 = 0x%08x\n", REGS(3));
+  TRACE("R8 = 0x%08x\n", REGS(8));
+  TRACE("LR = 0x%08x\n", LR);
+  TRACE("SP = 0x%08x\n", SP);
+  TRACE("nzcv = 0b%04b\n", arena.cpu.CPSR >> 28);
 
   PC += 4;
 
-  printf("\n");
-
-  // TEMPORARY 'cause I still haven't implemented the display
-  if (0x08001d4c == PC)
-    return false;
-
-  return true;
+  TRACE("\n");
 }
 
 
-bool cpu_thumb_step()
+static void cpu_thumb_step()
 {
-  cpu.thumb_fetch = bus_read_halfword(PC);
+  arena.cpu.thumb_fetch = bus_read_halfword(PC);
 
   uint32_t old_pc = PC;
-  cpu.thumb_function(&cpu);
+  arena.cpu.thumb_function(&arena.cpu);
 
   if (old_pc != PC)
   {
     if (PC % 2)
       PC -= 1;
-    thumb_flush(&cpu);
+    thumb_flush(&arena.cpu);
+    arena.cpu.pipeline_depth = 0;
   }
+  else if (arena.cpu.pipeline_depth < 2)
+    arena.cpu.pipeline_depth++;
 
-  printf("Fetched THUMB instruction: 0x%04x\n", cpu.thumb_fetch);
-  printf("Decoded THUMB instruction: 0x%04x\n", cpu.thumb_decode);
-  printf("Executed THUMB instruction: 0x%04x\n", cpu.thumb_exec);
+  TRACE("Fetched THUMB instruction: 0x%04x\n", arena.cpu.thumb_fetch);
+  TRACE("Decoded THUMB instruction: 0x%04x\n", arena.cpu.thumb_decode);
+  TRACE("Executed THUMB instruction: 0x%04x\n", arena.cpu.thumb_exec);
   
-  cpu.thumb_function = thumb_decode_instruction(cpu.thumb_decode);
-  cpu.thumb_exec = cpu.thumb_decode;
-  cpu.thumb_decode = cpu.thumb_fetch;
-
-  printf("R0 = 0x%08x\n", REGS(0));
-  printf("R1 = 0x%08x\n", REGS(1));
-  printf("R2 = 0x%08x\n", REGS(2));
-  printf("R3 = 0x%08x\n", REGS(3));
-  printf("R4 = 0x%08x\n", REGS(4));
-  printf("R5 = 0x%08x\n", REGS(5));
-  printf("LR = 0x%08x\n", LR);
-  printf("SP = 0x%08x\n", SP);
-  printf("nzcv = 0b%04b\n", cpu.CPSR >> 28);
+  arena.cpu.thumb_function = thumb_decode_instruction(arena.cpu.thumb_decode);
+  arena.cpu.thumb_exec = arena.cpu.thumb_decode;
+  arena.cpu.thumb_decode = arena.cpu.thumb_fetch;
+
+  TRACE("R0 = 0x%08x\n", REGS(0));
+  TRACE("R1 = 0x%08x\n", REGS(1));
+  TRACE("R2 = 0x%08x\n", REGS(2));
+  TRACE("R3 = 0x%08x\n", REGS(3));
+  TRACE("R4 = 0x%08x\n", REGS(4));
+  TRACE("R5 = 0x%08x\n", REGS(5));
+  TRACE("LR = 0x%08x\n", LR);
+  TRACE("SP = 0x%08x\n", SP);
+  TRACE("nzcv = 0b%04b\n", arena.cpu.CPSR >> 28);
 
   PC += 2;
-  printf("\n");
-
-  if (0x08000932 == PC)
-    return false;
-
-  return true;
+  TRACE("\n");
 }
 
@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "detect.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DETECT_X86
+#endif
+
+
+typedef struct
+{
+  const char *name;
+  uint8_t length;
+  backup_type backup;
+  uint32_t features;
+} library_id;
+
+// Every ID ends with "_V" (followed by the library version), which is what
+// the scanners look for
+static const library_id library_ids[] =
+{
+  { "EEPROM_V",   8,  BACKUP_EEPROM,      0 },
+  { "SRAM_V",     6,  BACKUP_SRAM,        0 },
+  { "SRAM_F_V",   8,  BACKUP_SRAM,        0 },
+  { "FLASH_V",    7,  BACKUP_FLASH_64K,   0 },
+  { "FLASH512_V", 10, BACKUP_FLASH_64K,   0 },
+  { "FLASH1M_V",  9,  BACKUP_FLASH_128K,  0 },
+  { "SIIRTC_V",   8,  BACKUP_NONE,        CART_FEATURE_RTC }
+};
+
+#define LIBRARY_IDS (sizeof(library_ids) / sizeof(library_ids[0]))
+
+
+
+// Known games whose strings are missing or misleading. The table is a
+// perfect hash: (code * OVERRIDE_SEED) >> 27 is collision free for these
+// keys, so a lookup is one multiply and one compare.
+typedef struct
+{
+  char game_code[4];
+  backup_type backup;
+  uint32_t features;
+} game_override;
+
+#define OVERRIDE_SEED 0x650D
+#define OVERRIDE_BITS 5
+
+static const game_override overrides[1 << OVERRIDE_BITS] =
+{
+  [3]  = { "BPEJ", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Emerald
+  [5]  = { "AX4E", BACKUP_FLASH_128K, 0 },                  // Super Mario Advance 4
+  [6]  = { "AXPE", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Sapphire
+  [7]  = { "BPRJ", BACKUP_FLASH_128K, 0 },                  // Pokemon FireRed
+  [8]  = { "ALFE", BACKUP_EEPROM,     0 },                  // DBZ Legacy of Goku II
+  [10] = { "U32E", BACKUP_EEPROM,     CART_FEATURE_RTC | CART_FEATURE_LIGHT_SENSOR },
+  [11] = { "AI2E", BACKUP_NONE,       0 },                  // Iridion II
+  [12] = { "U3IE", BACKUP_EEPROM,     CART_FEATURE_RTC | CART_FEATURE_LIGHT_SENSOR },
+  [15] = { "AXPJ", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Sapphire
+  [18] = { "AXVE", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Ruby
+  [20] = { "BPGE", BACKUP_FLASH_128K, 0 },                  // Pokemon LeafGreen
+  [21] = { "KYGE", BACKUP_EEPROM,     CART_FEATURE_TILT },  // Yoshi Topsy-Turvy
+  [22] = { "A2YE", BACKUP_NONE,       0 },                  // Top Gun Combat Zones
+  [23] = { "AX4P", BACKUP_FLASH_128K, 0 },                  // Super Mario Advance 4
+  [25] = { "ALFP", BACKUP_EEPROM,     0 },                  // DBZ Legacy of Goku II
+  [26] = { "AXVJ", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Ruby
+  [27] = { "BPEE", BACKUP_FLASH_128K, CART_FEATURE_RTC },   // Pokemon Emerald
+  [29] = { "BPGJ", BACKUP_FLASH_128K, 0 },                  // Pokemon LeafGreen
+  [31] = { "BPRE", BACKUP_FLASH_128K, 0 }                   // Pokemon FireRed
+};
+
+
+static const game_override *find_override(const uint8_t game_code[4])
+{
+  uint32_t key;
+  memcpy(&key, game_code, sizeof(key));
+
+  const game_override *entry =
+    &overrides[(uint32_t)(key * OVERRIDE_SEED) >> (32 - OVERRIDE_BITS)];
+  if (entry->game_code[0] && !memcmp(entry->game_code, game_code, 4))
+    return entry;
+  return NULL;
+}
+
+
+
+// position is the offset of a "_V": check which ID (if any) ends there
+static inline void check_candidate(const uint8_t *rom, uint32_t position,
+  uint32_t *found)
+{
+  for (uint8_t i = 0; i < LIBRARY_IDS; ++i)
+  {
+    uint32_t prefix = library_ids[i].length - 2;
+    if (position >= prefix &&
+      !memcmp(rom + position - prefix, library_ids[i].name, prefix))
+    {
+      *found |= 1 << i;
+    }
+  }
+}
+
+
+static void scan_scalar(const uint8_t *rom, uint32_t start, uint32_t size,
+  uint32_t *found)
+{
+  if (size < 2 || start >= size - 1)
+    return;
+
+  const uint8_t *p = memchr(rom + start, '_', size - 1 - start);
+  while (p)
+  {
+    uint32_t position = p - rom;
+    if (p[1] == 'V')
+      check_candidate(rom, position, found);
+    p = memchr(p + 1, '_', size - 1 - position - 1);
+  }
+}
+
+
+#ifdef DETECT_X86
+
+// Compare the block with '_' and the block one byte later with 'V': every
+// set bit of the combined mask is a "_V"
+static void scan_sse2(const uint8_t *rom, uint32_t size, uint32_t *found)
+{
+  const __m128i underscore = _mm_set1_epi8('_');
+  const __m128i v = _mm_set1_epi8('V');
+
+  uint32_t i = 0;
+  for (; i + 17 <= size; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(rom + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(rom + i + 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+      _mm_cmpeq_epi8(a, underscore), _mm_cmpeq_epi8(b, v)));
+
+    while (mask)
+    {
+      check_candidate(rom, i + __builtin_ctz(mask), found);
+      mask &= mask - 1;
+    }
+  }
+
+  scan_scalar(rom, i, size, found);
+}
+
+
+__attribute__((target("avx2")))
+static void scan_avx2(const uint8_t *rom, uint32_t size, uint32_t *found)
+{
+  const __m256i underscore = _mm256_set1_epi8('_');
+  const __m256i v = _mm256_set1_epi8('V');
+
+  uint32_t i = 0;
+  for (; i + 33 <= size; i += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(rom + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(rom + i + 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+      _mm256_cmpeq_epi8(a, underscore), _mm256_cmpeq_epi8(b, v)));
+
+    while (mask)
+    {
+      check_candidate(rom, i + __builtin_ctz(mask), found);
+      mask &= mask - 1;
+    }
+  }
+
+  scan_scalar(rom, i, size, found);
+}
+
+#endif
+
+
+static void scan_library_ids(const uint8_t *rom, uint32_t size,
+  uint32_t *found)
+{
+#ifdef DETECT_X86
+  if (__builtin_cpu_supports("avx2"))
+    scan_avx2(rom, size, found);
+  else
+    scan_sse2(rom, size, found);
+#else
+  scan_scalar(rom, 0, size, found);
+#endif
+}
+
+
+void detect_cartridge_features(const uint8_t *rom, uint32_t size,
+  const uint8_t game_code[4], cartridge_features *features)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  features->backup = BACKUP_NONE;
+  features->features = 0;
+  features->overridden = false;
+
+  const game_override *entry = find_override(game_code);
+  if (entry)
+  {
+    features->backup = entry->backup;
+    features->features = entry->features;
+    features->overridden = true;
+  }
+  else
+  {
+    uint32_t found = 0;
+    scan_library_ids(rom, size, &found);
+
+    // The first ID of the table wins if a ROM links more than one
+    for (uint8_t i = 0; i < LIBRARY_IDS; ++i)
+    {
+      if (!(found & (1 << i)))
+        continue;
+      if (features->backup == BACKUP_NONE)
+        features->backup = library_ids[i].backup;
+      features->features |= library_ids[i].features;
+    }
+
+    // No ID with a save type: assume SRAM, as before detection existed, so
+    // a game whose string was stripped keeps its saves
+    if (features->backup == BACKUP_NONE)
+      features->backup = BACKUP_SRAM;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  features->elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 +
+    (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+
+const char *detect_backup_name(backup_type type)
+{
+  static const char *names[] =
+  {
+    "NONE", "SRAM", "FLASH 64K", "FLASH 128K", "EEPROM"
+  };
+  return names[type];
+}
@@ -1,92 +1,166 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 #include "display.h"
 
-int window_thread(void *data) {
-    Display *display = (Display *)data;
-    display->window = SDL_CreateWindow(
-      "SDL3 Finestra con Renderer",
-      800,
-      600,
-      0
-    );
-    if (!display->window) {
-      printf("Errore SDL_CreateWindow: %s\n", SDL_GetError());
-      return -1;
+
+static int window_thread(void *data)
+{
+  Display *display = data;
+
+  SDL_Window *window = SDL_CreateWindow(display->title,
+    SCREEN_WIDTH * display->scale, SCREEN_HEIGHT * display->scale,
+    SDL_WINDOW_RESIZABLE);
+  if (!window)
+  {
+    printf("SDL_CreateWindow: %s\n", SDL_GetError());
+    atomic_store(&display->running, false);
+    return -1;
+  }
+
+  SDL_Renderer *renderer = SDL_CreateRenderer(window, NULL);
+  if (!renderer)
+  {
+    printf("SDL_CreateRenderer: %s\n", SDL_GetError());
+    SDL_DestroyWindow(window);
+    atomic_store(&display->running, false);
+    return -1;
+  }
+
+  // The PPU's pixels go as they are into a texture of the GBA's size, and
+  // that is scaled up to the window keeping the aspect
+  SDL_Texture *texture = SDL_CreateTexture(renderer,
+    SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+    SCREEN_WIDTH, SCREEN_HEIGHT);
+  if (!texture)
+  {
+    printf("SDL_CreateTexture: %s\n", SDL_GetError());
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    atomic_store(&display->running, false);
+    return -1;
+  }
+  SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+  SDL_SetRenderLogicalPresentation(renderer, SCREEN_WIDTH, SCREEN_HEIGHT,
+    SDL_LOGICAL_PRESENTATION_LETTERBOX);
+
+  // With vsync, presenting waits for the refresh; without, the thread naps
+  // between pictures
+  bool vsync = SDL_SetRenderVSync(renderer, 1);
+  atomic_store(&display->vsync, vsync);
+
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  SDL_RenderClear(renderer);
+  SDL_RenderPresent(renderer);
+
+  while (atomic_load(&display->running))
+  {
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+    {
+      if (event.type == SDL_EVENT_QUIT)
+        atomic_store(&display->running, false);
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(display->window, NULL);
-    if (!renderer) {
-      printf("Errore SDL_CreateRenderer: %s\n", SDL_GetError());
-      SDL_DestroyWindow(display->window);
-      return -1;
+    const uint32_t *pixels = frame_swap_take(&display->frames);
+    if (!pixels)
+    {
+      SDL_Delay(1);
+      continue;
     }
 
-    SDL_SetRenderDrawColor(renderer, display->color.red, display->color.green, display->color.blue, 255);
+    SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
     SDL_RenderClear(renderer);
+    SDL_RenderTexture(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
+    if (vsync)
+      SDL_SignalSemaphore(display->presented);
+    else
+      SDL_Delay(1);
+  }
+
+  SDL_DestroyTexture(texture);
+  SDL_DestroyRenderer(renderer);
+  SDL_DestroyWindow(window);
+  return 0;
+}
 
-    // Ciclo eventi/rendering
-    while (display->running) {
-      SDL_Event event;
-      while (SDL_PollEvent(&event)) {
-        if (event.type == SDL_EVENT_QUIT) {
-          display->running = 0;
-        }
-      }
-
-      SDL_LockMutex(display->mutex);
-      if (display->refresh)
-      {
-        SDL_SetRenderDrawColor(renderer, display->color.red, display->color.green, display->color.blue, 255);
-        SDL_RenderClear(renderer);
-        SDL_RenderPresent(renderer);
-        display->refresh = 0;
-      }
-      SDL_UnlockMutex(display->mutex);
-
-
-      SDL_Delay(16); // ~60 fps
-    }
 
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(display->window);
-    return 0;
+bool display_init(Display *display, const char *title, uint8_t scale)
+{
+  if (!SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS))
+  {
+    printf("SDL_Init: %s\n", SDL_GetError());
+    return false;
+  }
+
+  const SDL_DisplayMode *mode =
+    SDL_GetDesktopDisplayMode(SDL_GetPrimaryDisplay());
+  display->refresh_hz = mode && mode->refresh_rate > 0 ?
+    mode->refresh_rate : 60.0;
+
+  display->title = title;
+  display->scale = scale;
+  frame_swap_init(&display->frames);
+  atomic_store(&display->running, true);
+  atomic_store(&display->vsync, false);
+
+  display->presented = SDL_CreateSemaphore(0);
+  if (!display->presented)
+  {
+    printf("SDL_CreateSemaphore: %s\n", SDL_GetError());
+    return false;
+  }
+
+  display->thread = SDL_CreateThread(window_thread, "WindowThread", display);
+  if (!display->thread)
+  {
+    printf("SDL_CreateThread: %s\n", SDL_GetError());
+    atomic_store(&display->running, false);
+    return false;
+  }
+
+  return true;
 }
 
-void display_init(Display *display, char *title, uint8_t scale)
+
+bool display_running(Display *display)
 {
-  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS);
+  return atomic_load(&display->running);
+}
 
-  display->mutex = SDL_CreateMutex();
-  display->running = 1;
-  display->refresh = 0;
-  display->thread = SDL_CreateThread(window_thread, "WindowThread", display);
 
+uint32_t *display_back_buffer(Display *display)
+{
+  return frame_swap_back(&display->frames);
 }
 
-void display_update(Display *display, int i)
+
+uint32_t *display_present(Display *display)
 {
-  uint8_t colors[][3] = 
-  {
-    {255, 0, 0},
-    {0, 255, 0},
-    {0, 0, 255},
-    {255, 0, 255},
-    {255, 255, 255}
-  };
-
-  SDL_LockMutex(display->mutex);
-  display->color.red = colors[i][0];
-  display->color.green = colors[i][1];
-  display->color.blue = colors[i][2];
-  display->refresh = 1;
-  SDL_UnlockMutex(display->mutex);
+  return frame_swap_publish(&display->frames);
+}
+
+
+bool display_wait_refresh(Display *display)
+{
+  if (!atomic_load(&display->vsync))
+    return false;
+
+  return SDL_WaitSemaphoreTimeout(display->presented, DISPLAY_WAIT_MS);
 }
 
 
 void display_destroy(Display *display)
 {
-  display->running = 0;
+  atomic_store(&display->running, false);
+  if (display->thread)
+    SDL_WaitThread(display->thread, NULL);
+  display->thread = NULL;
+
+  if (display->presented)
+    SDL_DestroySemaphore(display->presented);
+  display->presented = NULL;
 }
@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "dma.h"
+#include "io.h"
+#include "bus.h"
+#include "arena.h"
+#include "backup.h"
+#include "scheduler.h"
+
+
+// DMAxCNT_H:
+//
+//  Bit   Expl.
+//  0-4   Not used
+//  5-6   Dest Addr Control  (0=Increment,1=Decrement,2=Fixed,3=Increment/Reload)
+//  7-8   Source Adr Control (0=Increment,1=Decrement,2=Fixed,3=Prohibited)
+//  9     DMA Repeat                   (0=Off, 1=On) (Must be zero if Bit 11 set)
+//  10    DMA Transfer Type            (0=16bit, 1=32bit)
+//  11    Game Pak DRQ  - DMA3 only -  (0=Normal, 1=DRQ <from> Game Pak, DMA3)
+//  12-13 DMA Start Timing  (0=Immediately, 1=VBlank, 2=HBlank, 3=Special)
+//  14    IRQ upon end of Word Count   (0=Disable, 1=Enable)
+//  15    DMA Enable                   (0=Off, 1=On)
+
+#define DMA_CTRL_INCREMENT  0
+#define DMA_CTRL_DECREMENT  1
+#define DMA_CTRL_FIXED      2
+#define DMA_CTRL_RELOAD     3
+
+#define DMA_REPEAT          0x0200
+#define DMA_WORD            0x0400
+#define DMA_IRQ             0x4000
+#define DMA_ENABLE          0x8000
+
+#define DMA_DEST_CTRL(control)  (((control) >> 5) & 0x3)
+#define DMA_SRC_CTRL(control)   (((control) >> 7) & 0x3)
+#define DMA_TIMING(control)     (((control) >> 12) & 0x3)
+
+#define REG(channel, reg) ((reg) + (channel) * DMA_REG_STRIDE)
+
+// An immediate transfer starts this many cycles after the enabling write
+#define DMA_START_DELAY 2
+
+
+static const uint32_t source_masks[4] =
+  { 0x07FFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+
+static const uint32_t destination_masks[4] =
+  { 0x07FFFFFF, 0x07FFFFFF, 0x07FFFFFF, 0x0FFFFFFF };
+
+static const uint32_t count_masks[4] =
+  { 0x3FFF, 0x3FFF, 0x3FFF, 0xFFFF };
+
+
+static uint32_t read_reg_word(uint32_t address)
+{
+  return io_get(address) | (io_get(address + 2) << 16);
+}
+
+static uint32_t latch_count(uint8_t channel)
+{
+  uint32_t count = io_get(REG(channel, REG_DMA0CNT_L)) & count_masks[channel];
+  return count ? count : count_masks[channel] + 1;
+}
+
+static int32_t address_step(uint8_t control, uint8_t unit)
+{
+  switch (control)
+  {
+  case DMA_CTRL_DECREMENT:
+    return -unit;
+
+  case DMA_CTRL_FIXED:
+    return 0;
+
+  default:
+    return unit;
+  }
+}
+
+
+static void dma_transfer(uint8_t channel);
+
+static void dma_start(uint64_t timestamp)
+{
+  (void)timestamp;
+
+  // Lower channels have priority
+  for (uint8_t channel = 0; channel < 4; ++channel)
+  {
+    if (!arena.dma[channel].pending)
+      continue;
+
+    // The game may have disabled it again in the meantime
+    arena.dma[channel].pending = false;
+    if (io_get(REG(channel, REG_DMA0CNT_H)) & DMA_ENABLE)
+      dma_transfer(channel);
+  }
+}
+
+
+void dma_init()
+{
+  memset(arena.dma, 0, sizeof(arena.dma));
+  scheduler_register(EVENT_DMA, dma_start);
+}
+
+
+
+// Plain memory to plain memory with both addresses going up (or a fixed
+// source, which is a fill) can be done on the host in one go. Anything else,
+// like I/O ports, Game Pak backup or overlapping forward copies, takes the
+// per-unit path.
+static bool fast_transfer(uint32_t source, uint32_t destination,
+  int32_t source_step, int32_t destination_step, uint32_t count, uint8_t unit)
+{
+  uint32_t length = count * unit;
+
+  if (destination_step != unit || source_step < 0)
+    return false;
+
+  if (source_step == 0)
+  {
+    uint8_t *dst = bus_host_pointer(destination, length, true);
+    uint8_t *src = bus_host_pointer(source, unit, false);
+    if (!dst || !src)
+      return false;
+
+    if (unit == 4)
+    {
+      uint32_t value = *((uint32_t *)src);
+      for (uint32_t i = 0; i < count; ++i)
+        ((uint32_t *)dst)[i] = value;
+    }
+    else
+    {
+      uint16_t value = *((uint16_t *)src);
+      for (uint32_t i = 0; i < count; ++i)
+        ((uint16_t *)dst)[i] = value;
+    }
+    return true;
+  }
+
+  uint8_t *dst = bus_host_pointer(destination, length, true);
+  uint8_t *src = bus_host_pointer(source, length, false);
+  if (!dst || !src)
+    return false;
+
+  // The hardware copies forward: only a destination ahead of the source
+  // inside the same block behaves differently from memmove
+  if (dst > src && dst < src + length)
+    return false;
+
+  memmove(dst, src, length);
+  return true;
+}
+
+
+static void slow_transfer(uint32_t source, uint32_t destination,
+  int32_t source_step, int32_t destination_step, uint32_t count, uint8_t unit)
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    if (unit == 4)
+      bus_write_word(destination, bus_read_word(source));
+    else
+      bus_write_halfword(destination, bus_read_halfword(source));
+
+    source += source_step;
+    destination += destination_step;
+  }
+}
+
+
+static void dma_transfer(uint8_t channel)
+{
+  dma_channel *dma = &arena.dma[channel];
+  uint16_t control = io_get(REG(channel, REG_DMA0CNT_H));
+
+  uint8_t timing = DMA_TIMING(control);
+  bool fifo = timing == DMA_TIMING_SPECIAL && (channel == 1 || channel == 2);
+
+  // Sound FIFO transfers always move 4 words to a fixed address
+  bool word = fifo || (control & DMA_WORD);
+  uint8_t unit = word ? 4 : 2;
+  uint32_t count = fifo ? 4 : dma->count;
+
+  int32_t source_step = address_step(DMA_SRC_CTRL(control), unit);
+  int32_t destination_step = fifo ? 0 :
+    address_step(DMA_DEST_CTRL(control), unit);
+
+  uint32_t source = dma->source & ~(unit - 1);
+  uint32_t destination = dma->destination & ~(unit - 1);
+
+  if ((source >> 24) == 0x0D || (destination >> 24) == 0x0D)
+    backup_eeprom_dma(count);
+
+  if (!fast_transfer(source, destination, source_step, destination_step,
+    count, unit))
+  {
+    // The bus bills Game Pak reads on its own, the DMA cost below covers them
+    uint64_t cycles = arena.emu.cycles;
+    slow_transfer(source, destination, source_step, destination_step,
+      count, unit);
+    arena.emu.cycles = cycles;
+  }
+
+  dma->source += source_step * count;
+  dma->destination += destination_step * count;
+
+  // 2N + 2(n-1)S + xI
+  uint32_t cycles = bus_access_cycles(source, word, false) +
+    bus_access_cycles(destination, word, false) +
+    (count - 1) * (bus_access_cycles(source, word, true) +
+    bus_access_cycles(destination, word, true)) + 2;
+  if (source >= 0x08000000 && destination >= 0x08000000)
+    cycles += 2;
+  arena.emu.cycles += cycles;
+
+  if ((control & DMA_REPEAT) && timing != DMA_TIMING_IMMEDIATE)
+  {
+    dma->count = latch_count(channel);
+    if (DMA_DEST_CTRL(control) == DMA_CTRL_RELOAD)
+      dma->destination = read_reg_word(REG(channel, REG_DMA0DAD)) &
+        destination_masks[channel];
+  }
+  else
+  {
+    io_set(REG(channel, REG_DMA0CNT_H), control & ~DMA_ENABLE);
+  }
+
+  if (control & DMA_IRQ)
+    io_request_interrupt(IRQ_DMA0 + channel);
+}
+
+
+void dma_write_control(uint8_t channel, uint16_t old, uint16_t value)
+{
+  if ((old & DMA_ENABLE) || !(value & DMA_ENABLE))
+    return;
+
+  dma_channel *dma = &arena.dma[channel];
+  dma->source = read_reg_word(REG(channel, REG_DMA0SAD)) &
+    source_masks[channel];
+  dma->destination = read_reg_word(REG(channel, REG_DMA0DAD)) &
+    destination_masks[channel];
+  dma->count = latch_count(channel);
+
+  if (DMA_TIMING(value) == DMA_TIMING_IMMEDIATE)
+  {
+    dma->pending = true;
+    scheduler_schedule(EVENT_DMA, scheduler_now() + DMA_START_DELAY);
+  }
+}
+
+
+
+static void dma_trigger(uint8_t timing)
+{
+  // Lower channels have priority
+  for (uint8_t channel = 0; channel < 4; ++channel)
+  {
+    uint16_t control = io_get(REG(channel, REG_DMA0CNT_H));
+    if ((control & DMA_ENABLE) && DMA_TIMING(control) == timing)
+      dma_transfer(channel);
+  }
+}
+
+void dma_on_vblank()
+{
+  dma_trigger(DMA_TIMING_VBLANK);
+}
+
+void dma_on_hblank()
+{
+  dma_trigger(DMA_TIMING_HBLANK);
+}
+
+void dma_on_fifo(uint8_t fifo)
+{
+  uint32_t fifo_address = 0x04000000 | (fifo ? REG_FIFO_B : REG_FIFO_A);
+
+  for (uint8_t channel = 1; channel <= 2; ++channel)
+  {
+    uint16_t control = io_get(REG(channel, REG_DMA0CNT_H));
+    if ((control & DMA_ENABLE) &&
+      DMA_TIMING(control) == DMA_TIMING_SPECIAL &&
+      arena.dma[channel].destination == fifo_address)
+    {
+      dma_transfer(channel);
+    }
+  }
+}
+
+void dma_on_video_capture(uint16_t line)
+{
+  uint16_t control = io_get(REG_DMA3CNT_H);
+  if (!(control & DMA_ENABLE) || DMA_TIMING(control) != DMA_TIMING_SPECIAL)
+    return;
+
+  // Video capture runs from line 2 to 161 and stops by itself
+  if (line >= 2 && line < 162)
+    dma_transfer(3);
+  else if (line == 162)
+    io_set(REG_DMA3CNT_H, control & ~DMA_ENABLE);
+}
@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdbool.h>
-
-#include <SDL3/SDL.h>
+#include <string.h>
 
 #include "emulator.h"
 #include "cartridge.h"
@@ -10,69 +9,154 @@
 #include "instructions.h"
 #include "bus.h"
 #include "bios.h"
+#include "io.h"
+#include "dma.h"
+#include "ppu.h"
+#include "apu.h"
+#include "timer.h"
+#include "arena.h"
+#include "scheduler.h"
+#include "backup.h"
 
-#include "display.h"
 
+// Everything emu_run_frames can produce: the APU is drained after every
+// frame, so nothing is left in its buffer to overflow. A frame holds 548.6
+// samples, one more is for the fraction; APU_BUFFER_FRAMES covers whatever
+// was left over before the call.
+#define AUDIO_CAPACITY (EMU_MAX_RUN_FRAMES * \
+  (EMU_CYCLES_PER_FRAME / APU_CYCLES_PER_SAMPLE + 1) + APU_BUFFER_FRAMES)
 
+static int16_t audio[AUDIO_CAPACITY * 2];
 
-static emu_context ctx;
-static Display display;
 
 emu_context *emu_get_context()
 {
-  return &ctx;
+  return &arena.emu;
 }
 
 
-int emu_run(int argc, char **argv)
+// "game.gba" -> "game.sav", next to the ROM
+static void save_path_for(const char *rom_path, char *save_path, size_t size)
 {
-  cpu_init();
+  snprintf(save_path, size, "%s", rom_path);
+
+  char *extension = strrchr(save_path, '.');
+  char *directory = strrchr(save_path, '/');
+  if (extension && (!directory || extension > directory))
+    *extension = 0;
 
-  ctx.running = true;
-  ctx.paused = false;
-  ctx.ticks = 0;
+  strncat(save_path, ".sav", size - strlen(save_path) - 1);
+}
 
-  //load_bios("../bios/gba_bios.bin");
-  load_cartridge("../roms/arm.gba");
-  //load_cartridge("../roms/thumb.gba");
-  //load_cartridge("../roms/memory.gba");
 
-  
-  while (ctx.running)
+bool emu_init(char *rom_path, char *bios_path, bool boot_bios)
+{
+  arena_init();
+  scheduler_init();
+  load_bios(bios_path);
+
+  // The built-in BIOS has no boot intro to play
+  bool skip_bios = !boot_bios || bios_is_builtin();
+
+  cpu_init(skip_bios);
+  bus_init();
+  io_init();
+  dma_init();
+  timer_init();
+  ppu_init();
+  apu_init();
+
+  if (skip_bios)
+    bios_post_boot_state();
+
+  arena.emu.running = true;
+  arena.emu.paused = false;
+  arena.emu.ticks = 0;
+  arena.emu.frames = 0;
+  arena.emu.frame_end = 0;
+
+  if (!load_cartridge(rom_path))
+    return false;
+
+  char save_path[512];
+  save_path_for(rom_path, save_path, sizeof(save_path));
+  if (!backup_init(cartridge_get_features()->backup, save_path,
+    cartridge_rom_size()))
   {
+    printf("Saves will not be kept\n");
+  }
 
-    if (!cpu_step())
+  return true;
+}
+
+
+void emu_shutdown()
+{
+  ppu_set_render_thread(false);
+  ppu_set_render_bands(1);
+  backup_destroy();
+  dealloc_cartridge();
+}
+
+
+// Runs up to the end of the current frame's budget. The budget moves by
+// exactly one frame each time, whatever the last instruction overshot by,
+// so frames never drift from the display timing.
+static emu_status run_frame()
+{
+  arena.emu.frame_end += EMU_CYCLES_PER_FRAME;
+
+  while (arena.emu.cycles < arena.emu.frame_end)
+  {
+    // The hardware only gets looked at when its next deadline comes
+    if (arena.emu.cycles >= scheduler_next())
     {
-      printf("CPU stopped!\n");
-      cpu_print_failed_test();
-      return -3;
+      scheduler_dispatch();
+      continue;
     }
 
-    // 133
-    // 636
-    // 560
-    // 124
-    if (ctx.ticks++ == 1)
-      break;
-    
-  }
+    // Halted: there is nothing to execute until an event wakes the CPU
+    if (arena.cpu.halted)
+    {
+      uint64_t next = scheduler_next();
+      arena.emu.cycles = next < arena.emu.frame_end ? next : arena.emu.frame_end;
+      continue;
+    }
 
-  display_init(&display, "Prova", 3);
-  for (int i = 0; i < 5; ++i)
-  {
-    display_update(&display, i);
-    SDL_Delay(1000);
+    if (!cpu_step())
+      return EMU_BREAKPOINT;
+    arena.emu.ticks++;
   }
 
-  SDL_Delay(2000);
-  display_destroy(&display);
-  
-  SDL_WaitThread(display.thread, NULL);
+  arena.emu.frames++;
+  return EMU_FRAME_DONE;
+}
 
-  dealloc_cartridge();
 
-  return 0;
-}
+emu_frame emu_run_frames(uint32_t count)
+{
+  emu_frame frame = { .status = EMU_FRAME_DONE };
+
+  if (count > EMU_MAX_RUN_FRAMES)
+    count = EMU_MAX_RUN_FRAMES;
+
+  for (uint32_t i = 0; i < count && frame.status == EMU_FRAME_DONE; ++i)
+  {
+    frame.status = run_frame();
+    frame.audio_frames += apu_take_samples(&audio[frame.audio_frames * 2],
+      AUDIO_CAPACITY - frame.audio_frames);
+  }
 
+  // The render thread may still be a few lines behind
+  ppu_sync();
+  frame.framebuffer = ppu_framebuffer();
+  frame.audio = audio;
+  frame.frame = arena.emu.frames;
+  return frame;
+}
 
 
+emu_frame emu_run_frame()
+{
+  return emu_run_frames(1);
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_hash.h"
+#include "ppu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_X86
+#endif
+
+
+#define STRIPE_SIZE         64
+#define STRIPES_PER_BLOCK   16
+#define BLOCK_SIZE          (STRIPE_SIZE * STRIPES_PER_BLOCK)
+
+#define PRIME32_1           0x9E3779B1u
+#define PRIME64_1           0x9E3779B185EBCA87ull
+#define PRIME64_2           0xC2B2AE3D27D4EB4Full
+
+
+// Stripe s of a block takes keys[s] to keys[s + 7]; the scramble at the
+// end of the block the 8 after those
+#define KEY_COUNT           (STRIPES_PER_BLOCK + 16)
+
+typedef void (*accumulate_kernel)(uint64_t acc[8], const uint8_t *data,
+  uint32_t stripes);
+
+static uint64_t keys[KEY_COUNT];
+static accumulate_kernel accumulate;
+
+
+
+static uint64_t read64(const uint8_t *p)
+{
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+// Each lane adds the product of the low and high halves of data ^ key, and
+// its neighbour the data itself, so that no input byte can cancel out
+static void accumulate_scalar(uint64_t acc[8], const uint8_t *data,
+  uint32_t stripes)
+{
+  for (uint32_t s = 0; s < stripes; ++s, data += STRIPE_SIZE)
+  {
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+      uint64_t value = read64(data + i * 8);
+      uint64_t mixed = value ^ keys[s + i];
+      acc[i ^ 1] += value;
+      acc[i] += (mixed & 0xFFFFFFFF) * (mixed >> 32);
+    }
+  }
+}
+
+#ifdef HASH_X86
+
+// Two lanes per register: the swap of the 64 bit halves is the i ^ 1
+static void accumulate_sse2(uint64_t acc[8], const uint8_t *data,
+  uint32_t stripes)
+{
+  __m128i sums[4];
+  for (uint32_t i = 0; i < 4; ++i)
+    sums[i] = _mm_loadu_si128((const __m128i *)(acc + i * 2));
+
+  for (uint32_t s = 0; s < stripes; ++s, data += STRIPE_SIZE)
+  {
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+      __m128i value = _mm_loadu_si128((const __m128i *)(data + i * 16));
+      __m128i key = _mm_loadu_si128((const __m128i *)(keys + s + i * 2));
+      __m128i mixed = _mm_xor_si128(value, key);
+      __m128i product = _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32));
+      __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+      sums[i] = _mm_add_epi64(sums[i], _mm_add_epi64(product, swapped));
+    }
+  }
+
+  for (uint32_t i = 0; i < 4; ++i)
+    _mm_storeu_si128((__m128i *)(acc + i * 2), sums[i]);
+}
+
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t acc[8], const uint8_t *data,
+  uint32_t stripes)
+{
+  __m256i sums[2];
+  for (uint32_t i = 0; i < 2; ++i)
+    sums[i] = _mm256_loadu_si256((const __m256i *)(acc + i * 4));
+
+  for (uint32_t s = 0; s < stripes; ++s, data += STRIPE_SIZE)
+  {
+    for (uint32_t i = 0; i < 2; ++i)
+    {
+      __m256i value = _mm256_loadu_si256((const __m256i *)(data + i * 32));
+      __m256i key = _mm256_loadu_si256((const __m256i *)(keys + s + i * 4));
+      __m256i mixed = _mm256_xor_si256(value, key);
+      __m256i product = _mm256_mul_epu32(mixed,
+        _mm256_srli_epi64(mixed, 32));
+      __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+      sums[i] = _mm256_add_epi64(sums[i], _mm256_add_epi64(product, swapped));
+    }
+  }
+
+  for (uint32_t i = 0; i < 2; ++i)
+    _mm256_storeu_si256((__m256i *)(acc + i * 4), sums[i]);
+}
+
+#endif
+
+
+static void scramble(uint64_t acc[8])
+{
+  for (uint32_t i = 0; i < 8; ++i)
+  {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= keys[STRIPES_PER_BLOCK + i];
+    acc[i] *= PRIME32_1;
+  }
+}
+
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ull;
+  return h ^ (h >> 32);
+}
+
+
+void frame_hash_init()
+{
+  // Fixed keys: the same on every run and every host
+  uint64_t seed = PRIME64_2;
+  for (uint32_t i = 0; i < KEY_COUNT; ++i)
+  {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    keys[i] = z ^ (z >> 31);
+  }
+
+  accumulate = accumulate_scalar;
+#ifdef HASH_X86
+  accumulate = __builtin_cpu_supports("avx2") ? accumulate_avx2 :
+    accumulate_sse2;
+#endif
+}
+
+
+uint64_t frame_hash(const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+  uint64_t acc[8] =
+  {
+    PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_1 ^ PRIME64_2,
+    PRIME64_2 >> 3, PRIME32_1 << 7, PRIME64_1 >> 5, PRIME64_2 ^ PRIME32_1
+  };
+
+  size_t left = size;
+  for (; left >= BLOCK_SIZE; left -= BLOCK_SIZE, bytes += BLOCK_SIZE)
+  {
+    accumulate(acc, bytes, STRIPES_PER_BLOCK);
+    scramble(acc);
+  }
+
+  // The stripes left, then the last bytes padded with zeros: the length
+  // goes in the result, so the padding cannot collide with real zeros
+  accumulate(acc, bytes, left / STRIPE_SIZE);
+  bytes += left / STRIPE_SIZE * STRIPE_SIZE;
+  left %= STRIPE_SIZE;
+  if (left)
+  {
+    uint8_t last[STRIPE_SIZE] = { 0 };
+    memcpy(last, bytes, left);
+    accumulate(acc, last, 1);
+  }
+
+  uint64_t h = size * PRIME64_1;
+  for (uint32_t i = 0; i < 8; i += 2)
+    h += mix(acc[i] ^ keys[STRIPES_PER_BLOCK + 8 + i],
+      acc[i + 1] ^ keys[STRIPES_PER_BLOCK + 9 + i]);
+
+  return avalanche(h);
+}
+
+
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A frame of noise, as a scene would give
+void frame_hash_benchmark()
+{
+  static uint32_t frame[SCREEN_WIDTH * SCREEN_HEIGHT];
+  const uint32_t rounds = 2000;
+
+  struct
+  {
+    const char *name;
+    accumulate_kernel kernel;
+  } kernels[] =
+  {
+    { "scalar", accumulate_scalar },
+#ifdef HASH_X86
+    { "sse2", accumulate_sse2 },
+    { "avx2", accumulate_avx2 },
+#endif
+  };
+
+  frame_hash_init();
+  accumulate_kernel chosen = accumulate;
+
+  uint32_t seed = 0x2468ACE0;
+  for (uint32_t i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i)
+  {
+    seed = seed * 1664525 + 1013904223;
+    frame[i] = seed;
+  }
+
+  uint64_t reference = 0;
+  for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+  {
+#ifdef HASH_X86
+    if (!strcmp(kernels[k].name, "avx2") && !__builtin_cpu_supports("avx2"))
+      continue;
+#endif
+    accumulate = kernels[k].kernel;
+
+    uint64_t h = frame_hash(frame, sizeof(frame));
+    if (!k)
+      reference = h;
+
+    volatile uint64_t sink = 0;
+    double start = now();
+    for (uint32_t i = 0; i < rounds; ++i)
+      sink ^= frame_hash(frame, sizeof(frame));
+    double us = (now() - start) * 1e6 / rounds;
+
+    printf("frame hash %-6s: %.2f us/frame, %.1f GB/s%s\n", kernels[k].name,
+      us, sizeof(frame) / us / 1e3, h == reference ? "" : " MISMATCH");
+  }
+
+  accumulate = chosen;
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "frame_swap.h"
+
+
+void frame_swap_init(frame_swap *s)
+{
+  memset(s->pixels, 0, sizeof(s->pixels));
+  s->back = 0;
+  s->front = 1;
+  atomic_store(&s->spare, 2);
+}
+
+
+uint32_t *frame_swap_back(frame_swap *s)
+{
+  return s->pixels[s->back];
+}
+
+
+// Release so the consumer sees the picture, acquire so the buffer coming
+// back is no longer read
+uint32_t *frame_swap_publish(frame_swap *s)
+{
+  uint32_t old = atomic_exchange_explicit(&s->spare,
+    s->back | FRAME_SWAP_FRESH, memory_order_acq_rel);
+  s->back = old & 3;
+  return s->pixels[s->back];
+}
+
+
+const uint32_t *frame_swap_take(frame_swap *s)
+{
+  if (!(atomic_load_explicit(&s->spare, memory_order_relaxed) &
+    FRAME_SWAP_FRESH))
+  {
+    return NULL;
+  }
+
+  uint32_t old = atomic_exchange_explicit(&s->spare, s->front,
+    memory_order_acq_rel);
+  s->front = old & 3;
+  return s->pixels[s->front];
+}
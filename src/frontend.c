@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL3/SDL.h>
+
+#include "frontend.h"
+#include "emulator.h"
+#include "cpu.h"
+#include "apu.h"
+#include "ppu.h"
+#include "pacer.h"
+#include "options.h"
+#include "hash_log.h"
+
+#include "display.h"
+
+
+
+// About 3 frames of sound queued ahead: enough to ride out scheduling
+// hiccups, little enough not to lag behind the picture
+#define AUDIO_TARGET_FRAMES 1650
+
+
+static Display display;
+static SDL_AudioStream *audio_stream;
+static hash_log hashes;
+
+
+static uint32_t audio_queued(void *user)
+{
+  (void)user;
+  return SDL_GetAudioStreamQueued(audio_stream) / (2 * sizeof(int16_t));
+}
+
+static bool wait_refresh(void *user)
+{
+  (void)user;
+  return display_wait_refresh(&display);
+}
+
+static bool audio_open()
+{
+  SDL_AudioSpec spec = { SDL_AUDIO_S16, 2, APU_SAMPLE_RATE };
+
+  SDL_Init(SDL_INIT_AUDIO);
+  audio_stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK,
+    &spec, NULL, NULL);
+  if (!audio_stream)
+  {
+    printf("No audio output: %s\n", SDL_GetError());
+    return false;
+  }
+
+  SDL_ResumeAudioStreamDevice(audio_stream);
+  return true;
+}
+
+
+// The window goes last: the emulator stops drawing into its buffers first
+static void frontend_shutdown()
+{
+  if (audio_stream)
+    SDL_DestroyAudioStream(audio_stream);
+  hash_log_close(&hashes);
+  ppu_set_output(NULL);
+  emu_shutdown();
+  display_destroy(&display);
+}
+
+
+int emu_run(const options *o)
+{
+  pace_mode pace = o->pace;
+  if (!options_start(o))
+    return -1;
+
+  // Without an audio device there is no audio clock to follow
+  if (pace == PACE_AUDIO && !audio_open())
+    pace = PACE_MULTIPLIER;
+
+  // The PPU draws straight into the display's back buffer, which is handed
+  // over whole at the end of each frame
+  bool window = display_init(&display, "myEmulator", 3);
+  if (window)
+    ppu_set_output(display_back_buffer(&display));
+
+  pacer pacer;
+  pacer_init(&pacer, pace, o->multiplier);
+  if (audio_stream)
+    pacer_set_audio(&pacer, audio_queued, NULL, AUDIO_TARGET_FRAMES);
+  if (window)
+  {
+    pacer_set_refresh(&pacer, display.refresh_hz);
+    pacer_set_display(&pacer, wait_refresh, NULL);
+  }
+
+  if (o->hash_log && !hash_log_open(&hashes, o->hash_log))
+    printf("Could not write %s\n", o->hash_log);
+
+  while (emu_get_context()->running && (!window || display_running(&display)))
+  {
+    emu_frame frame = emu_run_frame();
+    if (hashes.file)
+      hash_log_frame(&hashes, &frame);
+
+    if (window)
+      ppu_set_output(display_present(&display));
+
+    if (audio_stream)
+      SDL_PutAudioStreamData(audio_stream, frame.audio,
+        frame.audio_frames * 2 * sizeof(int16_t));
+
+    pacer_frame(&pacer);
+    if (pacer_speed_updated(&pacer))
+    {
+      const tile_cache_stats *tiles = ppu_tile_cache_stats();
+      uint32_t lookups = tiles->hits + tiles->misses;
+
+      printf("Speed: %.1f%% (%s), tile cache hits: %.1f%%\n",
+        pacer_speed(&pacer) * 100, pacer_mode_name(pace),
+        lookups ? tiles->hits * 100.0 / lookups : 100.0);
+    }
+
+    if (frame.status == EMU_BREAKPOINT)
+    {
+      printf("Breakpoint reached\n");
+      cpu_print_failed_test();
+      frontend_shutdown();
+      return -3;
+    }
+  }
+
+  frontend_shutdown();
+  return 0;
+}
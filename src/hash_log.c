@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "hash_log.h"
+#include "frame_hash.h"
+#include "ppu.h"
+
+
+static const char magic[8] = { 'G', 'B', 'A', 'H', 'A', 'S', 'H', 1 };
+static const char csv_header[] = "frame,video,audio\n";
+
+
+static bool is_csv(const char *path)
+{
+  size_t length = strlen(path);
+  return length >= 4 && !strcmp(path + length - 4, ".csv");
+}
+
+static void write64(uint8_t *p, uint64_t value)
+{
+  for (uint32_t i = 0; i < 8; ++i)
+    p[i] = value >> (i * 8);
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+  uint64_t value = 0;
+  for (uint32_t i = 0; i < 8; ++i)
+    value |= (uint64_t)p[i] << (i * 8);
+  return value;
+}
+
+
+bool hash_log_open(hash_log *log, const char *path)
+{
+  frame_hash_init();
+
+  log->csv = is_csv(path);
+  log->file = fopen(path, log->csv ? "w" : "wb");
+  if (!log->file)
+    return false;
+
+  if (log->csv)
+    fputs(csv_header, log->file);
+  else
+    fwrite(magic, 1, sizeof(magic), log->file);
+  return true;
+}
+
+
+void hash_log_frame(hash_log *log, const emu_frame *frame)
+{
+  hash_record record =
+  {
+    .frame = frame->frame,
+    .video = frame_hash(frame->framebuffer,
+      SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t)),
+    .audio = frame_hash(frame->audio,
+      frame->audio_frames * 2 * sizeof(int16_t))
+  };
+
+  if (log->csv)
+  {
+    fprintf(log->file, "%" PRIu64 ",%016" PRIx64 ",%016" PRIx64 "\n",
+      record.frame, record.video, record.audio);
+    return;
+  }
+
+  uint8_t bytes[24];
+  write64(bytes, record.frame);
+  write64(bytes + 8, record.video);
+  write64(bytes + 16, record.audio);
+  fwrite(bytes, 1, sizeof(bytes), log->file);
+}
+
+
+void hash_log_close(hash_log *log)
+{
+  if (log->file)
+    fclose(log->file);
+  log->file = NULL;
+}
+
+
+// The format goes by the header, not by the name
+bool hash_log_open_read(hash_log *log, const char *path)
+{
+  log->file = fopen(path, "rb");
+  if (!log->file)
+    return false;
+
+  char header[sizeof(magic)];
+  size_t read = fread(header, 1, sizeof(header), log->file);
+  log->csv = read != sizeof(header) || memcmp(header, magic, sizeof(magic));
+  if (log->csv)
+  {
+    rewind(log->file);
+    char line[64];
+    if (!fgets(line, sizeof(line), log->file) || strcmp(line, csv_header))
+      rewind(log->file);
+  }
+  return true;
+}
+
+
+bool hash_log_read(hash_log *log, hash_record *record)
+{
+  if (log->csv)
+    return fscanf(log->file, "%" SCNu64 ",%" SCNx64 ",%" SCNx64,
+      &record->frame, &record->video, &record->audio) == 3;
+
+  uint8_t bytes[24];
+  if (fread(bytes, 1, sizeof(bytes), log->file) != sizeof(bytes))
+    return false;
+  record->frame = read64(bytes);
+  record->video = read64(bytes + 8);
+  record->audio = read64(bytes + 16);
+  return true;
+}
+
+
+int hash_log_compare(const char *path_a, const char *path_b)
+{
+  hash_log a, b;
+  if (!hash_log_open_read(&a, path_a))
+  {
+    printf("Could not read %s\n", path_a);
+    return -1;
+  }
+  if (!hash_log_open_read(&b, path_b))
+  {
+    printf("Could not read %s\n", path_b);
+    hash_log_close(&a);
+    return -1;
+  }
+
+  int status = 0;
+  uint64_t frames = 0;
+  while (true)
+  {
+    hash_record ra, rb;
+    bool more_a = hash_log_read(&a, &ra);
+    bool more_b = hash_log_read(&b, &rb);
+
+    if (!more_a || !more_b)
+    {
+      if (more_a != more_b)
+      {
+        printf("%s ends after %" PRIu64 " frames\n",
+          more_a ? path_b : path_a, frames);
+        status = 1;
+      }
+      break;
+    }
+
+    if (ra.frame != rb.frame || ra.video != rb.video ||
+      ra.audio != rb.audio)
+    {
+      printf("First divergent frame: %" PRIu64 "%s%s%s\n", ra.frame,
+        ra.frame != rb.frame ? " (frame numbers differ)" : "",
+        ra.video != rb.video ? " (video)" : "",
+        ra.audio != rb.audio ? " (audio)" : "");
+      status = 1;
+      break;
+    }
+    ++frames;
+  }
+
+  if (!status)
+    printf("%" PRIu64 " frames, identical\n", frames);
+
+  hash_log_close(&a);
+  hash_log_close(&b);
+  return status;
+}
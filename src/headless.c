@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "headless.h"
+#include "emulator.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "pacer.h"
+#include "hash_log.h"
+
+
+void headless_attach(uint32_t *pixels)
+{
+  ppu_set_output(pixels);
+}
+
+
+void headless_detach()
+{
+  ppu_set_output(NULL);
+}
+
+
+bool headless_write_ppm(const uint32_t *pixels, const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+
+  fprintf(file, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+  for (uint32_t i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i)
+  {
+    uint8_t rgb[3] = { pixels[i] >> 16, pixels[i] >> 8, pixels[i] };
+    fwrite(rgb, 1, sizeof(rgb), file);
+  }
+
+  return fclose(file) == 0;
+}
+
+
+int headless_run(const options *o)
+{
+  static uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+  if (!options_start(o))
+    return -1;
+  headless_attach(pixels);
+
+  // No audio device and no display to follow
+  pace_mode pace = o->pace;
+  if (pace == PACE_AUDIO || pace == PACE_DISPLAY)
+    pace = PACE_UNTHROTTLED;
+
+  pacer pacer;
+  pacer_init(&pacer, pace, o->multiplier);
+
+  hash_log hashes = { NULL };
+  if (o->hash_log && !hash_log_open(&hashes, o->hash_log))
+    printf("Could not write %s\n", o->hash_log);
+
+  int status = 0;
+  for (uint64_t frames = 0; emu_get_context()->running &&
+    (!o->frames || frames < o->frames); ++frames)
+  {
+    emu_frame frame = emu_run_frame();
+    if (hashes.file)
+      hash_log_frame(&hashes, &frame);
+
+    pacer_frame(&pacer);
+    if (pacer_speed_updated(&pacer))
+      printf("Speed: %.1f%% (%s)\n", pacer_speed(&pacer) * 100,
+        pacer_mode_name(pace));
+
+    if (frame.status == EMU_BREAKPOINT)
+    {
+      printf("Breakpoint reached\n");
+      cpu_print_failed_test();
+      status = -3;
+      break;
+    }
+  }
+
+  if (o->screenshot && !headless_write_ppm(pixels, o->screenshot))
+    printf("Could not write %s\n", o->screenshot);
+
+  hash_log_close(&hashes);
+  emu_shutdown();
+  headless_detach();
+  return status;
+}
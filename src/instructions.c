@@ -4,6 +4,8 @@
 #include "instructions.h"
 #include "cpu.h"
 #include "bus.h"
+#include "io.h"
+#include "bios.h"
 #include "alu.h"
 
 
@@ -166,14 +168,14 @@ void switch_mode(cpu_context *cpu, uint8_t mode)
   switch (mode)
   {
   case 0x00:
-    printf("Switching to OLD USER MODE\n");
+    TRACE("Switching to OLD USER MODE\n");
     // not implemented
     fprintf(stderr, "OLD USER mode not yet implemented\n");
     exit(EXIT_FAILURE);
     break;
   
   case 0x11:
-    printf("Switching to FIQ MODE\n");
+    TRACE("Switching to FIQ MODE\n");
     cpu->current_SPSR = &cpu->SPSR_fiq;
     *cpu->current_SPSR = cpu->CPSR;
     for(int i = 8; i < 15; ++i)
@@ -183,7 +185,7 @@ void switch_mode(cpu_context *cpu, uint8_t mode)
     break;
   
   case 0x1F:
-    printf("Switching to SYSTEM MODE\n");
+    TRACE("Switching to SYSTEM MODE\n");
     if(cpu->current_SPSR == NULL)
     {
       fprintf(stderr, "Tying to switch to SYS mode but current spsr is null!\n");
@@ -197,6 +199,16 @@ void switch_mode(cpu_context *cpu, uint8_t mode)
     }
     break;
   
+  case 0x12:
+    TRACE("Switching to IRQ MODE\n");
+    bank_registers(cpu, 0x12);
+    break;
+
+  case 0x13:
+    TRACE("Switching to SUPERVISOR MODE\n");
+    bank_registers(cpu, 0x13);
+    break;
+
   default:
     fprintf(stderr, "Invalid mode set!\n");
     exit(EXIT_FAILURE);
@@ -204,6 +216,74 @@ void switch_mode(cpu_context *cpu, uint8_t mode)
 }
 
 
+// Points r8-r14 and the SPSR at the bank of the given mode. The CPSR is left
+// to the caller.
+void bank_registers(cpu_context *cpu, uint8_t mode)
+{
+  for (int i = 8; i < 15; ++i)
+    cpu->regs[i] = &cpu->regs_sys_usr[i];
+
+  switch (mode)
+  {
+  case 0x11:
+    for (int i = 8; i < 15; ++i)
+      cpu->regs[i] = &cpu->regs_fiq[i - 8];
+    cpu->current_SPSR = &cpu->SPSR_fiq;
+    break;
+
+  case 0x12:
+    cpu->regs[13] = &cpu->regs_irq[0];
+    cpu->regs[14] = &cpu->regs_irq[1];
+    cpu->current_SPSR = &cpu->SPSR_irq;
+    break;
+
+  case 0x13:
+    cpu->regs[13] = &cpu->regs_svc[0];
+    cpu->regs[14] = &cpu->regs_svc[1];
+    cpu->current_SPSR = &cpu->SPSR_svc;
+    break;
+
+  case 0x17:
+    cpu->regs[13] = &cpu->regs_abt[0];
+    cpu->regs[14] = &cpu->regs_abt[1];
+    cpu->current_SPSR = &cpu->SPSR_abt;
+    break;
+
+  case 0x1B:
+    cpu->regs[13] = &cpu->regs_und[0];
+    cpu->regs[14] = &cpu->regs_und[1];
+    cpu->current_SPSR = &cpu->SPSR_und;
+    break;
+
+  default:
+    // User and System have no SPSR
+    cpu->current_SPSR = NULL;
+    break;
+  }
+
+  cpu->current_mode = mode;
+}
+
+
+// "subs pc, lr, #4" and friends: CPSR = SPSR, back to the interrupted mode
+// and state. Both pipelines start over, whichever state we land in.
+void exception_return(cpu_context *cpu)
+{
+  uint32_t spsr = *cpu->current_SPSR;
+
+  cpu->CPSR = spsr;
+  bank_registers(cpu, spsr & 0x1F);
+
+  flush(cpu);
+  cpu->thumb_exec = THUMB_NOP;
+  cpu->thumb_function = thumb_decode_instruction(THUMB_NOP);
+  thumb_flush(cpu);
+
+  // The interrupted code may have an IRQ waiting that was masked so far
+  io_check_interrupts();
+}
+
+
 static void (*functions[])(cpu_context *) =
 {
   &arm_branch_and_exchange,
@@ -343,7 +423,7 @@ bool verify_condition(cpu_context *cpu, uint8_t cond)
 void arm_branch_and_exchange(cpu_context *cpu)
 {
   uint8_t Rn = cpu->instruction_to_exec & 0x0F;
-  printf("bx \tr%d\n", Rn);
+  TRACE("bx \tr%d\n", Rn);
   REGS(15) = (REGS(Rn) & 0xFFFFFFFE) - 4;
   //REGS(15) = (REGS(Rn) & 0xFFFFFFFE);
   //cpu->CPSR |= 0x00000020;
@@ -366,18 +446,18 @@ void arm_block_data_transfer(cpu_context *cpu)
     "da", "ia", "db", "ib"
   };
 
-  printf(load ? "ldm" : "stm");
-  printf("%s%s\tr%d%c, {", amod[pu], conds[cond], Rn, writeback ? '!' : '\0');
+  TRACE(load ? "ldm" : "stm");
+  TRACE("%s%s\tr%d%c, {", amod[pu], conds[cond], Rn, writeback ? '!' : '\0');
   bool comma = false;
   for (uint8_t i = 0; i < 0x10; ++i)
   {
     if ((cpu->instruction_to_exec >> i) & 0x1)
     {
-      printf("%sr%d", comma ? ", " : "", i);
+      TRACE("%sr%d", comma ? ", " : "", i);
       comma = comma | true;
     }
   }
-  printf("}%c\n", s_flag ? '^' : '\0');
+  TRACE("}%c\n", s_flag ? '^' : '\0');
 
   uint32_t base_address = REGS(Rn);
   uint32_t base_store_address = base_address;
@@ -645,7 +725,7 @@ void arm_branch_branch_link(cpu_context *cpu)
   uint8_t L = (cpu->instruction_to_exec >> 24) & 1;
   int32_t offset = (cpu->instruction_to_exec & 0xFFFFFF) << 2;
   offset |= (0 - (offset & 0x800000));        // sign extension
-  printf("%s%s \t#0x%x\n", (L ? "bl" : "b"), conds[cond], (offset + (int32_t)REGS(15)));
+  TRACE("%s%s \t#0x%x\n", (L ? "bl" : "b"), conds[cond], (offset + (int32_t)REGS(15)));
   
   if (L)
     REGS(14) = REGS(15) - 4;  // due to the pipeline
@@ -658,9 +738,44 @@ void arm_branch_branch_link(cpu_context *cpu)
   flush(cpu);
 }
 
+// size is the instruction size: at this point the PC is 2 instructions
+// ahead, and the step adds one more once we return
+static void software_interrupt(cpu_context *cpu, uint8_t number, uint8_t size)
+{
+  if (bios_is_builtin())
+  {
+    switch (bios_hle_swi(number))
+    {
+    case SWI_DONE:
+      return;
+
+    case SWI_RETRY:
+      REGS(15) -= size * 3;
+      return;
+
+    default:
+      break;
+    }
+  }
+
+  // Supervisor mode, ARM state, IRQs off
+  cpu->SPSR_svc = cpu->CPSR;
+  bank_registers(cpu, 0x13);
+  cpu->CPSR = (cpu->CPSR & ~0x3F) | 0x93;
+
+  REGS(14) = REGS(15) - size;
+  REGS(15) = 0x00000008 - size;
+
+  flush(cpu);
+  cpu->function = decode_instruction(NOP);
+}
+
 void arm_software_interrupt(cpu_context *cpu)
 {
-  printf("Software interrupt\n");
+  uint8_t number = (cpu->instruction_to_exec >> 16) & 0xFF;
+  TRACE("swi\t0x%02x\n", number);
+
+  software_interrupt(cpu, number, 4);
 }
 
 void arm_undefined(cpu_context *cpu)
@@ -679,12 +794,12 @@ void arm_single_data_transfer(cpu_context *cpu)
   uint8_t byte = (cpu->instruction_to_exec >> 22) & 1;
   uint8_t writeback = (cpu->instruction_to_exec >> 21) & 1;
   uint8_t load = (cpu->instruction_to_exec >> 20) & 1;
-  printf("%s%c\t", load ? "ldr" : "str", byte ? 'b' : '\0');
-  printf("r%d, [r%d", Rd, Rn);
+  TRACE("%s%c\t", load ? "ldr" : "str", byte ? 'b' : '\0');
+  TRACE("r%d, [r%d", Rd, Rn);
   char wb = writeback ? '!' : '\0';
   char sign = up ? '\0' : '-';
   if (!I)
-    printf(pre_indexed ? ", %c#%d]%c\n" : "], %c#%d%c\n", sign, offset, wb);
+    TRACE(pre_indexed ? ", %c#%d]%c\n" : "], %c#%d%c\n", sign, offset, wb);
   else
   {
     char *types[] = 
@@ -694,7 +809,7 @@ void arm_single_data_transfer(cpu_context *cpu)
       "asr",
       "ror"
     };
-    printf(pre_indexed ? ", %cr%d, %s #%d]%c\n" : "], %cr%d, %s #%d%c\n", 
+    TRACE(pre_indexed ? ", %cr%d, %s #%d]%c\n" : "], %cr%d, %s #%d%c\n", 
       sign, offset & 0xF, types[(offset >> 5) & 0x3], (offset >> 7) & 0x1F, wb);
   }
   //printf("Rn = R%d, Rd = R%d, Offset = #0x%03x\n", Rn, Rd, offset);
@@ -797,7 +912,7 @@ void arm_single_data_swap(cpu_context *cpu)
   uint8_t Rn = (cpu->instruction_to_exec >> 16) & 0xF;
   uint8_t Rd = (cpu->instruction_to_exec >> 12) & 0xF;
   uint8_t Rm = cpu->instruction_to_exec & 0xF;
-  printf("swp%c\tr%d, r%d, [r%d]\n", byte ? 'b' : '\0',
+  TRACE("swp%c\tr%d, r%d, [r%d]\n", byte ? 'b' : '\0',
     Rd, Rm, Rn);
 
   // Implementation
@@ -828,11 +943,11 @@ void arm_multiply(cpu_context *cpu)
   uint8_t Rn = (cpu->instruction_to_exec >> 12) & 0xF;
   uint8_t Rs = (cpu->instruction_to_exec >> 8) & 0xF;
   uint8_t Rm = (cpu->instruction_to_exec) & 0xF;
-  printf("%s%c\tr%d, r%d, r%d",
+  TRACE("%s%c\tr%d, r%d, r%d",
     accumulate ? "mla" : "mul", set_condition_codes ? 's' : '\0',
     Rd, Rm, Rs);
   
-  accumulate ? printf(", r%d\n", Rn) : printf("\n");
+  accumulate ? TRACE(", r%d\n", Rn) : TRACE("\n");
 
   // Implmentation
   if(!accumulate)
@@ -867,7 +982,7 @@ void arm_multiply_long(cpu_context *cpu)
   uint8_t Rn = (cpu->instruction_to_exec >> 12) & 0xF;
   uint8_t Rs = (cpu->instruction_to_exec >> 8) & 0xF;
   uint8_t Rm = (cpu->instruction_to_exec) & 0xF;
-  printf("%c%s%c\tr%d, r%d, r%d, r%d\n",
+  TRACE("%c%s%c\tr%d, r%d, r%d, r%d\n",
     is_unsigned ? 's' : 'u', accumulate ? "mlal" : "mull", 
     set_condition_codes ? 's' : '\0', Rn, Rd, Rm, Rs);
   
@@ -994,10 +1109,10 @@ void arm_halfword_transfer(cpu_context *cpu)
     "strd"
   };
 
-  printf("%s%s\tr%d, [r%d",
+  TRACE("%s%s\tr%d, [r%d",
     (load ? l_types : s_types)[sh], conds[cond],
     Rd, Rn);
-  printf(pre_indexed ? ", %cr%d]%c\n" : "], %c#%d%c\n",
+  TRACE(pre_indexed ? ", %cr%d]%c\n" : "], %c#%d%c\n",
     up ? '\0' : '-', Rm, writeback ? '!' : '\0');
 
 
@@ -1164,11 +1279,11 @@ void arm_halfword_transfer_imm(cpu_context *cpu)
     "strd"
   };
   
-  printf("%s%s\tr%d, [r%d",
+  TRACE("%s%s\tr%d, [r%d",
     (load ? l_types : s_types)[sh], conds[cond],
     Rd, Rn);
 
-  printf(pre_indexed ? ", %c#%d]%c\n" : "], %c#%d%c\n",
+  TRACE(pre_indexed ? ", %c#%d]%c\n" : "], %c#%d%c\n",
     up ? '\0' : '-', ofs, writeback ? '!' : '\0');
   
   
@@ -1191,11 +1306,11 @@ void arm_halfword_transfer_imm(cpu_context *cpu)
         else
           base_address -= offset;
         uint32_t temp = bus_read_halfword(base_address);
-        printf("temp = 0x%08x\n", temp);
+        TRACE("temp = 0x%08x\n", temp);
         temp = (temp >> (rotation_in_word * 8)) |
           (temp << (32 - (rotation_in_word * 8)));
         REGS(Rd) = temp;
-        printf("temp = 0x%08x\n", temp);
+        TRACE("temp = 0x%08x\n", temp);
       }
       else
       {
@@ -1317,7 +1432,7 @@ void arm_mrs(cpu_context *cpu)
 {
   uint8_t pos = (cpu->instruction_to_exec >> 22) & 0x1;
   uint8_t Rd = (cpu->instruction_to_exec >> 12) & 0xF;
-  printf("mrs\tr%d, %cpsr\n", Rd, pos ? 's' : 'c');
+  TRACE("mrs\tr%d, %cpsr\n", Rd, pos ? 's' : 'c');
 
   // implementation
   REGS(Rd) = pos ? *cpu->current_SPSR : cpu->CPSR;
@@ -1345,9 +1460,9 @@ void arm_msr(cpu_context *cpu)
   value += Rm;
   value = (value >> shift) | (value << (32 - shift));
 
-  printf("msr\t%cpsr%c%c%c%c%c, ", psr ? 's' : 'c', (f | s | x | c) ? '_' : '\0',
+  TRACE("msr\t%cpsr%c%c%c%c%c, ", psr ? 's' : 'c', (f | s | x | c) ? '_' : '\0',
     f ? 'f' : '\0', s ? 's' : '\0', x ? 'x' : '\0', c ? 'c' : '\0');
-  immediate ? printf("#0x%x\n", value) : printf("r%d\n", Rm);
+  immediate ? TRACE("#0x%x\n", value) : TRACE("r%d\n", Rm);
 
 
   // Implementation
@@ -1378,6 +1493,10 @@ void arm_msr(cpu_context *cpu)
 
   if ((old_mode != new_mode))
     switch_mode(cpu, new_mode);
+
+  // Clearing the I bit may unmask a pending interrupt
+  if (0 == psr && c)
+    io_check_interrupts();
 }
 
 void arm_data_processing(cpu_context *cpu)
@@ -1406,10 +1525,10 @@ void arm_data_processing(cpu_context *cpu)
   uint8_t Rn = (cpu->instruction_to_exec >> 16) & 0xF;
   uint8_t Rd = (cpu->instruction_to_exec >> 12) & 0xF;
 
-  printf("%s%s%s\t", ops[opcode], set_condition_codes ? "s" : "", 
+  TRACE("%s%s%s\t", ops[opcode], set_condition_codes ? "s" : "", 
     conds[cond]);
-  (opcode & 0xC) == 0x8 ? printf("") : printf("r%d, ", Rd); 
-  (opcode & 0xD) == 0xD ? printf("") : printf("r%d, ", Rn);
+  (opcode & 0xC) == 0x8 ? TRACE("") : TRACE("r%d, ", Rd); 
+  (opcode & 0xD) == 0xD ? TRACE("") : TRACE("r%d, ", Rn);
 
   if (immediate)
   {
@@ -1417,23 +1536,23 @@ void arm_data_processing(cpu_context *cpu)
     uint8_t Is = (cpu->instruction_to_exec >> 7) & 0x1E;  //multiplied by 2
     // ror shift
     uint32_t value = (nn >> Is) | (nn << (32 - Is));
-    printf("#0x%08x\n", value);
+    TRACE("#0x%08x\n", value);
   }
   else
   {
     uint8_t shift_by_register = (cpu->instruction_to_exec >> 4) & 0x1;
     uint8_t Rm = cpu->instruction_to_exec & 0xF;
 
-    printf("r%d, %s ", Rm, shift_types[(cpu->instruction_to_exec >> 5) & 0x3]);
+    TRACE("r%d, %s ", Rm, shift_types[(cpu->instruction_to_exec >> 5) & 0x3]);
 
     if (shift_by_register)
     {
       uint8_t Rs = (cpu->instruction_to_exec >> 8) & 0xF;
-      printf("r%d\n", Rs);
+      TRACE("r%d\n", Rs);
     }
     else
     {
-      printf("#%d\n", (cpu->instruction_to_exec >> 7) & 0x1F);
+      TRACE("#%d\n", (cpu->instruction_to_exec >> 7) & 0x1F);
     }
   }
 
@@ -1591,7 +1710,13 @@ void arm_data_processing(cpu_context *cpu)
   //printf("nzcv = 0x%04b\n", cpu->CPSR >> 28);
   // if Rd = 15 and is not a tst/teq/cmp/cmn
   if ((args.Rd == 15) && (!((opcode & 0xC) == 0x8)))
-    flush(cpu);
+  {
+    // With S set, writing the PC also restores the CPSR
+    if (args.set_condition_codes && cpu->current_SPSR != NULL)
+      exception_return(cpu);
+    else
+      flush(cpu);
+  }
 }
 
 
@@ -1623,8 +1748,10 @@ void (*thumb_decode_instruction(uint16_t instruction))(cpu_context *)
 
 void thumb_software_interrupt(cpu_context *cpu)
 {
-  printf("SWI\n");
-  NO_IMPL;
+  uint8_t number = cpu->thumb_exec & 0xFF;
+  TRACE("swi\t0x%02x\n", number);
+
+  software_interrupt(cpu, number, 2);
 }
 
 void thumb_unconditional_branch(cpu_context *cpu)
@@ -1632,7 +1759,7 @@ void thumb_unconditional_branch(cpu_context *cpu)
   int16_t offset = (cpu->thumb_exec << 1) & 0xFFF;
   offset |= (offset & 0x800) ? 0xF000 : 0x0000;
 
-  printf("b\t0x%08x\n", REGS(15) + offset);
+  TRACE("b\t0x%08x\n", REGS(15) + offset);
   REGS(15) = ((int32_t)REGS(15) - 2 + (int32_t)offset);
   thumb_flush(cpu);
 }
@@ -1643,7 +1770,7 @@ void thumb_conditional_branch(cpu_context *cpu)
   int16_t offset = (cpu->thumb_exec << 1) & 0x1FF;
   offset |= (offset >> 8) ? 0xFE00 : 0x0000;
 
-  printf("b%s\t0x%08x\n", conds[cond], REGS(15) + 2 + offset);
+  TRACE("b%s\t0x%08x\n", conds[cond], REGS(15) + 2 + offset);
 
   if (verify_condition(cpu, cond))
   {
@@ -1651,7 +1778,7 @@ void thumb_conditional_branch(cpu_context *cpu)
     thumb_flush(cpu);
   }
   else
-    printf("NOT EXECUTED DUE TO UNSATISFIED CONDITION!\n");
+    TRACE("NOT EXECUTED DUE TO UNSATISFIED CONDITION!\n");
   
 }
 
@@ -1668,7 +1795,7 @@ void thumb_conditional_branch(cpu_context *cpu)
 
 void thumb_multiple_load_store(cpu_context *cpu)
 {
-  printf("MLS\n");
+  TRACE("MLS\n");
   uint8_t rlist = (uint8_t)cpu->thumb_exec;
   uint8_t Rb = (cpu->thumb_exec >> 8) & 0x7;
   uint8_t load = (cpu->thumb_exec >> 10) & 0x2;
@@ -1682,7 +1809,7 @@ void thumb_multiple_load_store(cpu_context *cpu)
   switch (load_valid_rlist)
   {
     case 0b11:
-      printf("ldmia");
+      TRACE("ldmia");
       for (uint8_t i = 0; i < 8; ++i)
       {
         if ((rlist >> i) & 0x1)
@@ -1694,7 +1821,7 @@ void thumb_multiple_load_store(cpu_context *cpu)
       break;
     
     case 0b01:
-      printf("stmia");
+      TRACE("stmia");
       uint32_t base = REGS(Rb);
       uint32_t real_address;
       for (uint8_t i = 0; i < 8; ++i)
@@ -1717,29 +1844,29 @@ void thumb_multiple_load_store(cpu_context *cpu)
       break;
 
     case 0b10:
-      printf("Load invalid rlist\n");
-      printf("ldm");
+      TRACE("Load invalid rlist\n");
+      TRACE("ldm");
       REGS(15) = bus_read_word(REGS(Rb));
       REGS(Rb) += 0x40;
       break;
     
     case 0b00:
-      printf("Store invalid rlist\n");
-      printf("stm");
+      TRACE("Store invalid rlist\n");
+      TRACE("stm");
       bus_write_word(REGS(Rb), REGS(15) + 4);     // due to the pipeline
       REGS(Rb) += 0x40;
       break;
       
   }
 
-  printf("\tr%d!, {", Rb);
+  TRACE("\tr%d!, {", Rb);
   for (uint8_t i = 0; i < 8; ++i)
   {
     if ((rlist >> i) & 0x1)
-      printf("r%d ", i);
+      TRACE("r%d ", i);
   }
 
-  printf("}\n");
+  TRACE("}\n");
 }
 
 void thumb_long_branch_and_link(cpu_context *cpu)
@@ -1748,7 +1875,7 @@ void thumb_long_branch_and_link(cpu_context *cpu)
 
   if ((cpu->thumb_exec >> 11) & 0x1)
   {
-    printf("Long bl: temp = ...; PC = LR + 0x%03x << 1;\n", offset);
+    TRACE("Long bl: temp = ...; PC = LR + 0x%03x << 1;\n", offset);
     // DEBUG HERE!!!
     uint32_t temp = *cpu->regs[15];
     *cpu->regs[15] = *cpu->regs[14] + (offset << 1);
@@ -1756,7 +1883,7 @@ void thumb_long_branch_and_link(cpu_context *cpu)
   }
   else
   {
-    printf("Long bl: LR = PC + 0x%03x << 12\n", offset);
+    TRACE("Long bl: LR = PC + 0x%03x << 12\n", offset);
     *cpu->regs[14] = *cpu->regs[15] + 
       (((offset >> 10) ? 0xFFC00000 : 0x0) | (offset << 12));   // HERE
   }
@@ -1772,7 +1899,7 @@ void thumb_add_offset_to_sp(cpu_context *cpu)
   uint8_t is_negative = (cpu->thumb_exec >> 7) & 0x01;
   uint16_t imm = (cpu->thumb_exec & 0x7F) << 2;
 
-  printf("add\tsp, %c0x%x\n", is_negative ? '-' : '\0', imm);
+  TRACE("add\tsp, %c0x%x\n", is_negative ? '-' : '\0', imm);
 
   REGS(13) += (int32_t)(is_negative ? -1 : 1) * (int32_t) imm;
 }
@@ -1785,7 +1912,7 @@ void thumb_push_pop_registers(cpu_context *cpu)
 
   if (pop)
   {
-    printf("pop");
+    TRACE("pop");
 
     if (pc_lr)
     {
@@ -1805,7 +1932,7 @@ void thumb_push_pop_registers(cpu_context *cpu)
   }
   else
   {
-    printf("push");
+    TRACE("push");
     for (uint8_t i = 0; i < 8; ++i)
     {
       if ((rlist >> i) & 0x1)
@@ -1821,16 +1948,16 @@ void thumb_push_pop_registers(cpu_context *cpu)
     }
   }
 
-  printf("\t{");
+  TRACE("\t{");
   for (uint8_t i = 0; i < 8; ++i)
   {
     if ((rlist >> i) & 0x1)
-      printf("r%d ", i);
+      TRACE("r%d ", i);
   }
 
   if (pc_lr)
-    printf((pop) ? "pc " : "lr ");
-  printf("}\n");
+    TRACE((pop) ? "pc " : "lr ");
+  TRACE("}\n");
 }
 
 void thumb_load_store_halfword(cpu_context *cpu)
@@ -1844,7 +1971,7 @@ void thumb_load_store_halfword(cpu_context *cpu)
 
   if (load)
   {
-    printf("ldrh");
+    TRACE("ldrh");
     uint32_t temp = (uint32_t)bus_read_halfword(address & 0xFFFFFFFE);
     if (address & 0x1)
       REGS(Rd) = ((temp >> 8) | (temp << 24));
@@ -1854,11 +1981,11 @@ void thumb_load_store_halfword(cpu_context *cpu)
   }
   else
   {
-    printf("strh");
+    TRACE("strh");
     bus_write_halfword(address & 0xFFFFFFFE, (uint16_t)REGS(Rd));
   }
 
-  printf("\tr%d, [r%d, #0x%02x]\n", Rd, Rb, nn);
+  TRACE("\tr%d, [r%d, #0x%02x]\n", Rd, Rb, nn);
 }
 
 void thumb_sp_relative_load_store(cpu_context *cpu)
@@ -1871,18 +1998,18 @@ void thumb_sp_relative_load_store(cpu_context *cpu)
 
   if (load)
   {
-    printf("ldr");
+    TRACE("ldr");
     uint32_t temp = bus_read_word(address & 0xFFFFFFFC);
     uint8_t ror = (address & 0x3) * 8;
     REGS(Rd) = ((temp >> ror) | (temp << (32 - ror)));
   }
   else
   {
-    printf("str");
+    TRACE("str");
     bus_write_word(address & 0xFFFFFFFC, REGS(Rd));
   }
 
-  printf("\tr%d, [sp, #0x%03x]\n", Rd, nn);
+  TRACE("\tr%d, [sp, #0x%03x]\n", Rd, nn);
 }
 
 void thumb_load_address(cpu_context *cpu)
@@ -1890,7 +2017,7 @@ void thumb_load_address(cpu_context *cpu)
   uint8_t Rd = (cpu->thumb_exec >> 8) & 0x7;
   uint8_t sp = (cpu->thumb_exec >> 11) & 0x1;
   uint16_t offset = (cpu->thumb_exec << 2) & 0x03FC; 
-  printf("add\tr%d, %s, #0x%x\n", Rd, sp ? "sp" : "pc", offset);
+  TRACE("add\tr%d, %s, #0x%x\n", Rd, sp ? "sp" : "pc", offset);
   // Implementation
   void (*function)(alu_args *) = thumb_alu_functions[2];  // add
   alu_args args;
@@ -1924,29 +2051,29 @@ void thumb_load_store_imm_ofs(cpu_context *cpu)
   switch (opcode)
   {
     case 0:
-      printf("str");
+      TRACE("str");
       bus_write_word(address & 0xFFFFFFFC, REGS(Rd));
       break;
 
     case 1:
-      printf("ldr");
+      TRACE("ldr");
       uint32_t temp = bus_read_word(address & 0xFFFFFFFC);
       uint8_t ror = (address & 0x3) * 8;
       REGS(Rd) = ((temp >> ror) | (temp << (32 - ror)));
       break;
 
     case 2:
-      printf("strb");
+      TRACE("strb");
       bus_write(address, (uint8_t)REGS(Rd));
       break;
 
     case 3:
-      printf("ldrb");
+      TRACE("ldrb");
       REGS(Rd) = (uint32_t)bus_read(address);
       break;
   }
 
-  printf("\tr%d, [r%d, #0x%02x]\n", Rd, Rb, nn);
+  TRACE("\tr%d, [r%d, #0x%02x]\n", Rd, Rb, nn);
 }
 
 void thumb_load_store_reg_ofs(cpu_context *cpu)
@@ -1957,7 +2084,7 @@ void thumb_load_store_reg_ofs(cpu_context *cpu)
   uint8_t byte = (cpu->thumb_exec >> 10) & 0x1;
   uint8_t load = (cpu->thumb_exec >> 11) & 0x1;
 
-  printf("%s%c\tr%d, [r%d, r%d]\n", load ? "ldr" : "str", byte ? 'b' : ' ', Rd, Rb, Ro);
+  TRACE("%s%c\tr%d, [r%d, r%d]\n", load ? "ldr" : "str", byte ? 'b' : ' ', Rd, Rb, Ro);
 
   uint32_t address = (REGS(Rb) + REGS(Ro)); 
   //address -= (address & 0x1) << 2;                       // halfword alignement (?)
@@ -2011,18 +2138,18 @@ void thumb_load_store_sign_ext_b_h(cpu_context *cpu)
   switch (opcode)
   {
     case 0:
-      printf("strh");
+      TRACE("strh");
       bus_write_halfword(address, (uint16_t)REGS(Rd));
       break;
     
     case 1:
-      printf("ldsb");
+      TRACE("ldsb");
       temp = (uint32_t)bus_read(address);
       REGS(Rd) = (temp | ((temp >> 7) ? 0xFFFFFF00 : 0x00000000));
       break;
     
     case 2:
-      printf("ldrh");
+      TRACE("ldrh");
       temp = (uint32_t)bus_read_halfword(address);
       if (flag)
         REGS(Rd) = ((temp >> 8) | (temp << 24));
@@ -2031,7 +2158,7 @@ void thumb_load_store_sign_ext_b_h(cpu_context *cpu)
       break;
 
     case 3:
-      printf("ldsh");
+      TRACE("ldsh");
       temp = (uint32_t)bus_read_halfword(address);
       if (flag)
       {   // TO CHECK
@@ -2047,14 +2174,14 @@ void thumb_load_store_sign_ext_b_h(cpu_context *cpu)
       break;
   }
 
-  printf("\tr%d, [r%d, r%d]\n", Rd, Rb, Ro);
+  TRACE("\tr%d, [r%d, r%d]\n", Rd, Rb, Ro);
 }
 
 void thumb_pc_relative_load (cpu_context *cpu)
 {
   uint8_t Rd = (cpu->thumb_exec >> 8) & 0x7;
   int16_t imm = (((cpu->thumb_exec & 0xFF) << 2) | (((cpu->thumb_exec >> 7) & 0x1) ? 0xFC00 : 0));
-  printf("ldr\tr%d, [pc, %d]\n", Rd, imm);
+  TRACE("ldr\tr%d, [pc, %d]\n", Rd, imm);
 
   REGS(Rd) = bus_read_word((int32_t)REGS(15) + (int32_t)imm);
 }
@@ -2068,7 +2195,7 @@ void thumb_hi_regs_ops_bx(cpu_context *cpu)
   switch (opcode)
   {
   case 0x0:   // Add
-    printf("add\tR%d, R%d\n", Rd, Rs);
+    TRACE("add\tR%d, R%d\n", Rd, Rs);
     uint32_t a = REGS(Rd);
     uint32_t b = REGS(Rs);
     b += (15 == Rs) ? 2 : 0;
@@ -2078,10 +2205,10 @@ void thumb_hi_regs_ops_bx(cpu_context *cpu)
     break;
   
   case 0x1:
-    printf("cmp\tR%d, R%d\n", Rd, Rs);
+    TRACE("cmp\tR%d, R%d\n", Rd, Rs);
     a = REGS(Rd);
     b = REGS(Rs);
-    printf("Computing 0x%08x - 0x%08x\n", a, b);
+    TRACE("Computing 0x%08x - 0x%08x\n", a, b);
 
     result = a - b;
 
@@ -2100,7 +2227,7 @@ void thumb_hi_regs_ops_bx(cpu_context *cpu)
     break;
   
   case 0x2:
-    printf("mov\tR%d, R%d\n", Rd, Rs);
+    TRACE("mov\tR%d, R%d\n", Rd, Rs);
     REGS(Rd) = REGS(Rs) + ((15 == Rs) ? 2 : 0);
     
     if ((15 == Rd))   // halfword alignment
@@ -2111,10 +2238,10 @@ void thumb_hi_regs_ops_bx(cpu_context *cpu)
     break;
   
   case 0x3:
-    printf("b%sx\tR%d\n", (Rd & 0x8) ? "l" : "" , Rs);
+    TRACE("b%sx\tR%d\n", (Rd & 0x8) ? "l" : "" , Rs);
     REGS(15) = ((REGS(Rs)) & 0xFFFFFFFC) - 2; // -2
     cpu->CPSR = (cpu->CPSR & 0xFFFFFFDF) | ((REGS(Rs) & 0x1) << 5); // MARK HERE
-    printf("FLUSHING THE PIPELINE\n");
+    TRACE("FLUSHING THE PIPELINE\n");
     flush(cpu);
     thumb_flush(cpu);
     break;
@@ -2136,7 +2263,7 @@ void thumb_alu_operations(cpu_context *cpu)
   uint8_t Rs = (cpu->thumb_exec >> 3) & 0x7;
   uint8_t Rd = cpu->thumb_exec & 0x7;
 
-  printf("%s ...\n", ops[opcode]);
+  TRACE("%s ...\n", ops[opcode]);
 
   void (*function)(alu_args *) = thumb_alu_functions_complete[opcode];
   uint32_t op2;
@@ -2166,7 +2293,7 @@ void thumb_mov_cmp_add_sub_imm(cpu_context *cpu)
     "add", "sub"
   };
 
-  printf("%s\tR%d, #0x%x\n", ops[opcode], Rd, nn);
+  TRACE("%s\tR%d, #0x%x\n", ops[opcode], Rd, nn);
 
   // Implementation
   void (*function)(alu_args *) = thumb_alu_functions[opcode];
@@ -2185,7 +2312,7 @@ void thumb_add_sub(cpu_context *cpu)
   uint8_t Rs = (cpu->thumb_exec >> 0x3) & 0x7;
   uint8_t Rn = (cpu->thumb_exec >> 0x6) & 0x7;
   
-  printf("%s\tR%d, R%d, %c%d\n", (cpu->thumb_exec & 0x200) ? 
+  TRACE("%s\tR%d, R%d, %c%d\n", (cpu->thumb_exec & 0x200) ? 
     "sub" : "add", Rd, Rs, (cpu->thumb_exec & 0x400) ? 
     '#' : 'R', Rn);
   
@@ -2219,7 +2346,7 @@ void thumb_mov_shifted_regs(cpu_context *cpu)
     "lsl", "lsr", "asr", "INVALID"
   };
 
-  printf("%s\tR%d, R%d, #%d\n", s_types[opcode], Rd, Rn, shift);
+  TRACE("%s\tR%d, R%d, #%d\n", s_types[opcode], Rd, Rn, shift);
 
   uint32_t op2;
   uint32_t val = REGS(Rn);
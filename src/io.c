@@ -0,0 +1,234 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "io.h"
+#include "dma.h"
+#include "bus.h"
+#include "apu.h"
+#include "timer.h"
+#include "cpu.h"
+#include "render.h"
+#include "arena.h"
+#include "scheduler.h"
+
+
+// Runs right after anything that can make an interrupt deliverable: a new
+// IF bit, a write to IE or IME, or the CPU unmasking IRQs
+static void deliver_interrupt(uint64_t timestamp)
+{
+  (void)timestamp;
+
+  if ((io_get(REG_IME) & 1) && (io_get(REG_IE) & io_get(REG_IF)))
+    cpu_raise_irq();
+}
+
+
+void io_init()
+{
+  memset(arena.io_regs, 0, sizeof(arena.io_regs));
+  scheduler_register(EVENT_IRQ, deliver_interrupt);
+
+  // Power-on values: identity affine backgrounds, no key pressed
+  io_set(REG_BG2PA, 0x0100);
+  io_set(REG_BG2PD, 0x0100);
+  io_set(REG_BG3PA, 0x0100);
+  io_set(REG_BG3PD, 0x0100);
+  io_set(REG_KEYINPUT, 0x03FF);
+}
+
+
+uint16_t io_get(uint32_t address)
+{
+  return *((uint16_t *)&arena.io_regs[address]);
+}
+
+void io_set(uint32_t address, uint16_t value)
+{
+  *((uint16_t *)&arena.io_regs[address]) = value;
+}
+
+
+void io_request_interrupt(uint8_t irq)
+{
+  io_set(REG_IF, io_get(REG_IF) | (1 << irq));
+  io_check_interrupts();
+}
+
+void io_check_interrupts()
+{
+  uint16_t pending = io_get(REG_IE) & io_get(REG_IF);
+
+  // Waking up from Halt does not need IME
+  if (arena.cpu.halted && (pending & arena.cpu.wake_mask))
+    arena.cpu.halted = false;
+
+  if ((io_get(REG_IME) & 1) && pending)
+    scheduler_schedule(EVENT_IRQ, scheduler_now());
+}
+
+
+
+uint16_t io_read_halfword(uint32_t address)
+{
+  address &= ~1;
+
+  // DMA source, destination and count are write only
+  if (address >= REG_DMA0SAD && address <= REG_DMA3CNT_H)
+  {
+    uint32_t offset = (address - REG_DMA0SAD) % DMA_REG_STRIDE;
+    if (offset != REG_DMA0CNT_H - REG_DMA0SAD)
+      return 0;
+  }
+
+  // Timer counters are worked out on demand
+  if (address >= REG_TM0CNT_L && address <= REG_TM3CNT_H &&
+    !(address & (TIMER_REG_STRIDE - 1)))
+  {
+    return timer_read_counter((address - REG_TM0CNT_L) / TIMER_REG_STRIDE);
+  }
+
+  return io_get(address);
+}
+
+uint8_t io_read_byte(uint32_t address)
+{
+  return io_read_halfword(address) >> ((address & 1) * 8);
+}
+
+uint32_t io_read_word(uint32_t address)
+{
+  address &= ~3;
+  return io_read_halfword(address) | (io_read_halfword(address + 2) << 16);
+}
+
+
+
+// Every write goes through here, so the side effects live in one place
+void io_write_halfword(uint32_t address, uint16_t value)
+{
+  address &= ~1;
+
+  switch (address)
+  {
+  case REG_DISPSTAT:
+    // The status flags in bits 0-2 belong to the PPU
+    io_set(REG_DISPSTAT, (io_get(REG_DISPSTAT) & 0x0007) | (value & 0xFF38));
+    return;
+
+  case REG_VCOUNT:
+    return;
+
+  case REG_SOUNDCNT_H:
+    io_set(REG_SOUNDCNT_H, value & 0x770F);
+    apu_write_control(value);
+    timer_sound_changed();
+    return;
+
+  case REG_FIFO_A:
+  case REG_FIFO_A + 2:
+    apu_write_fifo(0, value);
+    return;
+
+  case REG_FIFO_B:
+  case REG_FIFO_B + 2:
+    apu_write_fifo(1, value);
+    return;
+
+  case REG_TM0CNT_L:
+  case REG_TM0CNT_L + TIMER_REG_STRIDE:
+  case REG_TM0CNT_L + TIMER_REG_STRIDE * 2:
+  case REG_TM0CNT_L + TIMER_REG_STRIDE * 3:
+    timer_write_reload((address - REG_TM0CNT_L) / TIMER_REG_STRIDE, value);
+    return;
+
+  case REG_TM0CNT_H:
+  case REG_TM0CNT_H + TIMER_REG_STRIDE:
+  case REG_TM0CNT_H + TIMER_REG_STRIDE * 2:
+  case REG_TM3CNT_H:
+    timer_write_control((address - REG_TM0CNT_H) / TIMER_REG_STRIDE,
+      io_get(address), value & 0x00C7);
+    return;
+
+  case REG_POSTFLG:
+    io_set(REG_POSTFLG, value & 0x00FF);
+    cpu_halt((value & 0x8000) ? CPU_WAKE_STOP : CPU_WAKE_HALT);
+    return;
+
+  case REG_IE:
+  case REG_IME:
+    io_set(address, value);
+    io_check_interrupts();
+    return;
+
+  case REG_BG2X:
+  case REG_BG2X + 2:
+  case REG_BG2Y:
+  case REG_BG2Y + 2:
+  case REG_BG3X:
+  case REG_BG3X + 2:
+  case REG_BG3Y:
+  case REG_BG3Y + 2:
+    // The new reference point applies from the next line on
+    io_set(address, value);
+    render_affine_latch(address < REG_BG3X ? 2 : 3, address & 4);
+    return;
+
+  case REG_IF:
+    // Writing 1 acknowledges the interrupt
+    io_set(REG_IF, io_get(REG_IF) & ~value);
+    return;
+
+  case REG_WAITCNT:
+    // Bit 15 is the read only Game Pak type (0 = GBA)
+    io_set(REG_WAITCNT, value & 0x7FFF);
+    bus_update_waitcnt(value);
+    return;
+
+  case REG_DMA0CNT_H:
+  case REG_DMA0CNT_H + DMA_REG_STRIDE:
+  case REG_DMA0CNT_H + DMA_REG_STRIDE * 2:
+  case REG_DMA3CNT_H:
+  {
+    uint16_t old = io_get(address);
+    io_set(address, value);
+    dma_write_control((address - REG_DMA0CNT_H) / DMA_REG_STRIDE, old, value);
+    return;
+  }
+
+  default:
+    io_set(address, value);
+    return;
+  }
+}
+
+void io_write_byte(uint32_t address, uint8_t value)
+{
+  uint32_t aligned = address & ~1;
+  uint8_t shift = (address & 1) * 8;
+
+  // HALTCNT is write only and shares its halfword with POSTFLG: each byte
+  // on its own
+  if (address == REG_HALTCNT)
+  {
+    cpu_halt((value & 0x80) ? CPU_WAKE_STOP : CPU_WAKE_HALT);
+    return;
+  }
+  if (address == REG_POSTFLG)
+  {
+    io_set(REG_POSTFLG, value);
+    return;
+  }
+
+  // Keep the other byte, except for IF where it would acknowledge it too
+  uint16_t old = (aligned == REG_IF) ? 0 : io_get(aligned);
+  old &= ~(0xFF << shift);
+  io_write_halfword(aligned, old | (value << shift));
+}
+
+void io_write_word(uint32_t address, uint32_t value)
+{
+  address &= ~3;
+  io_write_halfword(address, value & 0xFFFF);
+  io_write_halfword(address + 2, value >> 16);
+}
@@ -2,21 +2,40 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_ttf.h>
+#include "options.h"
+#include "headless.h"
+#include "render.h"
+#include "frame_hash.h"
+#include "hash_log.h"
 
-#include "emulator.h"
+#ifdef HAVE_SDL
+#include "frontend.h"
+#endif
 
 
 
 
 int main(int argc, char **argv)
 {
-  emu_run(argc, argv);
-  return 0;
+  options options;
+  options_parse(&options, argc, argv);
+
+  if (options.hash_compare[0])
+    return hash_log_compare(options.hash_compare[0],
+      options.hash_compare[1]);
+
+  if (options.bench_render)
+  {
+    render_init();
+    render_bitmap_benchmark();
+    render_bands_benchmark();
+    frame_hash_benchmark();
+    return 0;
+  }
+
+#ifdef HAVE_SDL
+  if (!options.headless)
+    return emu_run(&options);
+#endif
+  return headless_run(&options);
 }
-
-
-
-
-
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+#include "emulator.h"
+#include "ppu.h"
+#include "palette.h"
+#include "backup.h"
+#include "cpu.h"
+
+
+void options_parse(options *o, int argc, char **argv)
+{
+  *o = (options)
+  {
+    .rom_path = "../roms/arm.gba",
+    //.rom_path = "../roms/thumb.gba",
+    //.rom_path = "../roms/memory.gba",
+    .bios_path = "../bios/gba_bios.bin",
+    .pace = PACE_AUDIO,
+    .multiplier = 1.0,
+    .render_thread = true,
+    .render_bands = 1,
+    .breakpoint = CPU_NO_BREAKPOINT,
+  };
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "--boot-bios"))
+      o->boot_bios = true;
+    else if (!strcmp(argv[i], "--unthrottled"))
+      o->pace = PACE_UNTHROTTLED;
+    else if (!strcmp(argv[i], "--speed") && i + 1 < argc)
+    {
+      o->pace = PACE_MULTIPLIER;
+      o->multiplier = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--sync") && i + 1 < argc)
+    {
+      ++i;
+      o->pace = !strcmp(argv[i], "display") ? PACE_DISPLAY : PACE_AUDIO;
+    }
+    else if (!strcmp(argv[i], "--bios") && i + 1 < argc)
+      o->bios_path = argv[++i];
+    else if (!strcmp(argv[i], "--color-correction"))
+      o->color_correction = true;
+    else if (!strcmp(argv[i], "--no-render-thread"))
+      o->render_thread = false;
+    else if (!strcmp(argv[i], "--render-bands") && i + 1 < argc)
+      o->render_bands = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--break") && i + 1 < argc)
+      o->breakpoint = strtoul(argv[++i], NULL, 16);
+    else if (!strcmp(argv[i], "--save-sync") && i + 1 < argc)
+      o->save_sync_ms = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--bench-render"))
+      o->bench_render = true;
+    else if (!strcmp(argv[i], "--headless"))
+      o->headless = true;
+    else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+      o->frames = strtoull(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--screenshot") && i + 1 < argc)
+      o->screenshot = argv[++i];
+    else if (!strcmp(argv[i], "--hash-log") && i + 1 < argc)
+      o->hash_log = argv[++i];
+    else if (!strcmp(argv[i], "--hash-compare") && i + 2 < argc)
+    {
+      o->hash_compare[0] = argv[++i];
+      o->hash_compare[1] = argv[++i];
+    }
+    else
+      o->rom_path = argv[i];
+  }
+}
+
+
+bool options_start(const options *o)
+{
+  if (!emu_init(o->rom_path, o->bios_path, o->boot_bios))
+    return false;
+
+  palette_set_correction(o->color_correction);
+  cpu_set_breakpoint(o->breakpoint);
+  if (o->render_thread && !ppu_set_render_thread(true))
+    printf("No render thread, drawing on the CPU thread\n");
+  if (o->render_bands > 1 && !ppu_set_render_bands(o->render_bands))
+    printf("No band pool, drawing one line at a time\n");
+  if (o->save_sync_ms && !backup_start_sync(o->save_sync_ms))
+    printf("No save sync thread\n");
+
+  return true;
+}
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+
+#include "pacer.h"
+#include "emulator.h"
+
+
+#define NS_PER_SECOND 1000000000ull
+
+// 280896 cycles at 16.78 MHz: 16.74 ms, 59.73 Hz
+#define GBA_CLOCK_HZ  16777216ull
+#define GBA_FRAME_NS  (EMU_CYCLES_PER_FRAME * NS_PER_SECOND / GBA_CLOCK_HZ)
+
+// The kernel wakes us up late by up to this much; the rest is spun
+#define SPIN_NS       1000000ull
+
+// Further behind than this and we stop trying to catch up
+#define MAX_LAG_NS    (4 * GBA_FRAME_NS)
+
+#define SPEED_WINDOW_NS (NS_PER_SECOND / 2)
+
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+
+// Sleeps most of the way with an absolute deadline (no drift from the time
+// spent computing the sleep), then spins the last stretch
+static void wait_until(uint64_t deadline)
+{
+  uint64_t now = now_ns();
+
+  if (deadline > now + SPIN_NS)
+  {
+    uint64_t wake = deadline - SPIN_NS;
+    struct timespec ts = { wake / NS_PER_SECOND, wake % NS_PER_SECOND };
+    // A signal only interrupts the sleep; any other error ends it and the
+    // spin below covers the rest
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+      EINTR)
+    {
+    }
+  }
+
+  while (now_ns() < deadline)
+    ;
+}
+
+
+
+void pacer_init(pacer *p, pace_mode mode, double multiplier)
+{
+  p->mode = mode;
+  p->multiplier = multiplier > 0 ? multiplier : 1.0;
+  p->refresh_hz = 60.0;
+
+  p->audio_queued = NULL;
+  p->audio_user = NULL;
+  p->audio_target = 0;
+
+  p->wait_refresh = NULL;
+  p->refresh_user = NULL;
+
+  p->deadline = now_ns();
+  p->window_start = p->deadline;
+  p->window_frames = 0;
+  p->speed = 0;
+}
+
+
+void pacer_set_audio(pacer *p, uint32_t (*queued)(void *user), void *user,
+  uint32_t target)
+{
+  p->audio_queued = queued;
+  p->audio_user = user;
+  p->audio_target = target;
+}
+
+
+void pacer_set_refresh(pacer *p, double hz)
+{
+  if (hz > 0)
+    p->refresh_hz = hz;
+}
+
+
+void pacer_set_display(pacer *p, bool (*wait)(void *user), void *user)
+{
+  p->wait_refresh = wait;
+  p->refresh_user = user;
+}
+
+
+static uint64_t frame_period(pacer *p)
+{
+  switch (p->mode)
+  {
+  case PACE_MULTIPLIER:
+    return GBA_FRAME_NS / p->multiplier;
+
+  case PACE_DISPLAY:
+    return NS_PER_SECOND / p->refresh_hz;
+
+  case PACE_AUDIO:
+  {
+    if (!p->audio_queued || !p->audio_target)
+      return GBA_FRAME_NS;
+
+    // Rate control: stretch or shorten the frame by up to 0.5% depending
+    // on how far the queue is from its target, so the audio clock wins in
+    // the long run without audible pitch changes
+    double error = ((double)p->audio_queued(p->audio_user) - p->audio_target) /
+      p->audio_target;
+    error = error > 1.0 ? 1.0 : (error < -1.0 ? -1.0 : error);
+    return GBA_FRAME_NS * (1.0 + 0.005 * error);
+  }
+
+  default:
+    return 0;
+  }
+}
+
+
+static void update_speed(pacer *p, uint64_t now)
+{
+  p->window_frames++;
+
+  uint64_t elapsed = now - p->window_start;
+  if (elapsed < SPEED_WINDOW_NS)
+    return;
+
+  p->speed = (double)(p->window_frames * GBA_FRAME_NS) / elapsed;
+  p->window_start = now;
+  p->window_frames = 0;
+}
+
+
+void pacer_frame(pacer *p)
+{
+  // The present is the clock: the timer only restarts from it, in case the
+  // next frame has to fall back on it
+  if (p->mode == PACE_DISPLAY && p->wait_refresh &&
+    p->wait_refresh(p->refresh_user))
+  {
+    p->deadline = now_ns();
+  }
+  else if (p->mode != PACE_UNTHROTTLED)
+  {
+    p->deadline += frame_period(p);
+
+    uint64_t now = now_ns();
+    if (now > p->deadline + MAX_LAG_NS)
+      p->deadline = now;
+    else
+      wait_until(p->deadline);
+  }
+
+  update_speed(p, now_ns());
+}
+
+
+double pacer_speed(const pacer *p)
+{
+  return p->speed;
+}
+
+
+// True once per measurement window, when there is a new speed to show
+bool pacer_speed_updated(const pacer *p)
+{
+  return p->window_frames == 0;
+}
+
+
+const char *pacer_mode_name(pace_mode mode)
+{
+  static const char *names[] = { "unthrottled", "multiplier", "audio", "display" };
+  return names[mode];
+}
@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "palette.h"
+#include "render.h"
+
+
+// Every BGR555 color once: nothing is converted twice, and the palette
+// entries follow with one lookup each
+#define LUT_ENTRIES 32768
+
+
+typedef struct
+{
+  uint32_t lut[LUT_ENTRIES];
+  uint32_t colors[PALETTE_ENTRIES];
+  bool correction;
+} palette_cache;
+
+// Host side, like the framebuffer it feeds
+static palette_cache palette;
+
+
+// The LCD is darker and its channels bleed into each other. Gamma of the
+// screen, channel mix, then back to the host's gamma (as in higan).
+static uint32_t correct(uint16_t color)
+{
+  double r = pow((color & 0x1F) / 31.0, 4.0);
+  double g = pow(((color >> 5) & 0x1F) / 31.0, 4.0);
+  double b = pow(((color >> 10) & 0x1F) / 31.0, 4.0);
+
+  double scale = 255.0 * 255.0 / 280.0;
+  uint32_t red = pow((0 * b + 50 * g + 255 * r) / 255, 1 / 2.2) * scale;
+  uint32_t green = pow((30 * b + 230 * g + 10 * r) / 255, 1 / 2.2) * scale;
+  uint32_t blue = pow((220 * b + 10 * g + 50 * r) / 255, 1 / 2.2) * scale;
+
+  return 0xFF000000 | (red << 16) | (green << 8) | blue;
+}
+
+
+static void build_lut()
+{
+  if (palette.correction)
+  {
+    for (uint32_t color = 0; color < LUT_ENTRIES; ++color)
+      palette.lut[color] = correct(color);
+  }
+  else
+  {
+    uint16_t colors[LUT_ENTRIES];
+    for (uint32_t color = 0; color < LUT_ENTRIES; ++color)
+      colors[color] = color;
+    render_convert_bgr555(colors, palette.lut, LUT_ENTRIES);
+  }
+
+  // Everything has to go through the new table
+  memset(video.stale.palette, 0xFF, sizeof(video.stale.palette));
+}
+
+
+void palette_init()
+{
+  palette.correction = false;
+  build_lut();
+}
+
+
+void palette_set_correction(bool enabled)
+{
+  palette.correction = enabled;
+  build_lut();
+}
+
+
+void palette_sync()
+{
+  const uint16_t *pram = (const uint16_t *)video.pram;
+
+  for (uint32_t word = 0; word < PALETTE_ENTRIES / 64; ++word)
+  {
+    uint64_t stale = video.stale.palette[word];
+    if (!stale)
+      continue;
+    video.stale.palette[word] = 0;
+
+    while (stale)
+    {
+      uint32_t entry = word * 64 + __builtin_ctzll(stale);
+      palette.colors[entry] = palette.lut[pram[entry] & 0x7FFF];
+      stale &= stale - 1;
+    }
+  }
+}
+
+
+const uint32_t *palette_colors()
+{
+  return palette.colors;
+}
+
+
+void palette_direct(const uint16_t *src, uint32_t *dst, uint32_t count)
+{
+  // Without correction the SIMD conversion beats 128 KB of table lookups
+  if (!palette.correction)
+  {
+    render_convert_bgr555(src, dst, count);
+    return;
+  }
+
+  for (uint32_t i = 0; i < count; ++i)
+    dst[i] = palette.lut[src[i] & 0x7FFF];
+}
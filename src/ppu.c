@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "ppu.h"
+#include "bus.h"
+#include "io.h"
+#include "dma.h"
+#include "render.h"
+#include "render_queue.h"
+#include "tile_cache.h"
+#include "palette.h"
+#include "scheduler.h"
+
+
+// DISPSTAT:
+//
+//  Bit   Expl.
+//  0     V-Blank flag   (Read only) (1=VBlank) (set in line 160..226; not 227)
+//  1     H-Blank flag   (Read only) (1=HBlank) (toggled in all lines, 0..227)
+//  2     V-Counter flag (Read only) (1=Match)  (set in selected line)
+//  3     V-Blank IRQ Enable         (1=Enable)
+//  4     H-Blank IRQ Enable         (1=Enable)
+//  5     V-Counter IRQ Enable       (1=Enable)
+//  6-7   Not used
+//  8-15  V-Count Setting (LYC)      (0..227)
+
+#define DISPSTAT_VBLANK       0x0001
+#define DISPSTAT_HBLANK       0x0002
+#define DISPSTAT_VCOUNTER     0x0004
+#define DISPSTAT_VBLANK_IRQ   0x0008
+#define DISPSTAT_HBLANK_IRQ   0x0010
+#define DISPSTAT_VCOUNTER_IRQ 0x0020
+
+
+// The line is drawn for 960 cycles, then the HBlank flag goes up 46 cycles
+// later and stays up until the line ends
+static void hblank_start(uint64_t timestamp)
+{
+  uint16_t dispstat = io_get(REG_DISPSTAT) | DISPSTAT_HBLANK;
+  io_set(REG_DISPSTAT, dispstat);
+
+  if (dispstat & DISPSTAT_HBLANK_IRQ)
+    io_request_interrupt(IRQ_HBLANK);
+
+  // The line is complete by now; HBlank DMA only runs in the visible lines
+  uint16_t line = io_get(REG_VCOUNT);
+  if (line < PPU_VISIBLE_LINES)
+  {
+    render_queue_line(line);
+    render_affine_next_line();
+    dma_on_hblank();
+  }
+
+  scheduler_schedule(EVENT_PPU_LINE,
+    timestamp + PPU_CYCLES_PER_LINE - PPU_HBLANK_START);
+}
+
+
+static void line_end(uint64_t timestamp)
+{
+  uint16_t line = (io_get(REG_VCOUNT) + 1) % PPU_TOTAL_LINES;
+  uint16_t dispstat = io_get(REG_DISPSTAT) & ~DISPSTAT_HBLANK;
+
+  io_set(REG_VCOUNT, line);
+
+  if (line == PPU_VISIBLE_LINES)
+  {
+    dispstat |= DISPSTAT_VBLANK;
+    if (dispstat & DISPSTAT_VBLANK_IRQ)
+      io_request_interrupt(IRQ_VBLANK);
+    dma_on_vblank();
+    ppu_end_frame();
+
+    // The affine BGs start over from BGxX/BGxY for the next frame
+    for (uint8_t bg = 2; bg < 4; ++bg)
+    {
+      render_affine_latch(bg, false);
+      render_affine_latch(bg, true);
+    }
+  }
+  else if (line == PPU_TOTAL_LINES - 1)
+  {
+    dispstat &= ~DISPSTAT_VBLANK;
+  }
+
+  if (line == (dispstat >> 8))
+  {
+    dispstat |= DISPSTAT_VCOUNTER;
+    if (dispstat & DISPSTAT_VCOUNTER_IRQ)
+      io_request_interrupt(IRQ_VCOUNT);
+  }
+  else
+  {
+    dispstat &= ~DISPSTAT_VCOUNTER;
+  }
+
+  io_set(REG_DISPSTAT, dispstat);
+  dma_on_video_capture(line);
+
+  scheduler_schedule(EVENT_PPU_HBLANK, timestamp + PPU_HBLANK_START);
+}
+
+
+void ppu_init()
+{
+  render_init();
+  render_queue_init();
+
+  scheduler_register(EVENT_PPU_HBLANK, hblank_start);
+  scheduler_register(EVENT_PPU_LINE, line_end);
+  scheduler_schedule(EVENT_PPU_HBLANK, scheduler_now() + PPU_HBLANK_START);
+}
+
+
+void ppu_end_frame()
+{
+  render_queue_frame();
+}
+
+
+bool ppu_set_render_thread(bool enabled)
+{
+  if (!enabled)
+  {
+    render_queue_stop_thread();
+    return true;
+  }
+  return render_queue_start_thread();
+}
+
+
+bool ppu_set_render_bands(uint32_t threads)
+{
+  return render_bands_init(threads);
+}
+
+
+void ppu_set_output(uint32_t *pixels)
+{
+  render_queue_set_output(pixels);
+}
+
+
+void ppu_sync()
+{
+  render_queue_wait();
+}
+
+
+const uint32_t *ppu_framebuffer()
+{
+  return render_queue_framebuffer();
+}
+
+
+const tile_cache_stats *ppu_tile_cache_stats()
+{
+  return render_queue_tile_stats();
+}
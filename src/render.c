@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "render.h"
+#include "tile_cache.h"
+#include "palette.h"
+#include "io.h"
+
+
+// Scratch lines of the layers, reused from one line to the next. Every
+// thread drawing bands has its own.
+typedef struct
+{
+  line_buffer bg[4];
+  uint16_t colors[4][SCREEN_WIDTH];   // the same for the compositor
+  obj_line_buffer obj;
+} render_context;
+
+static _Thread_local render_context render;
+
+
+// Text and affine backgrounds of each mode (bit n = BGn)
+static const uint8_t text_layers[8] = { 0xF, 0x3, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0 };
+static const uint8_t affine_layers[8] = { 0x0, 0x4, 0xC, 0x0, 0x0, 0x0, 0x0, 0x0 };
+
+
+void render_init()
+{
+  render_bitmap_init();
+  render_affine_init();
+  render_compose_init();
+  tile_cache_init();
+  palette_init();
+}
+
+
+void render_sync()
+{
+  palette_sync();
+  tile_cache_sync();
+  render_obj_sync();
+}
+
+
+void render_scanline(const line_state *state, uint32_t *out)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+
+  if (dispcnt & DISPCNT_FORCED_BLANK)
+  {
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      out[x] = 0xFFFFFFFF;
+    return;
+  }
+
+  render_sync();
+  const uint32_t *palette = palette_colors();
+
+  // OBJs first: every mode draws them the same way
+  bool obj = dispcnt & DISPCNT_OBJ;
+  const obj_line_buffer *objs = NULL;
+  if (obj || (dispcnt & DISPCNT_OBJ_WIN))
+  {
+    render_obj_line(state, &render.obj);
+    objs = &render.obj;
+  }
+
+  // Windows and color effects take the compositor, the lines without any
+  // (most of them) the plain path below
+  bool effects = render_has_effects(state, objs);
+
+  uint8_t mode = DISPCNT_MODE(dispcnt);
+  if (mode >= 3 && effects)
+  {
+    const uint16_t *bg[4] = { NULL };
+    uint8_t priorities[4] =
+      { 0, 0, BGCNT_PRIORITY(line_reg(state, REG_BG2CNT)), 0 };
+    if (dispcnt & DISPCNT_BG(2))
+    {
+      render_bitmap_colors(state, render.colors[2]);
+      bg[2] = render.colors[2];
+    }
+
+    render_compose(state, bg, priorities, objs, out);
+    return;
+  }
+
+  if (mode >= 3)
+  {
+    uint32_t backdrop = palette[0];
+    bool bg2 = dispcnt & DISPCNT_BG(2);
+    uint8_t priority = BGCNT_PRIORITY(line_reg(state, REG_BG2CNT));
+
+    if (bg2)
+      render_bitmap_line(state, out, backdrop);
+    else
+      for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+        out[x] = backdrop;
+
+    for (uint32_t x = 0; obj && x < SCREEN_WIDTH; ++x)
+    {
+      uint8_t color = render.obj.color[x];
+      if (color && (!bg2 ||
+        (render.obj.flags[x] & OBJ_PIXEL_PRIORITY) <= priority ||
+        !render_bitmap_opaque(state, x)))
+      {
+        out[x] = palette[256 + color];
+      }
+    }
+    return;
+  }
+
+  // Draw every enabled layer on its own, in priority order (BG number
+  // breaks ties)
+  uint8_t layers[4];
+  uint8_t priorities[4];
+  uint8_t count = 0;
+  uint8_t text = text_layers[mode] & (dispcnt >> 8);
+  uint8_t affine = affine_layers[mode] & (dispcnt >> 8);
+
+  for (uint8_t priority = 0; priority < 4; ++priority)
+  {
+    for (uint8_t bg = 0; bg < 4; ++bg)
+    {
+      if (((text | affine) & (1 << bg)) &&
+        BGCNT_PRIORITY(line_reg(state, REG_BG0CNT + bg * 2)) == priority)
+      {
+        if (affine & (1 << bg))
+          render_affine_bg(state, bg, render.bg[bg]);
+        else
+          render_text_bg(state, bg, render.bg[bg]);
+        priorities[count] = priority;
+        layers[count++] = bg;
+      }
+    }
+  }
+
+  if (effects)
+  {
+    const uint16_t *pram = (const uint16_t *)video.pram;
+    const uint16_t *bg[4] = { NULL };
+    uint8_t bg_priorities[4] = { 0 };
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+      uint8_t layer = layers[i];
+      for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      {
+        uint8_t index = render.bg[layer][x];
+        render.colors[layer][x] = index ? pram[index] | 0x8000 : 0;
+      }
+      bg[layer] = render.colors[layer];
+      bg_priorities[layer] = priorities[i];
+    }
+
+    render_compose(state, bg, bg_priorities, objs, out);
+    return;
+  }
+
+  // Then the first opaque pixel wins; none at all is the backdrop, which
+  // is palette entry 0 anyway. An OBJ goes in front of the BGs of the same
+  // or a lower priority.
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+  {
+    uint8_t index = 0;
+    uint8_t priority = 4;
+    for (uint8_t i = 0; i < count && !index; ++i)
+    {
+      index = render.bg[layers[i]][x];
+      priority = priorities[i];
+    }
+    if (!index)
+      priority = 4;
+
+    uint8_t color = obj ? render.obj.color[x] : 0;
+    if (color && (render.obj.flags[x] & OBJ_PIXEL_PRIORITY) <= priority)
+      out[x] = palette[256 + color];
+    else
+      out[x] = palette[index];
+  }
+}
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "render.h"
+#include "io.h"
+#include "arena.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RENDER_X86
+#endif
+
+
+// BGxCNT screen size of the affine BGs: 128, 256, 512 or 1024 pixels square
+#define BG_SIZE_SHIFT(control)  (7 + BGCNT_SIZE(control))
+
+#define OBJ_VRAM 0x10000
+
+
+// Rotation/scaling registers of BG2 and BG3 (BG3 is 0x10 further):
+//
+//  Reg     Expl.
+//  BGxPA   dx, texture x per screen pixel     (8.8 fixed point, signed)
+//  BGxPB   dmx, texture x per screen line
+//  BGxPC   dy, texture y per screen pixel
+//  BGxPD   dmy, texture y per screen line
+//  BGxX    reference point x                  (20.8 fixed point, 28 bits)
+//  BGxY    reference point y
+
+#define REG_PA(bg)  (REG_BG2PA + ((bg) - 2) * 0x10)
+#define REG_PB(bg)  (REG_PA(bg) + 2)
+#define REG_PC(bg)  (REG_PA(bg) + 4)
+#define REG_PD(bg)  (REG_PA(bg) + 6)
+
+
+// One line of an affine BG: texture coordinates of the leftmost pixel and
+// their step to the next one, in 8.8 fixed point
+typedef struct
+{
+  int32_t x;
+  int32_t y;
+  int32_t pa;
+  int32_t pc;
+  uint32_t size_shift;
+  uint32_t screen_base;
+  uint32_t char_base;
+  bool wrap;
+} affine_bg;
+
+
+typedef void (*bg_kernel)(const affine_bg *bg, uint8_t *out);
+typedef void (*obj_kernel)(const affine_obj *obj, int32_t x, int32_t y,
+  int32_t pa, int32_t pc, uint32_t count, uint8_t *colors);
+
+static bg_kernel bg_line;
+static obj_kernel obj_line;
+
+
+
+// Both kernels below work the same way: step the coordinates, reduce them
+// to the texture (wrapping) or flag them outside, then fetch the map entry
+// and the pixel. Everything outside ends up transparent through a mask.
+
+static void bg_scalar(const affine_bg *bg, uint8_t *out)
+{
+  uint32_t mask = (1u << bg->size_shift) - 1;
+  uint32_t wrap = bg->wrap ? mask : ~0u;
+  int32_t x = bg->x;
+  int32_t y = bg->y;
+
+  for (uint32_t i = 0; i < SCREEN_WIDTH; ++i, x += bg->pa, y += bg->pc)
+  {
+    uint32_t u = (x >> 8) & wrap;
+    uint32_t v = (y >> 8) & wrap;
+    if ((u | v) & ~mask)
+    {
+      out[i] = 0;
+      continue;
+    }
+
+    uint8_t tile = video.vram[bg->screen_base +
+      ((v >> 3) << (bg->size_shift - 3)) + (u >> 3)];
+    out[i] = video.vram[bg->char_base + tile * 64 + (v & 7) * 8 + (u & 7)];
+  }
+}
+
+
+// Tile rows of an OBJ are row_shift tile numbers apart, its tile columns
+// color256 tile numbers (256 color tiles take two)
+static void obj_scalar(const affine_obj *obj, int32_t x, int32_t y,
+  int32_t pa, int32_t pc, uint32_t count, uint8_t *colors)
+{
+  for (uint32_t i = 0; i < count; ++i, x += pa, y += pc)
+  {
+    uint32_t u = x >> 8;
+    uint32_t v = y >> 8;
+    if ((u & ~(obj->width - 1)) | (v & ~(obj->height - 1)))
+    {
+      colors[i] = 0;
+      continue;
+    }
+
+    uint32_t tile = (obj->tile + ((v >> 3) << obj->row_shift) +
+      ((u >> 3) << obj->color256)) & 0x3FF;
+    uint32_t address = OBJ_VRAM + tile * 32;
+
+    if (obj->color256)
+    {
+      colors[i] = video.vram[address + (v & 7) * 8 + (u & 7)];
+    }
+    else
+    {
+      uint8_t color = video.vram[address + (v & 7) * 4 + (u & 7) / 2];
+      color = (color >> ((u & 1) * 4)) & 0xF;
+      colors[i] = color ? obj->palette | color : 0;
+    }
+  }
+}
+
+
+#ifdef RENDER_X86
+
+// The low byte of each of the 8 lanes, to 8 consecutive bytes
+__attribute__((target("avx2")))
+static inline void store_bytes(uint8_t *out, __m256i lanes)
+{
+  const __m256i low_bytes = _mm256_setr_epi8(
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  lanes = _mm256_shuffle_epi8(lanes, low_bytes);
+
+  uint32_t low = _mm_cvtsi128_si32(_mm256_castsi256_si128(lanes));
+  uint32_t high = _mm_cvtsi128_si32(_mm256_extracti128_si256(lanes, 1));
+  memcpy(out, &low, 4);
+  memcpy(out + 4, &high, 4);
+}
+
+
+// 8 pixels per iteration, the map entries and the pixels come from two
+// gathers. Lanes outside the texture fetch offset 0 and get masked out.
+__attribute__((target("avx2")))
+static void bg_avx2(const affine_bg *bg, uint8_t *out)
+{
+  const int *vram = (const int *)video.vram;
+  const __m256i byte = _mm256_set1_epi32(0xFF);
+  const __m256i seven = _mm256_set1_epi32(7);
+
+  uint32_t mask = (1u << bg->size_shift) - 1;
+  __m256i wrap = _mm256_set1_epi32(bg->wrap ? mask : ~0u);
+  __m256i outside = _mm256_set1_epi32(~mask);
+  __m128i row_shift = _mm_cvtsi32_si128(bg->size_shift - 3);
+  __m256i screen_base = _mm256_set1_epi32(bg->screen_base);
+  __m256i char_base = _mm256_set1_epi32(bg->char_base);
+
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i x = _mm256_add_epi32(_mm256_set1_epi32(bg->x),
+    _mm256_mullo_epi32(lanes, _mm256_set1_epi32(bg->pa)));
+  __m256i y = _mm256_add_epi32(_mm256_set1_epi32(bg->y),
+    _mm256_mullo_epi32(lanes, _mm256_set1_epi32(bg->pc)));
+  __m256i step_x = _mm256_set1_epi32(bg->pa * 8);
+  __m256i step_y = _mm256_set1_epi32(bg->pc * 8);
+
+  for (uint32_t i = 0; i < SCREEN_WIDTH; i += 8)
+  {
+    __m256i u = _mm256_and_si256(_mm256_srai_epi32(x, 8), wrap);
+    __m256i v = _mm256_and_si256(_mm256_srai_epi32(y, 8), wrap);
+    __m256i inside = _mm256_cmpeq_epi32(_mm256_and_si256(
+      _mm256_or_si256(u, v), outside), _mm256_setzero_si256());
+
+    __m256i entry = _mm256_add_epi32(screen_base, _mm256_add_epi32(
+      _mm256_sll_epi32(_mm256_srli_epi32(v, 3), row_shift),
+      _mm256_srli_epi32(u, 3)));
+    entry = _mm256_and_si256(entry, inside);
+    __m256i tile = _mm256_and_si256(
+      _mm256_i32gather_epi32(vram, entry, 1), byte);
+
+    __m256i pixel = _mm256_add_epi32(
+      _mm256_add_epi32(char_base, _mm256_slli_epi32(tile, 6)),
+      _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(v, seven), 3),
+      _mm256_and_si256(u, seven)));
+    pixel = _mm256_and_si256(pixel, inside);
+    __m256i color = _mm256_and_si256(
+      _mm256_i32gather_epi32(vram, pixel, 1), byte);
+
+    store_bytes(out + i, _mm256_and_si256(color, inside));
+
+    x = _mm256_add_epi32(x, step_x);
+    y = _mm256_add_epi32(y, step_y);
+  }
+}
+
+
+// Writes whole groups of 8: the colors buffer has room for the overshoot
+__attribute__((target("avx2")))
+static void obj_avx2(const affine_obj *obj, int32_t x, int32_t y,
+  int32_t pa, int32_t pc, uint32_t count, uint8_t *colors)
+{
+  const int *vram = (const int *)video.vram;
+  const __m256i byte = _mm256_set1_epi32(0xFF);
+  const __m256i seven = _mm256_set1_epi32(7);
+  const __m256i zero = _mm256_setzero_si256();
+
+  __m256i outside_u = _mm256_set1_epi32(~(obj->width - 1));
+  __m256i outside_v = _mm256_set1_epi32(~(obj->height - 1));
+  __m256i first_tile = _mm256_set1_epi32(obj->tile);
+  __m128i row_shift = _mm_cvtsi32_si128(obj->row_shift);
+  __m128i column_shift = _mm_cvtsi32_si128(obj->color256);
+  __m128i pixel_row_shift = _mm_cvtsi32_si128(obj->color256 ? 3 : 2);
+  __m128i pixel_shift = _mm_cvtsi32_si128(obj->color256 ? 0 : 1);
+  __m256i palette = _mm256_set1_epi32(obj->palette);
+
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i tex_x = _mm256_add_epi32(_mm256_set1_epi32(x),
+    _mm256_mullo_epi32(lanes, _mm256_set1_epi32(pa)));
+  __m256i tex_y = _mm256_add_epi32(_mm256_set1_epi32(y),
+    _mm256_mullo_epi32(lanes, _mm256_set1_epi32(pc)));
+  __m256i step_x = _mm256_set1_epi32(pa * 8);
+  __m256i step_y = _mm256_set1_epi32(pc * 8);
+
+  for (uint32_t i = 0; i < count; i += 8)
+  {
+    __m256i u = _mm256_srai_epi32(tex_x, 8);
+    __m256i v = _mm256_srai_epi32(tex_y, 8);
+    __m256i inside = _mm256_cmpeq_epi32(_mm256_or_si256(
+      _mm256_and_si256(u, outside_u), _mm256_and_si256(v, outside_v)), zero);
+
+    __m256i tile = _mm256_add_epi32(first_tile, _mm256_add_epi32(
+      _mm256_sll_epi32(_mm256_srli_epi32(v, 3), row_shift),
+      _mm256_sll_epi32(_mm256_srli_epi32(u, 3), column_shift)));
+    tile = _mm256_and_si256(tile, _mm256_set1_epi32(0x3FF));
+
+    __m256i address = _mm256_add_epi32(
+      _mm256_add_epi32(_mm256_set1_epi32(OBJ_VRAM), _mm256_slli_epi32(tile, 5)),
+      _mm256_add_epi32(
+      _mm256_sll_epi32(_mm256_and_si256(v, seven), pixel_row_shift),
+      _mm256_srl_epi32(_mm256_and_si256(u, seven), pixel_shift)));
+    address = _mm256_and_si256(address, inside);
+    __m256i color = _mm256_and_si256(
+      _mm256_i32gather_epi32(vram, address, 1), byte);
+
+    if (!obj->color256)
+    {
+      // Odd pixels are in the high nibble; 0 stays transparent
+      __m256i nibble = _mm256_slli_epi32(_mm256_and_si256(u,
+        _mm256_set1_epi32(1)), 2);
+      color = _mm256_and_si256(_mm256_srlv_epi32(color, nibble),
+        _mm256_set1_epi32(0xF));
+      color = _mm256_or_si256(color, _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(color, zero), palette));
+    }
+
+    store_bytes(colors + i, _mm256_and_si256(color, inside));
+
+    tex_x = _mm256_add_epi32(tex_x, step_x);
+    tex_y = _mm256_add_epi32(tex_y, step_y);
+  }
+}
+
+#endif
+
+
+void render_affine_init()
+{
+  bg_line = bg_scalar;
+  obj_line = obj_scalar;
+
+  // Without gathers, SSE2 would only add the address arithmetic, which
+  // is not where the time goes
+#ifdef RENDER_X86
+  if (__builtin_cpu_supports("avx2"))
+  {
+    bg_line = bg_avx2;
+    obj_line = obj_avx2;
+  }
+#endif
+}
+
+
+
+// The internal reference points: latched from BGxX/BGxY at the start of
+// each frame and when the game writes them, moved by PB/PD after each line
+static inline int32_t reference(uint32_t address)
+{
+  uint32_t value = io_get(address) | (io_get(address + 2) << 16);
+
+  // 28 bit signed
+  return (int32_t)(value << 4) >> 4;
+}
+
+void render_affine_latch(uint8_t bg, bool y)
+{
+  uint32_t address = REG_BG2X + (bg - 2) * 0x10 + (y ? 4 : 0);
+  if (y)
+    arena.affine[bg - 2].y = reference(address);
+  else
+    arena.affine[bg - 2].x = reference(address);
+}
+
+void render_affine_next_line()
+{
+  for (uint8_t bg = 2; bg < 4; ++bg)
+  {
+    arena.affine[bg - 2].x += (int16_t)io_get(REG_PB(bg));
+    arena.affine[bg - 2].y += (int16_t)io_get(REG_PD(bg));
+  }
+}
+
+
+void render_affine_bg(const line_state *state, uint8_t bg, uint8_t *out)
+{
+  uint16_t control = line_reg(state, REG_BG0CNT + bg * 2);
+
+  affine_bg line =
+  {
+    .x = state->affine[bg - 2].x,
+    .y = state->affine[bg - 2].y,
+    .pa = (int16_t)line_reg(state, REG_PA(bg)),
+    .pc = (int16_t)line_reg(state, REG_PC(bg)),
+    .size_shift = BG_SIZE_SHIFT(control),
+    .screen_base = BGCNT_SCREEN_BASE(control),
+    .char_base = BGCNT_CHAR_BASE(control),
+    .wrap = control & BGCNT_WRAPAROUND,
+  };
+
+  bg_line(&line, out);
+}
+
+
+void render_affine_obj(const affine_obj *obj, int32_t x, int32_t y,
+  int32_t pa, int32_t pc, uint32_t count, uint8_t *colors)
+{
+  obj_line(obj, x, y, pa, pc, count, colors);
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "render.h"
+#include "tile_cache.h"
+#include "io.h"
+
+
+// Fewer lines than this are not worth waking the pool for: a game that
+// writes video memory in the middle of the frame cuts it in small batches
+#define BAND_MIN_BATCH  (BAND_LINES * 2)
+
+
+typedef struct
+{
+  uint32_t threads;               // the caller included
+  thrd_t workers[BAND_MAX_THREADS - 1];
+
+  // The batch being drawn; bands are taken in order by whoever is free
+  const line_state *lines;
+  uint32_t count;
+  uint32_t *framebuffer;
+  atomic_uint next_band;
+
+  // Under the lock: batches started so far, workers still drawing
+  mtx_t lock;
+  cnd_t start;
+  cnd_t done;
+  uint32_t batches;
+  uint32_t busy;
+  bool stopping;
+} band_pool;
+
+static band_pool pool = { .threads = 1 };
+
+
+static void draw_bands()
+{
+  uint32_t bands = (pool.count + BAND_LINES - 1) / BAND_LINES;
+  uint32_t band;
+
+  while ((band = atomic_fetch_add(&pool.next_band, 1)) < bands)
+  {
+    uint32_t end = (band + 1) * BAND_LINES;
+    if (end > pool.count)
+      end = pool.count;
+
+    for (uint32_t i = band * BAND_LINES; i < end; ++i)
+      render_scanline(&pool.lines[i],
+        &pool.framebuffer[pool.lines[i].line * SCREEN_WIDTH]);
+  }
+}
+
+static int band_worker(void *unused)
+{
+  (void)unused;
+  uint32_t seen = 0;
+
+  mtx_lock(&pool.lock);
+  while (true)
+  {
+    while (pool.batches == seen && !pool.stopping)
+      cnd_wait(&pool.start, &pool.lock);
+    if (pool.stopping)
+      break;
+    seen = pool.batches;
+    mtx_unlock(&pool.lock);
+
+    draw_bands();
+    tile_cache_flush_stats();
+
+    mtx_lock(&pool.lock);
+    if (--pool.busy == 0)
+      cnd_signal(&pool.done);
+  }
+  mtx_unlock(&pool.lock);
+
+  return 0;
+}
+
+
+bool render_bands_init(uint32_t threads)
+{
+  render_bands_stop();
+
+  if (threads > BAND_MAX_THREADS)
+    threads = BAND_MAX_THREADS;
+  if (threads <= 1)
+    return true;
+
+  if (mtx_init(&pool.lock, mtx_plain) != thrd_success)
+    return false;
+  if (cnd_init(&pool.start) != thrd_success ||
+    cnd_init(&pool.done) != thrd_success)
+  {
+    mtx_destroy(&pool.lock);
+    return false;
+  }
+
+  pool.batches = 0;
+  pool.busy = 0;
+  pool.stopping = false;
+
+  for (pool.threads = 1; pool.threads < threads; ++pool.threads)
+  {
+    if (thrd_create(&pool.workers[pool.threads - 1], band_worker, NULL) !=
+      thrd_success)
+    {
+      render_bands_stop();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void render_bands_stop()
+{
+  if (pool.threads <= 1)
+    return;
+
+  mtx_lock(&pool.lock);
+  pool.stopping = true;
+  cnd_broadcast(&pool.start);
+  mtx_unlock(&pool.lock);
+
+  for (uint32_t i = 0; i < pool.threads - 1; ++i)
+    thrd_join(pool.workers[i], NULL);
+
+  cnd_destroy(&pool.start);
+  cnd_destroy(&pool.done);
+  mtx_destroy(&pool.lock);
+  pool.threads = 1;
+}
+
+
+uint32_t render_bands_threads()
+{
+  return pool.threads;
+}
+
+
+// The caches must be synced beforehand (render_sync): the lines only read
+// them then
+void render_bands_draw(const line_state *lines, uint32_t count,
+  uint32_t *framebuffer)
+{
+  pool.lines = lines;
+  pool.count = count;
+  pool.framebuffer = framebuffer;
+  atomic_store(&pool.next_band, 0);
+
+  if (pool.threads <= 1 || count < BAND_MIN_BATCH)
+  {
+    draw_bands();
+    return;
+  }
+
+  mtx_lock(&pool.lock);
+  pool.busy = pool.threads - 1;
+  pool.batches++;
+  cnd_broadcast(&pool.start);
+  mtx_unlock(&pool.lock);
+
+  draw_bands();
+
+  mtx_lock(&pool.lock);
+  while (pool.busy)
+    cnd_wait(&pool.done, &pool.lock);
+  mtx_unlock(&pool.lock);
+}
+
+
+
+// A busy mode 0 frame: four scrolling BGs, a screen of OBJs and alpha
+// blending, with the same registers as the hardware would latch them
+static void bench_scene(line_state *lines)
+{
+  uint32_t seed = 0x12345678;
+  for (uint32_t i = 0; i < sizeof(video.vram); ++i)
+  {
+    seed = seed * 1664525 + 1013904223;
+    video.vram[i] = seed >> 24;
+  }
+  for (uint32_t i = 0; i < sizeof(video.pram); ++i)
+    video.pram[i] = i * 37;
+
+  uint16_t *oam = (uint16_t *)video.oam;
+  for (uint32_t i = 0; i < 128; ++i)
+  {
+    seed = seed * 1664525 + 1013904223;
+    oam[i * 4] = (i * 13) & 0xFF;                        // Y, square
+    oam[i * 4 + 1] = ((i * 29) & 0x1FF) | 0x4000;        // X, 16x16
+    oam[i * 4 + 2] = (seed >> 16) & 0x03FF;              // tile
+  }
+
+  memset(&video.stale, 0xFF, sizeof(video.stale));
+
+  for (uint16_t line = 0; line < SCREEN_HEIGHT; ++line)
+  {
+    line_state *state = &lines[line];
+    memset(state, 0, sizeof(*state));
+    state->line = line;
+    state->regs[REG_DISPCNT / 2] = 0x1F00 | DISPCNT_OBJ_1D;
+    for (uint8_t bg = 0; bg < 4; ++bg)
+    {
+      state->regs[(REG_BG0CNT + bg * 2) / 2] = bg | (bg << 2) |
+        ((24 + bg) << 8) | (bg == 1 ? BGCNT_256_COLORS : 0);
+      state->regs[(REG_BG0HOFS + bg * 4) / 2] = line * (bg + 1);
+      state->regs[(REG_BG0VOFS + bg * 4) / 2] = bg * 40;
+    }
+    state->regs[REG_BLDCNT / 2] = 0x3E41;
+    state->regs[REG_BLDALPHA / 2] = 0x0A06;
+  }
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// How the time per frame goes down from 1 to 8 threads, checked against
+// the single thread picture
+void render_bands_benchmark()
+{
+  static line_state lines[SCREEN_HEIGHT];
+  static uint32_t reference[SCREEN_WIDTH * SCREEN_HEIGHT];
+  static uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+  const uint32_t frames = 500;
+
+  bench_scene(lines);
+  render_sync();
+  render_bands_init(1);
+  render_bands_draw(lines, SCREEN_HEIGHT, reference);
+
+  double single = 0;
+  for (uint32_t threads = 1; threads <= 8; ++threads)
+  {
+    if (!render_bands_init(threads))
+    {
+      printf("%u threads: could not start the pool\n", threads);
+      break;
+    }
+
+    memset(framebuffer, 0, sizeof(framebuffer));
+    double start = now();
+    for (uint32_t frame = 0; frame < frames; ++frame)
+      render_bands_draw(lines, SCREEN_HEIGHT, framebuffer);
+    double ms = (now() - start) * 1000 / frames;
+    if (threads == 1)
+      single = ms;
+
+    printf("%u thread%s: %.3f ms/frame, x%.2f%s\n", threads,
+      threads > 1 ? "s" : " ", ms, single / ms,
+      memcmp(framebuffer, reference, sizeof(reference)) ? " MISMATCH" : "");
+  }
+
+  render_bands_stop();
+}
@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "render.h"
+#include "tile_cache.h"
+#include "io.h"
+
+
+// Screen entry (text mode):
+//
+//  Bit   Expl.
+//  0-9   Tile Number     (0-1023)
+//  10    Horizontal Flip (0=Normal, 1=Mirrored)
+//  11    Vertical Flip   (0=Normal, 1=Mirrored)
+//  12-15 Palette Number  (0-15)    (Not used in 256 color/1 palette mode)
+
+#define ENTRY_TILE(entry)     ((entry) & 0x3FF)
+#define ENTRY_HFLIP           0x0400
+#define ENTRY_VFLIP           0x0800
+#define ENTRY_PALETTE(entry)  (((entry) >> 8) & 0xF0)
+
+// Backgrounds can only fetch tiles from the first 64 KB of VRAM
+#define BG_VRAM_SIZE 0x10000
+
+// 30 tiles cover the screen, one more when the scroll is not tile aligned
+#define LINE_TILES 31
+
+
+// A row of 16 color pixels from the cache gets the palette bank of its
+// screen entry, except where it is transparent. All 8 at once: the top bit of
+// each byte of (x + 0x7F) | x is set when that byte is nonzero.
+static inline void emit_4bpp(uint8_t *out, const uint8_t *row, uint16_t entry)
+{
+  uint64_t pixels;
+  memcpy(&pixels, row, 8);
+
+  uint64_t opaque = ((pixels + 0x7F7F7F7F7F7F7F7Full) | pixels) &
+    0x8080808080808080ull;
+  opaque = (opaque >> 7) * 0xFF;
+
+  pixels |= (ENTRY_PALETTE(entry) * 0x0101010101010101ull) & opaque;
+  memcpy(out, &pixels, 8);
+}
+
+
+void render_text_bg(const line_state *state, uint8_t bg, uint8_t *out)
+{
+  uint16_t control = line_reg(state, REG_BG0CNT + bg * 2);
+  uint16_t hofs = line_reg(state, REG_BG0HOFS + bg * 4) & 0x1FF;
+  uint16_t vofs = line_reg(state, REG_BG0VOFS + bg * 4) & 0x1FF;
+
+  uint32_t char_base = BGCNT_CHAR_BASE(control);
+  uint32_t screen_base = BGCNT_SCREEN_BASE(control);
+  uint8_t size = BGCNT_SIZE(control);
+  bool color256 = control & BGCNT_256_COLORS;
+
+  // 256 or 512 pixels each way, made of 32x32 tile screen blocks: the one
+  // on the right comes next, the ones below after those
+  uint16_t width_mask = (size & 1) ? 511 : 255;
+  uint16_t height_mask = (size & 2) ? 511 : 255;
+
+  uint16_t y = (state->line + vofs) & height_mask;
+  uint32_t row_base = screen_base + ((y >> 3) & 31) * 64;
+  if (y >= 256)
+    row_base += (size == 3) ? 0x1000 : 0x800;
+  uint8_t tile_y = y & 7;
+
+  // Whole tile rows go to a scratch line that starts up to 7 pixels left
+  // of the screen, the visible part is copied out at the end
+  uint8_t scratch[LINE_TILES * 8];
+  uint16_t x = hofs & ~7;
+
+  for (uint8_t i = 0; i < LINE_TILES; ++i)
+  {
+    uint32_t entry_address = row_base + ((x >> 3) & 31) * 2;
+    if (x >= 256)
+      entry_address += 0x800;
+    uint16_t entry = *((uint16_t *)&video.vram[entry_address]);
+
+    uint8_t row = (entry & ENTRY_VFLIP) ? 7 - tile_y : tile_y;
+    uint8_t *dst = &scratch[i * 8];
+    uint32_t address = char_base + ENTRY_TILE(entry) * (color256 ? 64 : 32);
+
+    if (address >= BG_VRAM_SIZE)
+    {
+      memset(dst, 0, 8);
+    }
+    else
+    {
+      const uint8_t *pixels = tile_cache_get(address, color256,
+        entry & ENTRY_HFLIP) + row * 8;
+      if (color256)
+        memcpy(dst, pixels, 8);
+      else
+        emit_4bpp(dst, pixels, entry);
+    }
+
+    x = (x + 8) & width_mask;
+  }
+
+  memcpy(out, &scratch[hofs & 7], SCREEN_WIDTH);
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "render.h"
+#include "palette.h"
+#include "io.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RENDER_X86
+#endif
+
+
+// Modes 4 and 5 have two frames, DISPCNT bit 4 selects the one shown
+#define FRAME_OFFSET      0xA000
+
+#define MODE5_WIDTH       160
+#define MODE5_HEIGHT      128
+
+
+typedef void (*bgr555_kernel)(const uint16_t *src, uint32_t *dst,
+  uint32_t count);
+typedef void (*indexed_kernel)(const uint8_t *src, const uint32_t *palette,
+  uint32_t *dst, uint32_t count);
+
+static bgr555_kernel convert_bgr555;
+static indexed_kernel convert_indexed;
+
+
+
+// 5 bit channels go to 8 bits with their top bits copied down, so that 31
+// becomes 255: x8 = x5 << 3 | x5 >> 2
+static void bgr555_scalar(const uint16_t *src, uint32_t *dst, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t r = src[i] & 0x1F;
+    uint32_t g = (src[i] >> 5) & 0x1F;
+    uint32_t b = (src[i] >> 10) & 0x1F;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+    dst[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+  }
+}
+
+static void indexed_scalar(const uint8_t *src, const uint32_t *palette,
+  uint32_t *dst, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; ++i)
+    dst[i] = palette[src[i]];
+}
+
+
+#ifdef RENDER_X86
+
+// The same arithmetic as the scalar version, on 32 bit lanes
+#define BGR555_TO_ARGB(set1, and, or, slli, srli, v)                          \
+({                                                                            \
+  __typeof__(v) mask = set1(0x1F);                                            \
+  __typeof__(v) r = and(v, mask);                                             \
+  __typeof__(v) g = and(srli(v, 5), mask);                                    \
+  __typeof__(v) b = and(srli(v, 10), mask);                                   \
+  r = or(slli(r, 3), srli(r, 2));                                             \
+  g = or(slli(g, 3), srli(g, 2));                                             \
+  b = or(slli(b, 3), srli(b, 2));                                             \
+  or(or(set1(0xFF000000), slli(r, 16)), or(slli(g, 8), b));                   \
+})
+
+
+static void bgr555_sse2(const uint16_t *src, uint32_t *dst, uint32_t count)
+{
+  const __m128i zero = _mm_setzero_si128();
+
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i low = _mm_unpacklo_epi16(pixels, zero);
+    __m128i high = _mm_unpackhi_epi16(pixels, zero);
+
+    _mm_storeu_si128((__m128i *)(dst + i), BGR555_TO_ARGB(_mm_set1_epi32,
+      _mm_and_si128, _mm_or_si128, _mm_slli_epi32, _mm_srli_epi32, low));
+    _mm_storeu_si128((__m128i *)(dst + i + 4), BGR555_TO_ARGB(_mm_set1_epi32,
+      _mm_and_si128, _mm_or_si128, _mm_slli_epi32, _mm_srli_epi32, high));
+  }
+
+  bgr555_scalar(src + i, dst + i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+static void bgr555_avx2(const uint16_t *src, uint32_t *dst, uint32_t count)
+{
+  uint32_t i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m256i low = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i *)(src + i)));
+    __m256i high = _mm256_cvtepu16_epi32(
+      _mm_loadu_si128((const __m128i *)(src + i + 8)));
+
+    _mm256_storeu_si256((__m256i *)(dst + i), BGR555_TO_ARGB(
+      _mm256_set1_epi32, _mm256_and_si256, _mm256_or_si256, _mm256_slli_epi32,
+      _mm256_srli_epi32, low));
+    _mm256_storeu_si256((__m256i *)(dst + i + 8), BGR555_TO_ARGB(
+      _mm256_set1_epi32, _mm256_and_si256, _mm256_or_si256, _mm256_slli_epi32,
+      _mm256_srli_epi32, high));
+  }
+
+  bgr555_scalar(src + i, dst + i, count - i);
+}
+
+
+// 8 palette lookups per gather
+__attribute__((target("avx2")))
+static void indexed_avx2(const uint8_t *src, const uint32_t *palette,
+  uint32_t *dst, uint32_t count)
+{
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i indices = _mm256_cvtepu8_epi32(
+      _mm_loadl_epi64((const __m128i *)(src + i)));
+    _mm256_storeu_si256((__m256i *)(dst + i),
+      _mm256_i32gather_epi32((const int *)palette, indices, 4));
+  }
+
+  indexed_scalar(src + i, palette, dst + i, count - i);
+}
+
+#endif
+
+
+void render_bitmap_init()
+{
+  convert_bgr555 = bgr555_scalar;
+  convert_indexed = indexed_scalar;
+
+#ifdef RENDER_X86
+  if (__builtin_cpu_supports("avx2"))
+  {
+    convert_bgr555 = bgr555_avx2;
+    convert_indexed = indexed_avx2;
+  }
+  else
+  {
+    // SSE2 has no gather: the plain table lookup stays
+    convert_bgr555 = bgr555_sse2;
+  }
+#endif
+}
+
+
+void render_convert_bgr555(const uint16_t *src, uint32_t *dst, uint32_t count)
+{
+  convert_bgr555(src, dst, count);
+}
+
+
+
+// BG2 of modes 3-5, untransformed. Pixels outside a mode 5 frame show the
+// backdrop.
+void render_bitmap_line(const line_state *state, uint32_t *out,
+  uint32_t backdrop)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+  uint16_t line = state->line;
+  uint8_t mode = DISPCNT_MODE(dispcnt);
+  uint32_t frame = (dispcnt & DISPCNT_FRAME) ? FRAME_OFFSET : 0;
+
+  switch (mode)
+  {
+  case 3:
+    palette_direct((const uint16_t *)&video.vram[line * SCREEN_WIDTH * 2], out,
+      SCREEN_WIDTH);
+    break;
+
+  case 4:
+    // Index 0 is transparent, and the backdrop is BG palette entry 0 anyway
+    convert_indexed(&video.vram[frame + line * SCREEN_WIDTH], palette_colors(),
+      out, SCREEN_WIDTH);
+    break;
+
+  case 5:
+  {
+    uint32_t x = 0;
+    if (line < MODE5_HEIGHT)
+    {
+      uint32_t address = frame + line * MODE5_WIDTH * 2;
+      palette_direct((const uint16_t *)&video.vram[address], out, MODE5_WIDTH);
+      x = MODE5_WIDTH;
+    }
+    for (; x < SCREEN_WIDTH; ++x)
+      out[x] = backdrop;
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+
+bool render_bitmap_opaque(const line_state *state, uint16_t x)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+  uint16_t line = state->line;
+  uint32_t frame = (dispcnt & DISPCNT_FRAME) ? FRAME_OFFSET : 0;
+
+  switch (DISPCNT_MODE(dispcnt))
+  {
+  case 3:
+    return true;
+
+  case 4:
+    return video.vram[frame + line * SCREEN_WIDTH + x] != 0;
+
+  case 5:
+    return line < MODE5_HEIGHT && x < MODE5_WIDTH;
+
+  default:
+    return false;
+  }
+}
+
+
+void render_bitmap_colors(const line_state *state, uint16_t *out)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+  uint16_t line = state->line;
+  const uint16_t *pram = (const uint16_t *)video.pram;
+  uint32_t frame = (dispcnt & DISPCNT_FRAME) ? FRAME_OFFSET : 0;
+
+  switch (DISPCNT_MODE(dispcnt))
+  {
+  case 3:
+  {
+    const uint16_t *pixels = (const uint16_t *)
+      &video.vram[line * SCREEN_WIDTH * 2];
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      out[x] = pixels[x] | 0x8000;
+    break;
+  }
+
+  case 4:
+  {
+    const uint8_t *indices = &video.vram[frame + line * SCREEN_WIDTH];
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      out[x] = indices[x] ? pram[indices[x]] | 0x8000 : 0;
+    break;
+  }
+
+  case 5:
+  {
+    const uint16_t *pixels = (const uint16_t *)
+      &video.vram[frame + line * MODE5_WIDTH * 2];
+    bool visible = line < MODE5_HEIGHT;
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      out[x] = (visible && x < MODE5_WIDTH) ? pixels[x] | 0x8000 : 0;
+    break;
+  }
+
+  default:
+    memset(out, 0, SCREEN_WIDTH * sizeof(uint16_t));
+    break;
+  }
+}
+
+
+static double bench(void (*run)(void *), void *data, uint32_t lines)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < lines; ++i)
+    run(data);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec) +
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+  return lines * SCREEN_WIDTH / seconds / 1e6;
+}
+
+typedef struct
+{
+  bgr555_kernel bgr555;
+  indexed_kernel indexed;
+  uint16_t src[SCREEN_WIDTH];
+  uint8_t indices[SCREEN_WIDTH];
+  uint32_t palette[256];
+  uint32_t dst[SCREEN_WIDTH];
+} bench_data;
+
+static void bench_bgr555(void *data)
+{
+  bench_data *b = data;
+  b->bgr555(b->src, b->dst, SCREEN_WIDTH);
+  __asm__ volatile("" : : "r"(b->dst) : "memory");
+}
+
+static void bench_indexed(void *data)
+{
+  bench_data *b = data;
+  b->indexed(b->indices, b->palette, b->dst, SCREEN_WIDTH);
+  __asm__ volatile("" : : "r"(b->dst) : "memory");
+}
+
+
+// Compares every kernel available on this host with the scalar reference:
+// same output, and how many megapixels per second
+void render_bitmap_benchmark()
+{
+  static bench_data b;
+  const uint32_t lines = 200000;
+
+  for (uint32_t i = 0; i < SCREEN_WIDTH; ++i)
+  {
+    b.src[i] = i * 0x0123;
+    b.indices[i] = i * 7;
+  }
+  for (uint32_t i = 0; i < 256; ++i)
+    b.palette[i] = 0xFF000000 | i * 0x010101;
+
+  uint32_t reference[SCREEN_WIDTH];
+  bgr555_scalar(b.src, reference, SCREEN_WIDTH);
+
+  struct { const char *name; bgr555_kernel bgr555; indexed_kernel indexed; }
+  kernels[] =
+  {
+    { "scalar", bgr555_scalar, indexed_scalar },
+#ifdef RENDER_X86
+    { "sse2", bgr555_sse2, indexed_scalar },
+    { "avx2", bgr555_avx2, indexed_avx2 },
+#endif
+  };
+
+  for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+  {
+#ifdef RENDER_X86
+    if (!strcmp(kernels[k].name, "avx2") && !__builtin_cpu_supports("avx2"))
+      continue;
+#endif
+    b.bgr555 = kernels[k].bgr555;
+    b.indexed = kernels[k].indexed;
+
+    b.bgr555(b.src, b.dst, SCREEN_WIDTH);
+    bool same = !memcmp(b.dst, reference, sizeof(reference));
+
+    double mode35 = bench(bench_bgr555, &b, lines);
+    double mode4 = bench(bench_indexed, &b, lines);
+    printf("%-8s mode 3/5: %8.1f Mpix/s  mode 4: %8.1f Mpix/s  %s\n",
+      kernels[k].name, mode35, mode4, same ? "" : "(MISMATCH)");
+  }
+}
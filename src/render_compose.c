@@ -0,0 +1,556 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "render.h"
+#include "palette.h"
+#include "io.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RENDER_X86
+#endif
+
+
+// WINxH / WINxV:
+//
+//  Bit   Expl.
+//  0-7   X2 / Y2, Rightmost / Bottom-most coordinate of window, plus 1
+//  8-15  X1 / Y1, Leftmost / Top-most coordinate of window
+//
+// Garbage values of X2>240 or X1>X2 are interpreted as X2=240 (same for
+// Y2 and 160).
+//
+// WININ / WINOUT:
+//
+//  Bit   Expl.
+//  0-5   Window 0 / Outside: BG0-BG3, OBJ and Color Special Effect enable
+//  8-13  Window 1 / OBJ Window: same
+//
+// BLDCNT:
+//
+//  Bit   Expl.
+//  0-5   1st Target Pixel (BG0, BG1, BG2, BG3, OBJ, BD)
+//  6-7   Color Special Effect (0=None, 1=Alpha, 2=Brighter, 3=Darker)
+//  8-13  2nd Target Pixel (BG0, BG1, BG2, BG3, OBJ, BD)
+//
+// BLDALPHA: 0-4 EVA, 8-12 EVB (each 0..16, more counts as 16)
+// BLDY:     0-4 EVY           (0..16, more counts as 16)
+
+#define WIN_START(reg)      ((reg) >> 8)
+#define WIN_END(reg)        ((reg) & 0xFF)
+
+#define BLD_EFFECT(bldcnt)  (((bldcnt) >> 6) & 0x3)
+#define BLD_NONE            0
+#define BLD_ALPHA           1
+#define BLD_BRIGHTER        2
+#define BLD_DARKER          3
+
+// Layer bits, as in the window and target masks
+#define LAYER_OBJ           0x10
+#define LAYER_BD            0x20
+#define LAYER_EFFECTS       0x20
+#define LAYER_ALL           0x3F
+
+// Colors of a layer line carry their opacity in the free bit 15
+#define OPAQUE              0x8000
+
+
+// Each pixel keeps the two frontmost layers that are visible through its
+// window: the one on top and the one it can blend with
+typedef struct
+{
+  uint16_t top[SCREEN_WIDTH];
+  uint16_t top_layer[SCREEN_WIDTH];
+  uint16_t second[SCREEN_WIDTH];
+  uint16_t second_layer[SCREEN_WIDTH];
+  uint16_t window[SCREEN_WIDTH];
+} compose_state;
+
+typedef struct
+{
+  uint16_t first;       // BLDCNT targets
+  uint16_t second;
+  uint16_t effect;
+  uint16_t eva;
+  uint16_t evb;
+  uint16_t evy;
+} blend_params;
+
+
+typedef void (*layer_kernel)(compose_state *state, const uint16_t *colors,
+  uint16_t layer, const uint16_t *priorities, uint16_t priority);
+typedef void (*effect_kernel)(const compose_state *state,
+  const uint16_t *semi, const blend_params *blend, uint16_t *out);
+
+static layer_kernel layer_pass;
+static effect_kernel effect_pass;
+
+
+
+// Scalar reference of both passes, one pixel at a time
+
+static void layer_scalar(compose_state *state, const uint16_t *colors,
+  uint16_t layer, const uint16_t *priorities, uint16_t priority)
+{
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+  {
+    if (!(colors[x] & OPAQUE) || !(state->window[x] & layer) ||
+      (priorities && priorities[x] != priority))
+      continue;
+
+    state->second[x] = state->top[x];
+    state->second_layer[x] = state->top_layer[x];
+    state->top[x] = colors[x];
+    state->top_layer[x] = layer;
+  }
+}
+
+
+static inline uint16_t channel_min(uint16_t value)
+{
+  return value > 31 ? 31 : value;
+}
+
+static void effect_scalar(const compose_state *state, const uint16_t *semi,
+  const blend_params *blend, uint16_t *out)
+{
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+  {
+    uint16_t top = state->top[x];
+    bool enabled = state->window[x] & LAYER_EFFECTS;
+    bool first = state->top_layer[x] & blend->first;
+    bool second = state->second_layer[x] & blend->second;
+
+    // Semi-transparent OBJs blend whatever the effect and 1st targets are
+    bool alpha = enabled && second && (semi[x] ||
+      (blend->effect == BLD_ALPHA && first));
+
+    uint16_t below = state->second[x];
+    uint16_t color = 0;
+    for (uint8_t shift = 0; shift < 15; shift += 5)
+    {
+      uint16_t a = (top >> shift) & 0x1F;
+      uint16_t b = (below >> shift) & 0x1F;
+      uint16_t c;
+
+      if (alpha)
+        c = channel_min((a * blend->eva + b * blend->evb) >> 4);
+      else if (enabled && first && blend->effect == BLD_BRIGHTER)
+        c = a + (((31 - a) * blend->evy) >> 4);
+      else if (enabled && first && blend->effect == BLD_DARKER)
+        c = a - ((a * blend->evy) >> 4);
+      else
+        c = a;
+
+      color |= c << shift;
+    }
+
+    out[x] = color;
+  }
+}
+
+
+#ifdef RENDER_X86
+
+// Helpers shared by the SSE2 and AVX2 passes. A mask lane is all ones or
+// all zeros, select picks a where it is set and b elsewhere.
+#define SELECT(and, andnot, or, mask, a, b) \
+  or(and(mask, a), andnot(mask, b))
+
+
+static void layer_sse2(compose_state *state, const uint16_t *colors,
+  uint16_t layer, const uint16_t *priorities, uint16_t priority)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi16((int16_t)OPAQUE);
+  __m128i layer_bits = _mm_set1_epi16(layer);
+  __m128i wanted = _mm_set1_epi16(priority);
+
+  for (uint32_t x = 0; x < SCREEN_WIDTH; x += 8)
+  {
+    __m128i color = _mm_loadu_si128((const __m128i *)&colors[x]);
+    __m128i window = _mm_loadu_si128((const __m128i *)&state->window[x]);
+
+    __m128i visible = _mm_andnot_si128(
+      _mm_cmpeq_epi16(_mm_and_si128(color, opaque), zero),
+      _mm_xor_si128(_mm_cmpeq_epi16(_mm_and_si128(window, layer_bits), zero),
+      _mm_set1_epi16(-1)));
+    if (priorities)
+      visible = _mm_and_si128(visible, _mm_cmpeq_epi16(wanted,
+        _mm_loadu_si128((const __m128i *)&priorities[x])));
+
+    __m128i top = _mm_loadu_si128((const __m128i *)&state->top[x]);
+    __m128i top_layer = _mm_loadu_si128((const __m128i *)&state->top_layer[x]);
+    __m128i second = _mm_loadu_si128((const __m128i *)&state->second[x]);
+    __m128i second_layer =
+      _mm_loadu_si128((const __m128i *)&state->second_layer[x]);
+
+    second = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+      visible, top, second);
+    second_layer = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+      visible, top_layer, second_layer);
+    top = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+      visible, color, top);
+    top_layer = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+      visible, layer_bits, top_layer);
+
+    _mm_storeu_si128((__m128i *)&state->top[x], top);
+    _mm_storeu_si128((__m128i *)&state->top_layer[x], top_layer);
+    _mm_storeu_si128((__m128i *)&state->second[x], second);
+    _mm_storeu_si128((__m128i *)&state->second_layer[x], second_layer);
+  }
+}
+
+
+// The three effects on 5 bit channels, 8 pixels at a time: every result is
+// computed and the masks pick one
+static void effect_sse2(const compose_state *state, const uint16_t *semi,
+  const blend_params *blend, uint16_t *out)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(-1);
+  const __m128i channel = _mm_set1_epi16(0x1F);
+  __m128i eva = _mm_set1_epi16(blend->eva);
+  __m128i evb = _mm_set1_epi16(blend->evb);
+  __m128i evy = _mm_set1_epi16(blend->evy);
+  __m128i first_targets = _mm_set1_epi16(blend->first);
+  __m128i second_targets = _mm_set1_epi16(blend->second);
+  __m128i effect_alpha = _mm_set1_epi16(
+    blend->effect == BLD_ALPHA ? -1 : 0);
+  __m128i effect_brighter = _mm_set1_epi16(
+    blend->effect == BLD_BRIGHTER ? -1 : 0);
+  __m128i effect_darker = _mm_set1_epi16(
+    blend->effect == BLD_DARKER ? -1 : 0);
+
+  for (uint32_t x = 0; x < SCREEN_WIDTH; x += 8)
+  {
+    __m128i top = _mm_loadu_si128((const __m128i *)&state->top[x]);
+    __m128i below = _mm_loadu_si128((const __m128i *)&state->second[x]);
+    __m128i window = _mm_loadu_si128((const __m128i *)&state->window[x]);
+    __m128i top_layer = _mm_loadu_si128((const __m128i *)&state->top_layer[x]);
+    __m128i second_layer =
+      _mm_loadu_si128((const __m128i *)&state->second_layer[x]);
+    __m128i semi_mask = _mm_loadu_si128((const __m128i *)&semi[x]);
+
+    __m128i enabled = _mm_xor_si128(ones, _mm_cmpeq_epi16(zero,
+      _mm_and_si128(window, _mm_set1_epi16(LAYER_EFFECTS))));
+    __m128i first = _mm_and_si128(enabled, _mm_xor_si128(ones,
+      _mm_cmpeq_epi16(zero, _mm_and_si128(top_layer, first_targets))));
+    __m128i second = _mm_xor_si128(ones,
+      _mm_cmpeq_epi16(zero, _mm_and_si128(second_layer, second_targets)));
+
+    __m128i alpha = _mm_and_si128(_mm_and_si128(enabled, second),
+      _mm_or_si128(semi_mask, _mm_and_si128(first, effect_alpha)));
+    __m128i brighter = _mm_andnot_si128(alpha,
+      _mm_and_si128(first, effect_brighter));
+    __m128i darker = _mm_andnot_si128(alpha,
+      _mm_and_si128(first, effect_darker));
+
+    __m128i color = zero;
+    for (uint8_t shift = 0; shift < 15; shift += 5)
+    {
+      __m128i count = _mm_cvtsi32_si128(shift);
+      __m128i a = _mm_and_si128(_mm_srl_epi16(top, count), channel);
+      __m128i b = _mm_and_si128(_mm_srl_epi16(below, count), channel);
+
+      __m128i blended = _mm_min_epi16(channel, _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(a, eva), _mm_mullo_epi16(b, evb)), 4));
+      __m128i up = _mm_add_epi16(a, _mm_srli_epi16(
+        _mm_mullo_epi16(_mm_sub_epi16(channel, a), evy), 4));
+      __m128i down = _mm_sub_epi16(a, _mm_srli_epi16(
+        _mm_mullo_epi16(a, evy), 4));
+
+      __m128i c = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+        alpha, blended, a);
+      c = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+        brighter, up, c);
+      c = SELECT(_mm_and_si128, _mm_andnot_si128, _mm_or_si128,
+        darker, down, c);
+
+      color = _mm_or_si128(color, _mm_sll_epi16(c, count));
+    }
+
+    _mm_storeu_si128((__m128i *)&out[x], color);
+  }
+}
+
+
+// The same two passes, 16 pixels at a time
+__attribute__((target("avx2")))
+static void layer_avx2(compose_state *state, const uint16_t *colors,
+  uint16_t layer, const uint16_t *priorities, uint16_t priority)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi16((int16_t)OPAQUE);
+  __m256i layer_bits = _mm256_set1_epi16(layer);
+  __m256i wanted = _mm256_set1_epi16(priority);
+
+  for (uint32_t x = 0; x < SCREEN_WIDTH; x += 16)
+  {
+    __m256i color = _mm256_loadu_si256((const __m256i *)&colors[x]);
+    __m256i window = _mm256_loadu_si256((const __m256i *)&state->window[x]);
+
+    __m256i visible = _mm256_andnot_si256(
+      _mm256_cmpeq_epi16(_mm256_and_si256(color, opaque), zero),
+      _mm256_xor_si256(_mm256_cmpeq_epi16(
+      _mm256_and_si256(window, layer_bits), zero), _mm256_set1_epi16(-1)));
+    if (priorities)
+      visible = _mm256_and_si256(visible, _mm256_cmpeq_epi16(wanted,
+        _mm256_loadu_si256((const __m256i *)&priorities[x])));
+
+    __m256i top = _mm256_loadu_si256((const __m256i *)&state->top[x]);
+    __m256i top_layer =
+      _mm256_loadu_si256((const __m256i *)&state->top_layer[x]);
+    __m256i second = _mm256_loadu_si256((const __m256i *)&state->second[x]);
+    __m256i second_layer =
+      _mm256_loadu_si256((const __m256i *)&state->second_layer[x]);
+
+    second = _mm256_blendv_epi8(second, top, visible);
+    second_layer = _mm256_blendv_epi8(second_layer, top_layer, visible);
+    top = _mm256_blendv_epi8(top, color, visible);
+    top_layer = _mm256_blendv_epi8(top_layer, layer_bits, visible);
+
+    _mm256_storeu_si256((__m256i *)&state->top[x], top);
+    _mm256_storeu_si256((__m256i *)&state->top_layer[x], top_layer);
+    _mm256_storeu_si256((__m256i *)&state->second[x], second);
+    _mm256_storeu_si256((__m256i *)&state->second_layer[x], second_layer);
+  }
+}
+
+
+__attribute__((target("avx2")))
+static void effect_avx2(const compose_state *state, const uint16_t *semi,
+  const blend_params *blend, uint16_t *out)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(-1);
+  const __m256i channel = _mm256_set1_epi16(0x1F);
+  __m256i eva = _mm256_set1_epi16(blend->eva);
+  __m256i evb = _mm256_set1_epi16(blend->evb);
+  __m256i evy = _mm256_set1_epi16(blend->evy);
+  __m256i first_targets = _mm256_set1_epi16(blend->first);
+  __m256i second_targets = _mm256_set1_epi16(blend->second);
+  __m256i effect_alpha = _mm256_set1_epi16(
+    blend->effect == BLD_ALPHA ? -1 : 0);
+  __m256i effect_brighter = _mm256_set1_epi16(
+    blend->effect == BLD_BRIGHTER ? -1 : 0);
+  __m256i effect_darker = _mm256_set1_epi16(
+    blend->effect == BLD_DARKER ? -1 : 0);
+
+  for (uint32_t x = 0; x < SCREEN_WIDTH; x += 16)
+  {
+    __m256i top = _mm256_loadu_si256((const __m256i *)&state->top[x]);
+    __m256i below = _mm256_loadu_si256((const __m256i *)&state->second[x]);
+    __m256i window = _mm256_loadu_si256((const __m256i *)&state->window[x]);
+    __m256i top_layer =
+      _mm256_loadu_si256((const __m256i *)&state->top_layer[x]);
+    __m256i second_layer =
+      _mm256_loadu_si256((const __m256i *)&state->second_layer[x]);
+    __m256i semi_mask = _mm256_loadu_si256((const __m256i *)&semi[x]);
+
+    __m256i enabled = _mm256_xor_si256(ones, _mm256_cmpeq_epi16(zero,
+      _mm256_and_si256(window, _mm256_set1_epi16(LAYER_EFFECTS))));
+    __m256i first = _mm256_and_si256(enabled, _mm256_xor_si256(ones,
+      _mm256_cmpeq_epi16(zero, _mm256_and_si256(top_layer, first_targets))));
+    __m256i second = _mm256_xor_si256(ones, _mm256_cmpeq_epi16(zero,
+      _mm256_and_si256(second_layer, second_targets)));
+
+    __m256i alpha = _mm256_and_si256(_mm256_and_si256(enabled, second),
+      _mm256_or_si256(semi_mask, _mm256_and_si256(first, effect_alpha)));
+    __m256i brighter = _mm256_andnot_si256(alpha,
+      _mm256_and_si256(first, effect_brighter));
+    __m256i darker = _mm256_andnot_si256(alpha,
+      _mm256_and_si256(first, effect_darker));
+
+    __m256i color = zero;
+    for (uint8_t shift = 0; shift < 15; shift += 5)
+    {
+      __m128i count = _mm_cvtsi32_si128(shift);
+      __m256i a = _mm256_and_si256(_mm256_srl_epi16(top, count), channel);
+      __m256i b = _mm256_and_si256(_mm256_srl_epi16(below, count), channel);
+
+      __m256i blended = _mm256_min_epi16(channel, _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(a, eva),
+        _mm256_mullo_epi16(b, evb)), 4));
+      __m256i up = _mm256_add_epi16(a, _mm256_srli_epi16(
+        _mm256_mullo_epi16(_mm256_sub_epi16(channel, a), evy), 4));
+      __m256i down = _mm256_sub_epi16(a, _mm256_srli_epi16(
+        _mm256_mullo_epi16(a, evy), 4));
+
+      __m256i c = _mm256_blendv_epi8(a, blended, alpha);
+      c = _mm256_blendv_epi8(c, up, brighter);
+      c = _mm256_blendv_epi8(c, down, darker);
+
+      color = _mm256_or_si256(color, _mm256_sll_epi16(c, count));
+    }
+
+    _mm256_storeu_si256((__m256i *)&out[x], color);
+  }
+}
+
+#endif
+
+
+void render_compose_init()
+{
+  layer_pass = layer_scalar;
+  effect_pass = effect_scalar;
+
+#ifdef RENDER_X86
+  layer_pass = layer_sse2;
+  effect_pass = effect_sse2;
+  if (__builtin_cpu_supports("avx2"))
+  {
+    layer_pass = layer_avx2;
+    effect_pass = effect_avx2;
+  }
+#endif
+}
+
+
+
+static void fill_window(uint16_t *window, uint16_t horizontal, uint16_t mask)
+{
+  uint16_t x1 = WIN_START(horizontal);
+  uint16_t x2 = WIN_END(horizontal);
+  if (x2 > SCREEN_WIDTH || x1 > x2)
+    x2 = SCREEN_WIDTH;
+
+  for (uint16_t x = x1; x < x2; ++x)
+    window[x] = mask;
+}
+
+static bool window_on_line(uint16_t vertical, uint16_t line)
+{
+  uint16_t y1 = WIN_START(vertical);
+  uint16_t y2 = WIN_END(vertical);
+  if (y2 > SCREEN_HEIGHT || y1 > y2)
+    y2 = SCREEN_HEIGHT;
+
+  return line >= y1 && line < y2;
+}
+
+
+// Which layers each pixel shows, spans at a time: outside first, then the
+// OBJ window, window 1 and window 0 over it, from the lowest priority up
+static void build_windows(const line_state *state,
+  const obj_line_buffer *obj, uint16_t *window)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+  uint16_t line = state->line;
+
+  if (!(dispcnt & (DISPCNT_WIN0 | DISPCNT_WIN1 | DISPCNT_OBJ_WIN)))
+  {
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      window[x] = LAYER_ALL;
+    return;
+  }
+
+  uint16_t winin = line_reg(state, REG_WININ);
+  uint16_t winout = line_reg(state, REG_WINOUT);
+
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+    window[x] = winout & LAYER_ALL;
+
+  if (dispcnt & DISPCNT_OBJ_WIN)
+  {
+    uint16_t mask = (winout >> 8) & LAYER_ALL;
+    for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+      if (obj->window[x])
+        window[x] = mask;
+  }
+
+  if ((dispcnt & DISPCNT_WIN1) &&
+    window_on_line(line_reg(state, REG_WIN1V), line))
+    fill_window(window, line_reg(state, REG_WIN1H), (winin >> 8) & LAYER_ALL);
+
+  if ((dispcnt & DISPCNT_WIN0) &&
+    window_on_line(line_reg(state, REG_WIN0V), line))
+    fill_window(window, line_reg(state, REG_WIN0H), winin & LAYER_ALL);
+}
+
+
+static inline uint16_t clamp_coefficient(uint16_t value)
+{
+  value &= 0x1F;
+  return value > 16 ? 16 : value;
+}
+
+
+bool render_has_effects(const line_state *state, const obj_line_buffer *obj)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+
+  return (dispcnt & (DISPCNT_WIN0 | DISPCNT_WIN1 | DISPCNT_OBJ_WIN)) ||
+    BLD_EFFECT(line_reg(state, REG_BLDCNT)) != BLD_NONE ||
+    (obj && (dispcnt & DISPCNT_OBJ) && obj->semi);
+}
+
+
+void render_compose(const line_state *state, const uint16_t *bg[4],
+  const uint8_t priorities[4], const obj_line_buffer *obj, uint32_t *out)
+{
+  static _Thread_local compose_state compose;
+  const uint16_t *pram = (const uint16_t *)video.pram;
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+
+  build_windows(state, obj, compose.window);
+
+  // The backdrop is behind everything and always visible
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+  {
+    compose.top[x] = pram[0];
+    compose.top_layer[x] = LAYER_BD;
+    compose.second[x] = 0;
+    compose.second_layer[x] = 0;
+  }
+
+  // OBJ pixels as colors, their priorities, and which are semi-transparent
+  // (the OBJ window may need them when the OBJ layer itself is off)
+  bool obj_layer = obj && (dispcnt & DISPCNT_OBJ);
+  uint16_t obj_colors[SCREEN_WIDTH];
+  uint16_t obj_priorities[SCREEN_WIDTH];
+  uint16_t semi[SCREEN_WIDTH];
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+  {
+    uint8_t color = obj_layer ? obj->color[x] : 0;
+    obj_colors[x] = color ? pram[256 + color] | OPAQUE : 0;
+    obj_priorities[x] = obj_layer ? obj->flags[x] & OBJ_PIXEL_PRIORITY : 0;
+    semi[x] = (color && (obj->flags[x] & OBJ_PIXEL_SEMI)) ? 0xFFFF : 0;
+  }
+
+  // Back to front: each layer pushes what it covers down to second place.
+  // At equal priority OBJs are in front of BGs, and lower BGs in front of
+  // higher ones.
+  for (int8_t priority = 3; priority >= 0; --priority)
+  {
+    for (int8_t layer = 3; layer >= 0; --layer)
+      if (bg[layer] && priorities[layer] == priority)
+        layer_pass(&compose, bg[layer], 1 << layer, NULL, 0);
+
+    if (obj_layer)
+      layer_pass(&compose, obj_colors, LAYER_OBJ, obj_priorities, priority);
+  }
+
+  // The top layer of pixels that were semi-transparent OBJs but got
+  // covered by a BG is not an OBJ any more
+  for (uint32_t x = 0; x < SCREEN_WIDTH; ++x)
+    semi[x] &= compose.top_layer[x] == LAYER_OBJ ? 0xFFFF : 0;
+
+  uint16_t bldcnt = line_reg(state, REG_BLDCNT);
+  uint16_t bldalpha = line_reg(state, REG_BLDALPHA);
+  blend_params blend =
+  {
+    .first = bldcnt & LAYER_ALL,
+    .second = (bldcnt >> 8) & LAYER_ALL,
+    .effect = BLD_EFFECT(bldcnt),
+    .eva = clamp_coefficient(bldalpha),
+    .evb = clamp_coefficient(bldalpha >> 8),
+    .evy = clamp_coefficient(line_reg(state, REG_BLDY)),
+  };
+
+  uint16_t colors[SCREEN_WIDTH];
+  effect_pass(&compose, semi, &blend, colors);
+  palette_direct(colors, out, SCREEN_WIDTH);
+}
@@ -0,0 +1,337 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "render.h"
+#include "tile_cache.h"
+
+
+// OBJ Attribute 0:
+//
+//  Bit   Expl.
+//  0-7   Y-Coordinate           (0-255)
+//  8     Rotation/Scaling Flag  (0=Off, 1=On)
+//  9     When Rotation/Scaling used (Attribute 0, bit 8 set):
+//          Double-Size Flag     (0=Normal, 1=Double)
+//        When Rotation/Scaling not used (Attribute 0, bit 8 cleared):
+//          OBJ Disable          (0=Normal, 1=Not displayed)
+//  10-11 OBJ Mode  (0=Normal, 1=Semi-Transparent, 2=OBJ Window, 3=Prohibited)
+//  12    OBJ Mosaic             (0=Off, 1=On)
+//  13    Colors/Palettes        (0=16/16, 1=256/1)
+//  14-15 OBJ Shape              (0=Square,1=Horizontal,2=Vertical,3=Prohibited)
+//
+// OBJ Attribute 1:
+//
+//  Bit   Expl.
+//  0-8   X-Coordinate           (0-511)
+//  When Rotation/Scaling used (Attribute 0, bit 8 set):
+//    9-13  Rotation/Scaling Parameter Selection (0-31)
+//  When Rotation/Scaling not used (Attribute 0, bit 8 cleared):
+//    12    Horizontal Flip      (0=Normal, 1=Mirrored)
+//    13    Vertical Flip        (0=Normal, 1=Mirrored)
+//  14-15 OBJ Size               (0..3, depends on OBJ Shape)
+//
+// OBJ Attribute 2:
+//
+//  Bit   Expl.
+//  0-9   Character Name          (0-1023=Tile Number)
+//  10-11 Priority relative to BG (0-3; 0=Highest)
+//  12-15 Palette Number   (0-15) (Not used in 256 color/1 palette mode)
+
+#define ATTR0_Y(attr)         ((attr) & 0xFF)
+#define ATTR0_AFFINE          0x0100
+#define ATTR0_DOUBLE          0x0200
+#define ATTR0_DISABLE         0x0200
+#define ATTR0_MODE(attr)      (((attr) >> 10) & 0x3)
+#define ATTR0_256_COLORS      0x2000
+#define ATTR0_SHAPE(attr)     (((attr) >> 14) & 0x3)
+
+#define ATTR1_X(attr)         ((attr) & 0x1FF)
+#define ATTR1_PARAMETER(attr) (((attr) >> 9) & 0x1F)
+#define ATTR1_HFLIP           0x1000
+#define ATTR1_VFLIP           0x2000
+#define ATTR1_SIZE(attr)      (((attr) >> 14) & 0x3)
+
+#define ATTR2_TILE(attr)      ((attr) & 0x3FF)
+#define ATTR2_PRIORITY(attr)  (((attr) >> 10) & 0x3)
+#define ATTR2_PALETTE(attr)   (((attr) >> 8) & 0xF0)
+
+#define OBJ_MODE_NORMAL       0
+#define OBJ_MODE_SEMI         1
+#define OBJ_MODE_WINDOW       2
+
+#define OBJ_COUNT             128
+#define OBJ_VRAM              0x10000
+
+// Bitmap modes keep the first half of OBJ VRAM for their frames
+#define BITMAP_FIRST_TILE     512
+
+// Cycles the OBJ unit has per line, with and without H-Blank Interval Free
+#define OBJ_CYCLES            1210
+#define OBJ_CYCLES_HBLANK     954
+
+
+// Width and height of each shape and size
+static const uint8_t obj_sizes[4][4][2] =
+{
+  { {  8,  8 }, { 16, 16 }, { 32, 32 }, { 64, 64 } },
+  { { 16,  8 }, { 32,  8 }, { 32, 16 }, { 64, 32 } },
+  { {  8, 16 }, {  8, 32 }, { 16, 32 }, { 32, 64 } },
+  { {  0,  0 }, {  0,  0 }, {  0,  0 }, {  0,  0 } },
+};
+
+
+// The OBJs on each visible line, in OAM order. Rebuilt only when OAM
+// changed: a line then just walks the few that concern it.
+typedef struct
+{
+  uint8_t entries[SCREEN_HEIGHT][OBJ_COUNT];
+  uint8_t count[SCREEN_HEIGHT];
+} obj_lists;
+
+// Host side, derived from OAM
+static obj_lists lists;
+
+
+typedef struct
+{
+  uint16_t attr0;
+  uint16_t attr1;
+  uint16_t attr2;
+  uint8_t width;
+  uint8_t height;
+  uint8_t box_width;    // area covered on screen: twice the size when an
+  uint8_t box_height;   // affine OBJ has the double size flag
+} obj_entry;
+
+
+static bool read_entry(uint8_t index, obj_entry *obj)
+{
+  const uint16_t *attributes = (const uint16_t *)&video.oam[index * 8];
+  obj->attr0 = attributes[0];
+  obj->attr1 = attributes[1];
+  obj->attr2 = attributes[2];
+
+  bool affine = obj->attr0 & ATTR0_AFFINE;
+  if (!affine && (obj->attr0 & ATTR0_DISABLE))
+    return false;
+
+  const uint8_t *size = obj_sizes[ATTR0_SHAPE(obj->attr0)]
+    [ATTR1_SIZE(obj->attr1)];
+  obj->width = size[0];
+  obj->height = size[1];
+
+  uint8_t scale = (affine && (obj->attr0 & ATTR0_DOUBLE)) ? 2 : 1;
+  obj->box_width = obj->width * scale;
+  obj->box_height = obj->height * scale;
+
+  return obj->width && ATTR0_MODE(obj->attr0) != 3;
+}
+
+
+static void build_lists()
+{
+  memset(lists.count, 0, sizeof(lists.count));
+
+  for (uint8_t index = 0; index < OBJ_COUNT; ++index)
+  {
+    obj_entry obj;
+    if (!read_entry(index, &obj))
+      continue;
+
+    // Y wraps at 256: an OBJ near the bottom comes back at the top
+    uint8_t y = ATTR0_Y(obj.attr0);
+    for (uint8_t row = 0; row < obj.box_height; ++row)
+    {
+      uint8_t line = (y + row) & 0xFF;
+      if (line < SCREEN_HEIGHT)
+        lists.entries[line][lists.count[line]++] = index;
+    }
+  }
+}
+
+
+void render_obj_sync()
+{
+  bool changed = false;
+  for (uint32_t word = 0; word < OAM_DIRTY_WORDS; ++word)
+  {
+    if (video.stale.oam[word])
+    {
+      changed = true;
+      video.stale.oam[word] = 0;
+    }
+  }
+
+  if (changed)
+    build_lists();
+}
+
+
+
+// A pixel is drawn unless an earlier OBJ with the same or a higher priority
+// is already there. OBJ window pixels only go to the window mask.
+static inline void plot(obj_line_buffer *out, uint16_t x, uint8_t color,
+  uint8_t flags, bool window)
+{
+  if (!color)
+    return;
+
+  if (window)
+  {
+    out->window[x] = 1;
+    return;
+  }
+
+  if (!out->color[x] ||
+    (flags & OBJ_PIXEL_PRIORITY) < (out->flags[x] & OBJ_PIXEL_PRIORITY))
+  {
+    out->color[x] = color;
+    out->flags[x] = flags;
+  }
+}
+
+
+// Tile number of a tile column and row of the OBJ. In 2D mapping the tiles
+// are laid out in a 32x32 tile sheet, in 1D mapping they follow each other.
+static inline uint32_t tile_address(const obj_entry *obj, bool mapping_1d,
+  uint8_t column, uint8_t row)
+{
+  bool color256 = obj->attr0 & ATTR0_256_COLORS;
+  uint32_t tile = ATTR2_TILE(obj->attr2);
+  uint8_t step = color256 ? 2 : 1;
+
+  if (mapping_1d)
+    tile += row * (obj->width / 8) * step + column * step;
+  else
+    tile = ((color256 ? tile & ~1 : tile) + row * 32 + column * step);
+
+  return OBJ_VRAM + (tile & 0x3FF) * 32;
+}
+
+
+static void render_regular(const obj_entry *obj, int16_t x, uint8_t row,
+  bool mapping_1d, uint8_t flags, bool window, obj_line_buffer *out)
+{
+  bool color256 = obj->attr0 & ATTR0_256_COLORS;
+  bool hflip = obj->attr1 & ATTR1_HFLIP;
+  uint8_t palette = color256 ? 0 : ATTR2_PALETTE(obj->attr2);
+  uint8_t columns = obj->width / 8;
+
+  if (obj->attr1 & ATTR1_VFLIP)
+    row = obj->height - 1 - row;
+
+  for (uint8_t column = 0; column < columns; ++column)
+  {
+    int16_t start = x + column * 8;
+    if (start + 8 <= 0 || start >= SCREEN_WIDTH)
+      continue;
+
+    // Mirrored, the last tile comes first
+    uint8_t tile_column = hflip ? columns - 1 - column : column;
+    const uint8_t *pixels = tile_cache_get(
+      tile_address(obj, mapping_1d, tile_column, row / 8), color256, hflip) +
+      (row & 7) * 8;
+
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+      int16_t screen_x = start + i;
+      if (screen_x >= 0 && screen_x < SCREEN_WIDTH && pixels[i])
+        plot(out, screen_x, palette | pixels[i], flags, window);
+    }
+  }
+}
+
+
+static void render_affine(const obj_entry *obj, int16_t x, uint8_t row,
+  bool mapping_1d, uint8_t flags, bool window, obj_line_buffer *out)
+{
+  bool color256 = obj->attr0 & ATTR0_256_COLORS;
+  uint32_t tile = ATTR2_TILE(obj->attr2);
+
+  affine_obj texture =
+  {
+    .tile = (!mapping_1d && color256) ? tile & ~1 : tile,
+    .width = obj->width,
+    .height = obj->height,
+    .row_shift = mapping_1d ?
+      __builtin_ctz(obj->width / 8) + color256 : 5,
+    .color256 = color256,
+    .palette = color256 ? 0 : ATTR2_PALETTE(obj->attr2),
+  };
+
+  // PA-PD are in the fourth halfword of 4 consecutive OAM entries
+  const int16_t *parameters = (const int16_t *)
+    &video.oam[ATTR1_PARAMETER(obj->attr1) * 32 + 6];
+  int32_t pa = parameters[0];
+  int32_t pb = parameters[4];
+  int32_t pc = parameters[8];
+  int32_t pd = parameters[12];
+
+  // Only the part of the box that is on screen
+  int16_t first = x < 0 ? -x : 0;
+  int16_t last = x + obj->box_width > SCREEN_WIDTH ?
+    SCREEN_WIDTH - x : obj->box_width;
+  if (first >= last)
+    return;
+
+  // Rotation is around the centre of the box, in 8.8 fixed point
+  int32_t dy = row - obj->box_height / 2;
+  int32_t dx = first - obj->box_width / 2;
+  int32_t tex_x = pa * dx + pb * dy + (obj->width << 7);
+  int32_t tex_y = pc * dx + pd * dy + (obj->height << 7);
+
+  uint8_t colors[128 + 8];
+  render_affine_obj(&texture, tex_x, tex_y, pa, pc, last - first, colors);
+
+  for (int16_t i = first; i < last; ++i)
+    plot(out, x + i, colors[i - first], flags, window);
+}
+
+
+void render_obj_line(const line_state *state, obj_line_buffer *out)
+{
+  uint16_t dispcnt = line_reg(state, REG_DISPCNT);
+  uint16_t line = state->line;
+
+  memset(out, 0, sizeof(*out));
+
+  bool mapping_1d = dispcnt & DISPCNT_OBJ_1D;
+  bool bitmap = DISPCNT_MODE(dispcnt) >= 3;
+  int32_t cycles = (dispcnt & DISPCNT_HBLANK_FREE) ?
+    OBJ_CYCLES_HBLANK : OBJ_CYCLES;
+
+  for (uint8_t i = 0; i < lists.count[line]; ++i)
+  {
+    obj_entry obj;
+    if (!read_entry(lists.entries[line][i], &obj))
+      continue;
+
+    bool affine = obj.attr0 & ATTR0_AFFINE;
+
+    // Every OBJ on the line costs its width, twice over plus 10 when it
+    // is affine. What does not fit any more is not drawn.
+    cycles -= affine ? 10 + obj.box_width * 2 : obj.width;
+    if (cycles < 0)
+      break;
+
+    if (bitmap && ATTR2_TILE(obj.attr2) < BITMAP_FIRST_TILE)
+      continue;
+
+    int16_t x = ATTR1_X(obj.attr1);
+    if (x >= 256)
+      x -= 512;
+    uint8_t row = (line - ATTR0_Y(obj.attr0)) & 0xFF;
+
+    uint8_t mode = ATTR0_MODE(obj.attr0);
+    uint8_t flags = ATTR2_PRIORITY(obj.attr2) |
+      (mode == OBJ_MODE_SEMI ? OBJ_PIXEL_SEMI : 0);
+    bool window = mode == OBJ_MODE_WINDOW;
+    out->semi |= mode == OBJ_MODE_SEMI;
+
+    if (affine)
+      render_affine(&obj, x, row, mapping_1d, flags, window, out);
+    else
+      render_regular(&obj, x, row, mapping_1d, flags, window, out);
+  }
+}
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "render_queue.h"
+#include "render.h"
+#include "tile_cache.h"
+#include "arena.h"
+
+
+// Video memory goes over in 32 byte blocks: VRAM, then PRAM, then OAM
+#define BLOCK_SIZE    32
+#define VRAM_BLOCKS   (sizeof(arena.vram) / BLOCK_SIZE)
+#define PRAM_BLOCKS   (sizeof(arena.bg_obj_pram) / BLOCK_SIZE)
+
+// More than a frame of lines with a few blocks each. A burst of writes (a
+// DMA of a whole tile set) spreads over as many slots as it needs.
+#define QUEUE_SLOTS   256
+#define SLOT_BLOCKS   64
+
+// How many times the render thread looks for the next slot before it goes
+// to sleep: the next line is usually only a few microseconds away
+#define SPIN_ROUNDS   256
+
+
+typedef enum
+{
+  SLOT_MEMORY,      // blocks only, the line goes in a later slot
+  SLOT_LINE,        // blocks, then the line to draw with them
+  SLOT_FRAME        // the last line of the frame is done
+} slot_kind;
+
+typedef struct
+{
+  uint8_t kind;
+  uint8_t count;
+  uint16_t blocks[SLOT_BLOCKS];
+  uint8_t data[SLOT_BLOCKS][BLOCK_SIZE];
+  line_state state;
+} queue_slot;
+
+typedef struct
+{
+  queue_slot slots[QUEUE_SLOTS];
+  queue_slot *filling;            // the slot the CPU side is writing
+  bool threaded;
+
+  // head only moves on the CPU side, tail on the render side
+  _Alignas(64) atomic_uint head;
+  _Alignas(64) atomic_uint tail;
+
+  atomic_bool running;
+  atomic_bool sleeping;           // the render thread waits for a slot
+  atomic_bool waiting;            // the CPU side waits for the tail
+  mtx_t lock;
+  cnd_t wake;
+  cnd_t done;
+  thrd_t thread;
+
+  // With the band pool, the lines wait here until the frame ends or video
+  // memory changes under them
+  line_state pending[SCREEN_HEIGHT];
+  uint32_t pending_count;
+
+  uint32_t *output;               // the framebuffer, or one of the caller's
+  tile_cache_stats tiles;
+} render_queue;
+
+// Host side, not guest state, like everything on the render side
+static render_queue queue;
+static uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+video_memory video;
+
+
+// Render side
+static void draw_pending()
+{
+  if (!queue.pending_count)
+    return;
+
+  render_sync();
+  render_bands_draw(queue.pending, queue.pending_count, queue.output);
+  queue.pending_count = 0;
+}
+
+// The blocks go to the copy, marked stale for the caches
+static void apply(const queue_slot *slot)
+{
+  if (slot->count)
+    draw_pending();
+
+  for (uint32_t i = 0; i < slot->count; ++i)
+  {
+    uint32_t block = slot->blocks[i];
+
+    if (block < VRAM_BLOCKS)
+    {
+      memcpy(&video.vram[block * BLOCK_SIZE], slot->data[i], BLOCK_SIZE);
+      video.stale.tiles[block >> 6] |= 1ull << (block & 63);
+    }
+    else if ((block -= VRAM_BLOCKS) < PRAM_BLOCKS)
+    {
+      memcpy(&video.pram[block * BLOCK_SIZE], slot->data[i], BLOCK_SIZE);
+      video.stale.palette[block >> 2] |= 0xFFFFull << ((block & 3) * 16);
+    }
+    else
+    {
+      block -= PRAM_BLOCKS;
+      memcpy(&video.oam[block * BLOCK_SIZE], slot->data[i], BLOCK_SIZE);
+      video.stale.oam[block >> 4] |= 0xFull << ((block & 15) * 4);
+    }
+  }
+
+  if (slot->kind == SLOT_LINE && render_bands_threads() > 1)
+  {
+    if (queue.pending_count == SCREEN_HEIGHT)
+      draw_pending();
+    queue.pending[queue.pending_count++] = slot->state;
+  }
+  else if (slot->kind == SLOT_LINE)
+  {
+    render_scanline(&slot->state,
+      &queue.output[slot->state.line * SCREEN_WIDTH]);
+  }
+  else if (slot->kind == SLOT_FRAME)
+  {
+    draw_pending();
+    queue.tiles = tile_cache_take_stats();
+  }
+}
+
+
+// Spins for a while, then sleeps until the CPU side queues something.
+// False when the thread has to stop.
+static bool wait_for_slot(uint32_t tail)
+{
+  for (uint32_t round = 0; round < SPIN_ROUNDS; ++round)
+  {
+    if (atomic_load_explicit(&queue.head, memory_order_acquire) != tail)
+      return true;
+    thrd_yield();
+  }
+
+  mtx_lock(&queue.lock);
+  atomic_store(&queue.sleeping, true);
+  while (atomic_load(&queue.head) == tail && atomic_load(&queue.running))
+    cnd_wait(&queue.wake, &queue.lock);
+  atomic_store(&queue.sleeping, false);
+  mtx_unlock(&queue.lock);
+
+  return atomic_load(&queue.head) != tail;
+}
+
+static int render_thread(void *unused)
+{
+  (void)unused;
+  uint32_t tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+
+  while (wait_for_slot(tail))
+  {
+    apply(&queue.slots[tail % QUEUE_SLOTS]);
+    atomic_store(&queue.tail, ++tail);
+
+    if (atomic_load(&queue.waiting))
+    {
+      mtx_lock(&queue.lock);
+      cnd_signal(&queue.done);
+      mtx_unlock(&queue.lock);
+    }
+  }
+
+  return 0;
+}
+
+
+// CPU side. Without the thread there is a single slot, drawn as soon as it
+// is published.
+static queue_slot *next_slot()
+{
+  queue_slot *slot = &queue.slots[0];
+
+  if (queue.threaded)
+  {
+    uint32_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&queue.tail, memory_order_acquire) ==
+      QUEUE_SLOTS)
+    {
+      thrd_yield();
+    }
+    slot = &queue.slots[head % QUEUE_SLOTS];
+  }
+
+  slot->count = 0;
+  return slot;
+}
+
+static void publish(queue_slot *slot)
+{
+  if (!queue.threaded)
+  {
+    apply(slot);
+    return;
+  }
+
+  uint32_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+  atomic_store(&queue.head, head + 1);
+
+  if (atomic_load(&queue.sleeping))
+  {
+    mtx_lock(&queue.lock);
+    cnd_signal(&queue.wake);
+    mtx_unlock(&queue.lock);
+  }
+}
+
+
+static void add_block(uint32_t block)
+{
+  queue_slot *slot = queue.filling;
+  if (slot->count == SLOT_BLOCKS)
+  {
+    slot->kind = SLOT_MEMORY;
+    publish(slot);
+    slot = queue.filling = next_slot();
+  }
+
+  const uint8_t *source;
+  if (block < VRAM_BLOCKS)
+    source = &arena.vram[block * BLOCK_SIZE];
+  else if (block < VRAM_BLOCKS + PRAM_BLOCKS)
+    source = &arena.bg_obj_pram[(block - VRAM_BLOCKS) * BLOCK_SIZE];
+  else
+    source = &arena.oam[(block - VRAM_BLOCKS - PRAM_BLOCKS) * BLOCK_SIZE];
+
+  slot->blocks[slot->count] = block;
+  memcpy(slot->data[slot->count++], source, BLOCK_SIZE);
+}
+
+// Takes the blocks of a stale bitmap whose bits stand for entry_size bytes
+static void collect(uint64_t *stale, uint32_t words, uint32_t entry_size,
+  uint32_t first_block)
+{
+  uint32_t per_block = BLOCK_SIZE / entry_size;
+  uint64_t group = per_block == 64 ? ~0ull : (1ull << per_block) - 1;
+
+  for (uint32_t word = 0; word < words; ++word)
+  {
+    uint64_t bits = stale[word];
+    if (!bits)
+      continue;
+    stale[word] = 0;
+
+    while (bits)
+    {
+      uint32_t bit = __builtin_ctzll(bits) & ~(per_block - 1);
+      add_block(first_block + (word * 64 + bit) / per_block);
+      bits &= ~(group << bit);
+    }
+  }
+}
+
+
+void render_queue_init()
+{
+  render_queue_stop_thread();
+
+  memset(&video, 0, sizeof(video));
+  memset(framebuffer, 0, sizeof(framebuffer));
+  memset(&queue.tiles, 0, sizeof(queue.tiles));
+  queue.output = framebuffer;
+  queue.pending_count = 0;
+}
+
+
+bool render_queue_start_thread()
+{
+  if (queue.threaded)
+    return true;
+
+  atomic_store(&queue.head, 0);
+  atomic_store(&queue.tail, 0);
+  atomic_store(&queue.running, true);
+  atomic_store(&queue.sleeping, false);
+  atomic_store(&queue.waiting, false);
+
+  if (mtx_init(&queue.lock, mtx_plain) != thrd_success)
+    return false;
+  if (cnd_init(&queue.wake) != thrd_success ||
+    cnd_init(&queue.done) != thrd_success ||
+    thrd_create(&queue.thread, render_thread, NULL) != thrd_success)
+  {
+    mtx_destroy(&queue.lock);
+    return false;
+  }
+
+  queue.threaded = true;
+  return true;
+}
+
+
+void render_queue_stop_thread()
+{
+  if (!queue.threaded)
+    return;
+
+  render_queue_wait();
+
+  mtx_lock(&queue.lock);
+  atomic_store(&queue.running, false);
+  cnd_signal(&queue.wake);
+  mtx_unlock(&queue.lock);
+
+  thrd_join(queue.thread, NULL);
+  cnd_destroy(&queue.wake);
+  cnd_destroy(&queue.done);
+  mtx_destroy(&queue.lock);
+  queue.threaded = false;
+}
+
+
+bool render_queue_threaded()
+{
+  return queue.threaded;
+}
+
+
+// What the line needs: the video memory written since the last one (which
+// is everything after init or a loaded state), then the registers
+void render_queue_line(uint16_t line)
+{
+  queue.filling = next_slot();
+
+  collect(arena.stale.tiles, VRAM_DIRTY_WORDS, 32, 0);
+  collect(arena.stale.palette, PRAM_DIRTY_WORDS, 2, VRAM_BLOCKS);
+  collect(arena.stale.oam, OAM_DIRTY_WORDS, 8, VRAM_BLOCKS + PRAM_BLOCKS);
+
+  queue_slot *slot = queue.filling;
+  slot->kind = SLOT_LINE;
+  slot->state.line = line;
+  memcpy(slot->state.regs, arena.io_regs, RENDER_REGS_SIZE);
+  memcpy(slot->state.affine, arena.affine, sizeof(arena.affine));
+  publish(slot);
+}
+
+
+void render_queue_frame()
+{
+  queue_slot *slot = next_slot();
+  slot->kind = SLOT_FRAME;
+  publish(slot);
+}
+
+
+void render_queue_wait()
+{
+  if (!queue.threaded)
+    return;
+
+  uint32_t head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+  if (atomic_load(&queue.tail) == head)
+    return;
+
+  mtx_lock(&queue.lock);
+  atomic_store(&queue.waiting, true);
+  while (atomic_load(&queue.tail) != head)
+    cnd_wait(&queue.done, &queue.lock);
+  atomic_store(&queue.waiting, false);
+  mtx_unlock(&queue.lock);
+}
+
+
+void render_queue_set_output(uint32_t *pixels)
+{
+  queue.output = pixels ? pixels : framebuffer;
+}
+
+
+const uint32_t *render_queue_framebuffer()
+{
+  return queue.output;
+}
+
+
+const tile_cache_stats *render_queue_tile_stats()
+{
+  return &queue.tiles;
+}
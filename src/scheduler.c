@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "arena.h"
+
+
+#define sched arena.scheduler
+
+static event_handler handlers[EVENT_COUNT];
+
+
+static inline bool before(const scheduled_event *a, const scheduled_event *b)
+{
+  // Ties go by event type, so the order never depends on the heap history
+  return a->timestamp < b->timestamp ||
+    (a->timestamp == b->timestamp && a->type < b->type);
+}
+
+static inline void place(uint8_t index, scheduled_event event)
+{
+  sched.heap[index] = event;
+  sched.position[event.type] = index;
+}
+
+
+static void sift_up(uint8_t index)
+{
+  scheduled_event event = sched.heap[index];
+  while (index > 0)
+  {
+    uint8_t parent = (index - 1) / 2;
+    if (!before(&event, &sched.heap[parent]))
+      break;
+    place(index, sched.heap[parent]);
+    index = parent;
+  }
+  place(index, event);
+}
+
+
+static void sift_down(uint8_t index)
+{
+  scheduled_event event = sched.heap[index];
+  for (;;)
+  {
+    uint8_t child = index * 2 + 1;
+    if (child >= sched.size)
+      break;
+    if (child + 1 < sched.size && before(&sched.heap[child + 1], &sched.heap[child]))
+      child++;
+    if (!before(&sched.heap[child], &event))
+      break;
+    place(index, sched.heap[child]);
+    index = child;
+  }
+  place(index, event);
+}
+
+
+static inline void update_next()
+{
+  sched.next = sched.size ? sched.heap[0].timestamp : UINT64_MAX;
+}
+
+
+
+void scheduler_init()
+{
+  sched.size = 0;
+  memset(sched.position, -1, sizeof(sched.position));
+  update_next();
+}
+
+
+void scheduler_register(event_type type, event_handler handler)
+{
+  handlers[type] = handler;
+}
+
+
+void scheduler_schedule(event_type type, uint64_t timestamp)
+{
+  int8_t index = sched.position[type];
+
+  if (index < 0)
+  {
+    index = sched.size++;
+    place(index, (scheduled_event){ timestamp, type });
+    sift_up(index);
+  }
+  else
+  {
+    // Already pending: move it
+    uint64_t old = sched.heap[index].timestamp;
+    sched.heap[index].timestamp = timestamp;
+    if (timestamp < old)
+      sift_up(index);
+    else
+      sift_down(index);
+  }
+
+  update_next();
+}
+
+
+void scheduler_cancel(event_type type)
+{
+  int8_t index = sched.position[type];
+  if (index < 0)
+    return;
+
+  sched.position[type] = -1;
+  if (index != --sched.size)
+  {
+    // The last leaf fills the hole and may have to go either way
+    uint8_t moved = sched.heap[sched.size].type;
+    place(index, sched.heap[sched.size]);
+    sift_down(index);
+    sift_up(sched.position[moved]);
+  }
+
+  update_next();
+}
+
+
+bool scheduler_is_scheduled(event_type type)
+{
+  return sched.position[type] >= 0;
+}
+
+
+uint64_t scheduler_deadline(event_type type)
+{
+  int8_t index = sched.position[type];
+  return index < 0 ? UINT64_MAX : sched.heap[index].timestamp;
+}
+
+
+uint64_t scheduler_now()
+{
+  return arena.emu.cycles;
+}
+
+
+uint64_t scheduler_next()
+{
+  return sched.next;
+}
+
+
+void scheduler_dispatch()
+{
+  while (sched.size && sched.heap[0].timestamp <= arena.emu.cycles)
+  {
+    scheduled_event event = sched.heap[0];
+
+    // Pop before calling: the handler is free to schedule itself again
+    sched.position[event.type] = -1;
+    if (--sched.size)
+    {
+      place(0, sched.heap[sched.size]);
+      sift_down(0);
+    }
+    update_next();
+
+    handlers[event.type](event.timestamp);
+  }
+}
@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "tile_cache.h"
+#include "render.h"
+
+
+// Every tile is decoded once, both ways round, and stays until one of the
+// 32 byte blocks it is made of gets written to: a 16 color tile is one block,
+// a 256 color tile is two.
+//
+// The bands of a frame may look tiles up on several threads at once. The
+// first one to miss a tile claims and decodes it; the others that miss it
+// meanwhile decode their own copy. Invalidation only happens between bands.
+typedef struct
+{
+  uint8_t pixels4[TILE_CACHE_BLOCKS][2][64];
+  uint8_t pixels8[TILE_CACHE_BLOCKS][2][64];
+  atomic_uint_least64_t valid4[TILE_CACHE_BLOCKS / 64];
+  atomic_uint_least64_t valid8[TILE_CACHE_BLOCKS / 64];
+  atomic_uint_least64_t claimed4[TILE_CACHE_BLOCKS / 64];
+  atomic_uint_least64_t claimed8[TILE_CACHE_BLOCKS / 64];
+  atomic_uint hits;
+  atomic_uint misses;
+} tile_cache;
+
+// Host side, not guest state: a loaded save state only needs it dropped
+static tile_cache cache;
+
+// Each thread counts on its own, and decodes the tiles it could not claim
+static _Thread_local tile_cache_stats counts;
+static _Thread_local uint8_t unclaimed[2][64];
+
+
+// Only while no other thread looks tiles up
+static inline void drop(atomic_uint_least64_t *word, uint64_t bits)
+{
+  uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+  atomic_store_explicit(word, value & ~bits, memory_order_relaxed);
+}
+
+
+void tile_cache_init()
+{
+  for (uint32_t word = 0; word < TILE_CACHE_BLOCKS / 64; ++word)
+  {
+    atomic_store(&cache.valid4[word], 0);
+    atomic_store(&cache.valid8[word], 0);
+    atomic_store(&cache.claimed4[word], 0);
+    atomic_store(&cache.claimed8[word], 0);
+  }
+  atomic_store(&cache.hits, 0);
+  atomic_store(&cache.misses, 0);
+  memset(&counts, 0, sizeof(counts));
+}
+
+
+void tile_cache_sync()
+{
+  for (uint32_t word = 0; word < TILE_CACHE_BLOCKS / 64; ++word)
+  {
+    uint64_t stale = video.stale.tiles[word];
+    if (!stale)
+      continue;
+    video.stale.tiles[word] = 0;
+
+    // A block is the whole of its 16 color tile, and the second half of the
+    // 256 color tile that starts one block earlier
+    uint64_t stale8 = stale | (stale >> 1);
+    drop(&cache.valid4[word], stale);
+    drop(&cache.claimed4[word], stale);
+    drop(&cache.valid8[word], stale8);
+    drop(&cache.claimed8[word], stale8);
+    if (word && (stale & 1))
+    {
+      drop(&cache.valid8[word - 1], 1ull << 63);
+      drop(&cache.claimed8[word - 1], 1ull << 63);
+    }
+  }
+}
+
+
+static void decode_4bpp(uint32_t block, uint8_t pixels[2][64])
+{
+  uint8_t *normal = pixels[0];
+  uint8_t *flipped = pixels[1];
+
+  for (uint8_t row = 0; row < 8; ++row)
+  {
+    uint32_t nibbles;
+    memcpy(&nibbles, &video.vram[block * 32 + row * 4], 4);
+
+    // Leftmost pixel in the low nibble
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+      uint8_t color = (nibbles >> (i * 4)) & 0xF;
+      normal[row * 8 + i] = color;
+      flipped[row * 8 + 7 - i] = color;
+    }
+  }
+}
+
+static void decode_8bpp(uint32_t block, uint8_t pixels[2][64])
+{
+  uint8_t *normal = pixels[0];
+  uint8_t *flipped = pixels[1];
+
+  // The last block has no second half to read: the hardware returns zeros
+  uint32_t length = (block + 1 < TILE_CACHE_BLOCKS) ? 64 : 32;
+  memset(normal, 0, 64);
+  memcpy(normal, &video.vram[block * 32], length);
+
+  for (uint8_t row = 0; row < 8; ++row)
+  {
+    uint64_t bytes;
+    memcpy(&bytes, &normal[row * 8], 8);
+    bytes = __builtin_bswap64(bytes);
+    memcpy(&flipped[row * 8], &bytes, 8);
+  }
+}
+
+
+const uint8_t *tile_cache_get(uint32_t address, bool color256, bool hflip)
+{
+  uint32_t block = address >> 5;
+  uint32_t word = block >> 6;
+  uint64_t bit = 1ull << (block & 63);
+  atomic_uint_least64_t *valid = color256 ? cache.valid8 : cache.valid4;
+  uint8_t (*pixels)[64] = color256 ?
+    cache.pixels8[block] : cache.pixels4[block];
+
+  if (atomic_load_explicit(&valid[word], memory_order_acquire) & bit)
+  {
+    counts.hits++;
+    return pixels[hflip];
+  }
+
+  counts.misses++;
+  atomic_uint_least64_t *claimed = color256 ? cache.claimed8 : cache.claimed4;
+  bool mine = !(atomic_fetch_or_explicit(&claimed[word], bit,
+    memory_order_relaxed) & bit);
+  if (!mine)
+    pixels = unclaimed;
+
+  if (color256)
+    decode_8bpp(block, pixels);
+  else
+    decode_4bpp(block, pixels);
+
+  if (mine)
+    atomic_fetch_or_explicit(&valid[word], bit, memory_order_release);
+  return pixels[hflip];
+}
+
+
+void tile_cache_flush_stats()
+{
+  atomic_fetch_add(&cache.hits, counts.hits);
+  atomic_fetch_add(&cache.misses, counts.misses);
+  memset(&counts, 0, sizeof(counts));
+}
+
+
+tile_cache_stats tile_cache_take_stats()
+{
+  tile_cache_flush_stats();
+
+  tile_cache_stats stats =
+  {
+    .hits = atomic_exchange(&cache.hits, 0),
+    .misses = atomic_exchange(&cache.misses, 0),
+  };
+  return stats;
+}
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "timer.h"
+#include "io.h"
+#include "apu.h"
+#include "arena.h"
+#include "scheduler.h"
+
+
+// TMxCNT_H:
+//
+//  Bit   Expl.
+//  0-1   Prescaler Selection (0=F/1, 1=F/64, 2=F/256, 3=F/1024)
+//  2     Count-up Timing   (0=Normal, 1=See below)  ;Not used in TM0CNT_H
+//  3-5   Not used
+//  6     Timer IRQ Enable  (0=Disable, 1=IRQ on Timer overflow)
+//  7     Timer Start/Stop  (0=Stop, 1=Operate)
+//  8-15  Not used
+
+#define TIMER_CASCADE       0x0004
+#define TIMER_IRQ           0x0040
+#define TIMER_ENABLE        0x0080
+
+// SOUNDCNT_H: left/right enables and timer select of DMA sound A and B
+#define SOUND_A_ENABLE      0x0300
+#define SOUND_A_TIMER       0x0400
+#define SOUND_B_ENABLE      0x3000
+#define SOUND_B_TIMER       0x4000
+
+#define REG(timer, reg) ((reg) + (timer) * TIMER_REG_STRIDE)
+
+
+static const uint8_t prescaler_shifts[4] = { 0, 6, 8, 10 };
+
+
+static inline uint16_t control_of(uint8_t timer)
+{
+  return io_get(REG(timer, REG_TM0CNT_H));
+}
+
+// Enabled and counting cycles, as opposed to stopped or cascaded
+static bool counts_cycles(uint8_t timer)
+{
+  uint16_t control = control_of(timer);
+  return (control & TIMER_ENABLE) && (timer == 0 || !(control & TIMER_CASCADE));
+}
+
+static bool cascades_into(uint8_t timer)
+{
+  return timer < 3 && (control_of(timer + 1) & (TIMER_ENABLE | TIMER_CASCADE)) ==
+    (TIMER_ENABLE | TIMER_CASCADE);
+}
+
+// Whether anybody would notice this timer overflowing
+static bool overflow_observed(uint8_t timer)
+{
+  if (control_of(timer) & TIMER_IRQ)
+    return true;
+  if (cascades_into(timer))
+    return true;
+
+  uint16_t sound = io_get(REG_SOUNDCNT_H);
+  if ((sound & SOUND_A_ENABLE) && !!(sound & SOUND_A_TIMER) == timer)
+    return true;
+  if ((sound & SOUND_B_ENABLE) && !!(sound & SOUND_B_TIMER) == timer)
+    return true;
+
+  return false;
+}
+
+
+// Counter value at a given time: counting past 0xFFFF restarts from the
+// reload value as many times as it takes
+static uint16_t counter_at(uint8_t timer, uint64_t now)
+{
+  timer_channel *t = &arena.timer[timer];
+  if (!counts_cycles(timer))
+    return t->counter;
+
+  uint64_t value = t->counter + ((now - t->start) >> t->shift);
+  if (value > 0xFFFF)
+    value = t->reload + (value - 0x10000) % (0x10000 - t->reload);
+
+  return value;
+}
+
+// Moves the reference point to now, keeping the prescaler phase
+static void latch(uint8_t timer, uint64_t now)
+{
+  timer_channel *t = &arena.timer[timer];
+  uint64_t phase = (now - t->start) & ((1ull << t->shift) - 1);
+
+  t->counter = counter_at(timer, now);
+  t->start = now - phase;
+}
+
+
+static void reschedule(uint8_t timer)
+{
+  timer_channel *t = &arena.timer[timer];
+
+  if (!counts_cycles(timer) || !overflow_observed(timer))
+  {
+    scheduler_cancel(EVENT_TIMER0 + timer);
+    return;
+  }
+
+  // The counter may have wrapped unobserved since `start`
+  latch(timer, scheduler_now());
+  scheduler_schedule(EVENT_TIMER0 + timer,
+    t->start + ((0x10000ull - t->counter) << t->shift));
+}
+
+
+static void overflow(uint8_t timer)
+{
+  uint16_t control = control_of(timer);
+
+  if (control & TIMER_IRQ)
+    io_request_interrupt(IRQ_TIMER0 + timer);
+
+  if (timer < 2)
+    apu_timer_overflow(timer);
+
+  // A cascaded timer counts overflows instead of cycles
+  if (cascades_into(timer))
+  {
+    timer_channel *next = &arena.timer[timer + 1];
+    if (++next->counter == 0)
+    {
+      next->counter = next->reload;
+      overflow(timer + 1);
+    }
+  }
+}
+
+
+static void overflow_event(uint8_t timer, uint64_t timestamp)
+{
+  timer_channel *t = &arena.timer[timer];
+
+  t->counter = t->reload;
+  t->start = timestamp;
+  overflow(timer);
+
+  scheduler_schedule(EVENT_TIMER0 + timer,
+    timestamp + ((0x10000ull - t->reload) << t->shift));
+}
+
+static void timer0_overflow(uint64_t timestamp) { overflow_event(0, timestamp); }
+static void timer1_overflow(uint64_t timestamp) { overflow_event(1, timestamp); }
+static void timer2_overflow(uint64_t timestamp) { overflow_event(2, timestamp); }
+static void timer3_overflow(uint64_t timestamp) { overflow_event(3, timestamp); }
+
+
+
+void timer_init()
+{
+  memset(arena.timer, 0, sizeof(arena.timer));
+
+  scheduler_register(EVENT_TIMER0, timer0_overflow);
+  scheduler_register(EVENT_TIMER1, timer1_overflow);
+  scheduler_register(EVENT_TIMER2, timer2_overflow);
+  scheduler_register(EVENT_TIMER3, timer3_overflow);
+}
+
+
+uint16_t timer_read_counter(uint8_t timer)
+{
+  return counter_at(timer, scheduler_now());
+}
+
+
+void timer_write_reload(uint8_t timer, uint16_t value)
+{
+  // Only used at the next start or overflow, but counter_at works out the
+  // wraps since `start` from the current reload: settle those first
+  if (counts_cycles(timer))
+    latch(timer, scheduler_now());
+
+  arena.timer[timer].reload = value;
+}
+
+
+void timer_write_control(uint8_t timer, uint16_t old, uint16_t value)
+{
+  timer_channel *t = &arena.timer[timer];
+  uint64_t now = scheduler_now();
+
+  // Settle the count under the old settings first
+  io_set(REG(timer, REG_TM0CNT_H), old);
+  latch(timer, now);
+  io_set(REG(timer, REG_TM0CNT_H), value);
+
+  if (!(old & TIMER_ENABLE) && (value & TIMER_ENABLE))
+  {
+    t->counter = t->reload;
+    t->start = now;
+  }
+  else if (t->shift != prescaler_shifts[value & 0x3])
+  {
+    // New prescaler, new phase
+    t->start = now;
+  }
+
+  t->shift = prescaler_shifts[value & 0x3];
+
+  reschedule(timer);
+
+  // This timer starting or stopping to cascade changes who the previous
+  // one has to report to
+  if (timer > 0)
+    reschedule(timer - 1);
+}
+
+
+void timer_sound_changed()
+{
+  reschedule(0);
+  reschedule(1);
+}